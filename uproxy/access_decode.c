@@ -0,0 +1,70 @@
+//turns the proxy's binary access log (-l) back into text, one line per request:
+//	time status cache bytes total_ms connect_ms first_byte_ms uri
+//status, connect_ms and first_byte_ms are - when there were none, and a uri too long for its record ends in ...
+//each thread's records are in order, but threads are written out in turns, so sort on the time for one timeline
+//build from this directory:
+//	gcc -O2 -pthread -Dmain=proxy_main access_decode.c -o access_decode -lz && ./access_decode access.log.1 access.log
+//with no files it reads standard input. the proxy's main is renamed on the command line so this file can provide its own
+#include "uproxy.c"
+#undef main
+
+#include <time.h>
+
+char *cache_results[] = {"-", "memory", "disk", "miss", "shared", "revalidated", "mapped"};
+
+void print_ms(unsigned long us) {
+	if(us == 0) printf(" -");
+	else printf(" %.3f", us / 1000.0);
+}
+
+//prints every record in one log file. returns 0, or -1 if it isn't an access log
+int decode(FILE *fp, char *name) {
+	char magic[sizeof(ACCESS_MAGIC) - 1], when[32];
+	access_record rec;
+	struct tm tm;
+	time_t secs;
+	int len;
+	
+	len = fread(magic, 1, sizeof(magic), fp);
+	if(len == 0) return 0;
+	if(len != sizeof(magic) || memcmp(magic, ACCESS_MAGIC, sizeof(magic)) != 0) {
+		fprintf(stderr, "%s is not an access log this version of the proxy wrote\n", name);
+		return -1;
+	}
+	
+	while(fread(&rec, sizeof(rec), 1, fp) == 1) {
+		secs = rec.time / 1000000;
+		gmtime_r(&secs, &tm);
+		strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+		printf("%s.%06luZ", when, (unsigned long) (rec.time % 1000000));
+		
+		if(rec.status) printf(" %d", rec.status);
+		else printf(" -");
+		printf(" %s %lu", rec.cache < sizeof(cache_results) / sizeof(cache_results[0]) ? cache_results[rec.cache] : "?", (unsigned long) rec.bytes);
+		printf(" %.3f", rec.total_us / 1000.0);
+		print_ms(rec.connect_us);
+		print_ms(rec.first_byte_us);
+		
+		len = rec.uri_len < ACCESS_URI ? rec.uri_len : ACCESS_URI;
+		printf(" %.*s%s\n", len, rec.uri, rec.uri_len > ACCESS_URI ? "..." : "");
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	FILE *fp;
+	int i, failed = 0;
+	
+	if(argc < 2) return decode(stdin, "standard input") < 0;
+	
+	for(i = 1; i < argc; i++) {
+		if((fp = fopen(argv[i], "r")) == NULL) {
+			perror(argv[i]);
+			failed = 1;
+			continue;
+		}
+		if(decode(fp, argv[i]) < 0) failed = 1;
+		fclose(fp);
+	}
+	return failed;
+}
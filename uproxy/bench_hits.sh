@@ -0,0 +1,50 @@
+#!/bin/bash
+# measures cache hit throughput for 1 KB, 1 MB and 100 MB objects
+# usage: ./bench_hits.sh [proxy options...], e.g. ./bench_hits.sh -e or ./bench_hits.sh -m 0 to bench the disk tier alone
+# needs gcc, curl and python3. serves the objects from a local origin on port 8090 and runs the proxy on 8891
+
+PROXY_PORT=8891
+ORIGIN_PORT=8090
+WORK=$(mktemp -d)
+HERE=$(cd "$(dirname "$0")" && pwd)
+
+gcc -O2 -pthread "$HERE/uproxy.c" -o "$WORK/proxy" -lz || exit 1
+
+mkdir -p "$WORK/origin" "$WORK/run"
+head -c 1024 /dev/urandom > "$WORK/origin/1k"
+head -c 1048576 /dev/urandom > "$WORK/origin/1m"
+head -c 104857600 /dev/urandom > "$WORK/origin/100m"
+touch "$WORK/run/blocklist"
+
+(cd "$WORK/origin" && exec python3 -m http.server $ORIGIN_PORT > /dev/null 2>&1) &
+ORIGIN=$!
+(cd "$WORK/run" && exec "$WORK/proxy" "$@" $PROXY_PORT 3600 > /dev/null 2>&1) &
+PROXY=$!
+sleep 1
+
+# fetches an object count times over one connection per fetch and prints the rate
+bench() {
+	url=http://localhost:$ORIGIN_PORT/$1
+	count=$2
+	size=$(stat -c %s "$WORK/origin/$1")
+
+	# the first fetch fills the cache, the second promotes the object to memory when it fits
+	curl -s --proxy localhost:$PROXY_PORT $url -o /dev/null
+	curl -s --proxy localhost:$PROXY_PORT $url -o /dev/null
+
+	start=$(date +%s.%N)
+	for i in $(seq 1 $count); do
+		curl -s --proxy localhost:$PROXY_PORT $url -o /dev/null || echo "fetch of $1 failed"
+	done
+	end=$(date +%s.%N)
+
+	echo "$1 $count $size $start $end" | awk '{ t = $5 - $4; printf "%-5s %5d fetches  %8.1f fetches/s  %9.1f MB/s\n", $1, $2, $2 / t, $2 * $3 / t / 1048576 }'
+}
+
+bench 1k 2000
+bench 1m 500
+bench 100m 10
+
+kill $PROXY $ORIGIN
+wait $PROXY $ORIGIN 2>/dev/null
+rm -rf "$WORK"
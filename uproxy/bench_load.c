@@ -0,0 +1,299 @@
+//load generator for the proxy: threads that each keep a connection to the proxy (or open one per request with -k 0)
+//and send it GETs, back to back, for urls picked from a zipf distribution. reports throughput, latency percentiles,
+//and, given the proxy's admin port and pid, its cache hit ratio and cpu time per request. bench_origin.py serves the
+//urls and bench_load.sh runs the standard set of loads against a fresh proxy
+//build from this directory:
+//	gcc -O2 -pthread -Dmain=proxy_main bench_load.c -o bench_load -lm -lz
+//usage: ./bench_load [-t threads] [-d seconds] [-W warmup seconds] [-n urls] [-s zipf exponent] [-k 0|1]
+//	[-a proxy admin port] [-P proxy pid] <proxy port> <url template, %d is replaced by the url's rank>
+//the proxy's main is renamed on the command line so this file can provide its own, and responses are
+//delimited with the proxy's own parser
+#include "uproxy.c"
+#undef main
+
+#include <time.h>
+#include <math.h>
+
+typedef struct {
+	pthread_t thread;
+	unsigned long seed;
+	unsigned int *lat;		//microseconds each measured request took
+	long nlat, cap;
+	unsigned long bytes, errors, connects;
+} load_thread;
+
+int threads = 16, nurls = 1000, load_keep_alive = 1, proxy_port;
+double duration = 10, warmup = 1, zipf_s = 1.0;
+char *url_template;
+double *zipf_cdf;		//chance of picking a rank up to and including each one
+atomic_int measuring, stopping;
+
+//ranks are picked with a xorshift generator per thread, so the threads don't share any state
+double uniform(unsigned long *seed) {
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+	return (*seed >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void zipf_init(void) {
+	double sum = 0;
+	int i;
+	
+	zipf_cdf = malloc(nurls * sizeof(double));
+	for(i = 0; i < nurls; i++) zipf_cdf[i] = sum += 1 / pow(i + 1, zipf_s);
+	for(i = 0; i < nurls; i++) zipf_cdf[i] /= sum;
+}
+
+int zipf_pick(unsigned long *seed) {
+	double u = uniform(seed);
+	int low = 0, high = nurls - 1, mid;
+	
+	while(low < high) {
+		mid = (low + high) / 2;
+		if(zipf_cdf[mid] < u) low = mid + 1;
+		else high = mid;
+	}
+	return low;
+}
+
+int connect_proxy(int port) {
+	struct sockaddr_in addr;
+	struct timeval wait = {10, 0};
+	int sock = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if(sock < 0 || connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		if(sock >= 0) close(sock);
+		return -1;
+	}
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	
+	//a proxy that stops answering shows up as errors rather than a load that never ends
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+	return sock;
+}
+
+//reads one whole response, counting its bytes. returns its status, or -1 if the connection failed or it was malformed
+int read_response(int sock, char *buf, unsigned long *bytes, int *keep_alive) {
+	response_head rh;
+	body_framer f;
+	int fill = 0, status, n;
+	
+	while((status = parse_response_head(buf, fill, &rh)) == 0) {
+		n = recv(sock, buf + fill, HEADSIZE - fill, 0);
+		if(n <= 0) return -1;
+		fill += n;
+	}
+	if(status < 0) return -1;
+	
+	body_framer_init(&f, &rh);
+	if(body_consume(&f, buf + rh.head_len, fill - rh.head_len, NULL) < 0) return -1;
+	*bytes += fill;
+	while(!f.done) {
+		n = recv(sock, buf, RELAY_BUFSIZE, 0);
+		if(n == 0 && f.mode == BODY_CLOSE) break;
+		if(n <= 0 || body_consume(&f, buf, n, NULL) < 0) return -1;
+		*bytes += n;
+	}
+	*keep_alive = rh.keep_alive && f.mode != BODY_CLOSE;
+	return rh.status;
+}
+
+void *load_func(void *arg) {
+	load_thread *t = arg;
+	char *buf = malloc(RELAY_BUFSIZE > HEADSIZE ? RELAY_BUFSIZE : HEADSIZE), request[BUFSIZE], url[BUFSIZE];
+	unsigned long start, bytes;
+	int sock = -1, len, status, keep_alive, measured;
+	
+	while(!atomic_load(&stopping)) {
+		snprintf(url, sizeof(url), url_template, zipf_pick(&t->seed));
+		len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: bench\r\nConnection: %s\r\n\r\n", url, load_keep_alive ? "keep-alive" : "close");
+		measured = atomic_load(&measuring);
+		
+		if(sock < 0) {
+			if((sock = connect_proxy(proxy_port)) < 0) {
+				if(measured) t->errors++;
+				usleep(1000);
+				continue;
+			}
+			if(measured) t->connects++;
+		}
+		
+		start = now_us();
+		bytes = 0;
+		if(socket_write(sock, request, len) < 0 || (status = read_response(sock, buf, &bytes, &keep_alive)) < 0) {
+			if(measured) t->errors++;
+			close(sock);
+			sock = -1;
+			continue;
+		}
+		if(measured && status != 200) t->errors++;
+		else if(measured) {
+			if(t->nlat == t->cap) {
+				t->cap = t->cap ? 2 * t->cap : 65536;
+				t->lat = realloc(t->lat, t->cap * sizeof(unsigned int));
+			}
+			t->lat[t->nlat++] = now_us() - start;
+			t->bytes += bytes;
+		}
+		
+		if(!load_keep_alive || !keep_alive) {
+			close(sock);
+			sock = -1;
+		}
+	}
+	if(sock >= 0) close(sock);
+	free(buf);
+	return NULL;
+}
+
+//the proxy's cache counters, read from its admin port. read_metrics returns -1 if it can't be reached
+typedef struct {
+	double memory, mapped, disk, misses, coalesced;
+} proxy_counts;
+
+int read_metrics(int port, proxy_counts *counts) {
+	char *body = malloc(METRICS_SIZE), *line, *next;
+	int sock = connect_proxy(port), fill = 0, n;
+	
+	memset(counts, 0, sizeof(*counts));
+	if(body == NULL || sock < 0 || socket_write(sock, "GET /metrics HTTP/1.0\r\n\r\n", 25) < 0) {
+		if(sock >= 0) close(sock);
+		free(body);
+		return -1;
+	}
+	while(fill < METRICS_SIZE - 1 && (n = recv(sock, body + fill, METRICS_SIZE - 1 - fill, 0)) > 0) fill += n;
+	body[fill] = '\0';
+	close(sock);
+	
+	for(line = body; line != NULL; line = next) {
+		next = strchr(line, '\n');
+		if(next) *next++ = '\0';
+		if(strncmp(line, "uproxy_cache_hits_total{tier=\"memory\"} ", 39) == 0) counts->memory = atof(line + 39);
+		else if(strncmp(line, "uproxy_cache_hits_total{tier=\"mapped\"} ", 39) == 0) counts->mapped = atof(line + 39);
+		else if(strncmp(line, "uproxy_cache_hits_total{tier=\"disk\"} ", 37) == 0) counts->disk = atof(line + 37);
+		else if(strncmp(line, "uproxy_cache_misses_total ", 26) == 0) counts->misses = atof(line + 26);
+		else if(strncmp(line, "uproxy_cache_coalesced_total ", 29) == 0) counts->coalesced = atof(line + 29);
+	}
+	free(body);
+	return 0;
+}
+
+//cpu seconds the proxy has used, user and system, or -1 if its pid can't be read
+double proxy_cpu(int pid) {
+	char path[64], stat[1024], *p;
+	unsigned long utime, stime;
+	FILE *fp;
+	int n;
+	
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if((fp = fopen(path, "r")) == NULL) return -1;
+	n = fread(stat, 1, sizeof(stat) - 1, fp);
+	fclose(fp);
+	stat[n > 0 ? n : 0] = '\0';
+	
+	//the command name may hold spaces, so fields are counted from the parenthesis after it. utime and stime are the 14th and 15th
+	if((p = strrchr(stat, ')')) == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) return -1;
+	return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+int compare_lat(const void *a, const void *b) {
+	unsigned int x = *(unsigned int *) a, y = *(unsigned int *) b;
+	
+	return x < y ? -1 : x > y;
+}
+
+double percentile(unsigned int *lat, long n, double q) {
+	long i = (long) (q * n);
+	
+	if(n == 0) return 0;
+	return lat[i < n ? i : n - 1] / 1000.0;
+}
+
+void usage_load(char *prog) {
+	fprintf(stderr, "Usage %s [-t threads] [-d seconds] [-W warmup seconds] [-n urls] [-s zipf exponent] [-k 0|1] [-a proxy admin port] [-P proxy pid] <proxy port> <url template>\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	load_thread *t;
+	proxy_counts before, after;
+	unsigned int *lat;
+	unsigned long bytes = 0, errors = 0, connects = 0;
+	double cpu_before = -1, cpu_after = -1, started, elapsed, hits, lookups;
+	long n = 0;
+	int i, opt, admin = 0, pid = 0, metrics = -1;
+	
+	while((opt = getopt(argc, argv, "t:d:W:n:s:k:a:P:")) != -1) {
+		switch(opt) {
+			case 't': threads = atoi(optarg); break;
+			case 'd': duration = atof(optarg); break;
+			case 'W': warmup = atof(optarg); break;
+			case 'n': nurls = atoi(optarg); break;
+			case 's': zipf_s = atof(optarg); break;
+			case 'k': load_keep_alive = atoi(optarg); break;
+			case 'a': admin = atoi(optarg); break;
+			case 'P': pid = atoi(optarg); break;
+			default: usage_load(argv[0]);
+		}
+	}
+	if(argc - optind != 2 || threads <= 0 || nurls <= 0 || duration <= 0) usage_load(argv[0]);
+	proxy_port = atoi(argv[optind]);
+	url_template = argv[optind + 1];
+	signal(SIGPIPE, SIG_IGN);
+	zipf_init();
+	
+	t = calloc(threads, sizeof(load_thread));
+	for(i = 0; i < threads; i++) {
+		t[i].seed = 0x9e3779b97f4a7c15UL * (i + 1);
+		pthread_create(&t[i].thread, NULL, load_func, &t[i]);
+	}
+	
+	//the warmup fills the cache and opens the connections, and nothing from it is counted
+	usleep(warmup * 1e6);
+	if(admin) metrics = read_metrics(admin, &before);
+	if(pid) cpu_before = proxy_cpu(pid);
+	started = now_us();
+	atomic_store(&measuring, 1);
+	usleep(duration * 1e6);
+	atomic_store(&measuring, 0);
+	elapsed = (now_us() - started) / 1e6;
+	if(pid) cpu_after = proxy_cpu(pid);
+	if(metrics == 0) metrics = read_metrics(admin, &after);
+	atomic_store(&stopping, 1);
+	
+	for(i = 0; i < threads; i++) {
+		pthread_join(t[i].thread, NULL);
+		n += t[i].nlat;
+		bytes += t[i].bytes;
+		errors += t[i].errors;
+		connects += t[i].connects;
+	}
+	lat = malloc((n ? n : 1) * sizeof(unsigned int));
+	for(n = 0, i = 0; i < threads; i++) {
+		memcpy(lat + n, t[i].lat, t[i].nlat * sizeof(unsigned int));
+		n += t[i].nlat;
+	}
+	qsort(lat, n, sizeof(unsigned int), compare_lat);
+	
+	printf("%d threads, %s, %d urls (zipf %.2f), %.1f s\n", threads, load_keep_alive ? "keep-alive" : "connection per request", nurls, zipf_s, elapsed);
+	printf("requests: %ld (%.1f/s), %.1f MB/s, %lu errors, %lu connections opened\n", n, n / elapsed, bytes / elapsed / 1048576, errors, connects);
+	printf("latency: p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n", percentile(lat, n, 0.5), percentile(lat, n, 0.99), percentile(lat, n, 0.999), percentile(lat, n, 1));
+	if(metrics == 0) {
+		hits = (after.memory - before.memory) + (after.mapped - before.mapped) + (after.disk - before.disk);
+		lookups = hits + (after.misses - before.misses);
+		printf("cache: %.1f%% hits (%.1f%% memory, %.1f%% mapped, %.1f%% disk), %.0f misses, %.0f shared a download\n", lookups ? 100 * hits / lookups : 0,
+			lookups ? 100 * (after.memory - before.memory) / lookups : 0, lookups ? 100 * (after.mapped - before.mapped) / lookups : 0,
+			lookups ? 100 * (after.disk - before.disk) / lookups : 0,
+			after.misses - before.misses, after.coalesced - before.coalesced);
+	}
+	else if(admin) printf("cache: couldn't read the proxy's metrics on port %d\n", admin);
+	if(cpu_before >= 0 && cpu_after >= 0)
+		printf("cpu: %.1f us per request, %.2f cores\n", n ? (cpu_after - cpu_before) * 1e6 / n : 0, (cpu_after - cpu_before) / elapsed);
+	else if(pid) printf("cpu: couldn't read /proc/%d/stat\n", pid);
+	return errors > 0;
+}
@@ -0,0 +1,48 @@
+#!/bin/bash
+# runs the proxy through a standard set of loads against a local stand-in origin and reports throughput, latency
+# percentiles, cache hit ratio and cpu per request for each, so a regression on the request path shows up as a number
+# usage: ./bench_load.sh [proxy options...], e.g. ./bench_load.sh -e. BENCH_SECONDS sets how long each load runs (default 10)
+# needs gcc and python3. the origin (bench_origin.py) runs on port 8092, the proxy on 8892 with its admin port on 8992
+
+PROXY_PORT=8892
+ADMIN_PORT=8992
+ORIGIN_PORT=8092
+SECONDS_EACH=${BENCH_SECONDS:-10}
+WORK=$(mktemp -d)
+HERE=$(cd "$(dirname "$0")" && pwd)
+
+gcc -O2 -pthread "$HERE/uproxy.c" -o "$WORK/proxy" -lz || exit 1
+(cd "$HERE" && gcc -O2 -pthread -Dmain=proxy_main bench_load.c -o "$WORK/bench_load" -lm -lz) || exit 1
+
+mkdir -p "$WORK/run"
+touch "$WORK/run/blocklist"
+
+python3 "$HERE/bench_origin.py" $ORIGIN_PORT &
+ORIGIN=$!
+(cd "$WORK/run" && exec "$WORK/proxy" -a $ADMIN_PORT "$@" $PROXY_PORT 3600 > /dev/null 2>&1) &
+PROXY=$!
+sleep 1
+
+# each load asks for its own paths, so it starts from a cold cache. arguments are the load generator's
+load() {
+	name=$1
+	shift
+	echo "== $name"
+	"$WORK/bench_load" -d $SECONDS_EACH -a $ADMIN_PORT -P $PROXY "$@"
+	echo
+}
+
+# a hot set of small objects, nearly all memory hits: the cost of the hit path in proxy_func and the memory tier
+load "small hits" -t 16 -n 1000 $PROXY_PORT "http://localhost:$ORIGIN_PORT/1024/0/len/hits/%d"
+# the same without keep-alive, so accepting and setting up connections is part of every request
+load "small hits, connection per request" -t 16 -n 1000 -k 0 $PROXY_PORT "http://localhost:$ORIGIN_PORT/1024/0/len/close/%d"
+# sizes from 1 KB to 4 MB, the larger ones only cached on disk: find and the disk tier's sendfile path
+load "mixed sizes" -t 16 -n 2000 $PROXY_PORT "http://localhost:$ORIGIN_PORT/1024-4194304/0/len/mixed/%d"
+# a long tail over a slow origin, so many requests miss: forwarding, cache_response and the upstream pool
+load "long tail, 20 ms origin" -t 64 -n 200000 -s 0.8 $PROXY_PORT "http://localhost:$ORIGIN_PORT/4096/20/len/tail/%d"
+# chunked bodies trickled out by the origin, which concurrent misses on the same url share while they stream
+load "streamed chunked downloads" -t 32 -n 200 -W 0 $PROXY_PORT "http://localhost:$ORIGIN_PORT/262144/400/stream/stream/%d"
+
+kill $PROXY $ORIGIN
+wait $PROXY $ORIGIN 2>/dev/null
+rm -rf "$WORK"
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+# stand-in origin server for benchmarking the proxy: every path names the object it wants, so the load generator
+# picks sizes, latency and framing through its url template without any setup
+#   /<size>/<delay ms>/<framing>/<anything>
+# size is a byte count, or a range like 1024-1048576 to get sizes spread log-uniformly over it, fixed for each path.
+# framing is one of
+#   len      a Content-Length body, sent after the delay
+#   chunked  the same body in 16 KB chunks
+#   stream   the head right away, then the body in 8 chunks with the delay spread between them, like a slow download
+# responses are cacheable for an hour. usage: ./bench_origin.py <port>
+
+import sys
+import time
+import zlib
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+CHUNK = 16384
+pattern = memoryview(bytes(range(251)) * 4096)
+
+
+# bodies are slices of one pattern, grown as larger ones are asked for, so making one costs nothing
+def body(size):
+	global pattern
+	while len(pattern) < size:
+		pattern = memoryview(bytes(pattern) * 2)
+	return pattern[:size]
+
+
+def object_size(spec, path):
+	if '-' not in spec:
+		return int(spec)
+	low, high = (int(n) for n in spec.split('-'))
+	# the same path always gets the same size, so a cached copy matches what the origin would send
+	fraction = zlib.crc32(path.encode()) / 0xffffffff
+	return int(low * (high / low) ** fraction)
+
+
+class Handler(BaseHTTPRequestHandler):
+	protocol_version = 'HTTP/1.1'
+	# heads and bodies are written separately, and would otherwise wait on the proxy's delayed acks
+	disable_nagle_algorithm = True
+
+	def log_message(self, *args):
+		pass
+
+	def do_GET(self):
+		try:
+			spec, delay, framing = self.path.split('/')[1:4]
+			data = body(object_size(spec, self.path))
+			delay = int(delay) / 1000.0
+		except ValueError:
+			self.send_error(404)
+			return
+
+		if framing != 'stream' and delay > 0:
+			time.sleep(delay)
+		self.send_response(200)
+		self.send_header('Content-Type', 'application/octet-stream')
+		self.send_header('Cache-Control', 'max-age=3600')
+		if framing == 'len':
+			self.send_header('Content-Length', str(len(data)))
+			self.end_headers()
+			self.wfile.write(data)
+			return
+
+		self.send_header('Transfer-Encoding', 'chunked')
+		self.end_headers()
+		size = CHUNK if framing == 'chunked' else max(1, -(-len(data) // 8))
+		for start in range(0, len(data), size):
+			if framing == 'stream':
+				self.wfile.flush()
+				time.sleep(delay / 8)
+			piece = data[start:start + size]
+			self.wfile.write(b''.join((b'%x\r\n' % len(piece), piece, b'\r\n')))
+		self.wfile.write(b'0\r\n\r\n')
+
+
+ThreadingHTTPServer.daemon_threads = True
+ThreadingHTTPServer.allow_reuse_address = True
+# a burst of misses opens many connections at once, which the default backlog of 5 would turn into SYN retries
+ThreadingHTTPServer.request_queue_size = 256
+ThreadingHTTPServer(('127.0.0.1', int(sys.argv[1])), Handler).serve_forever()
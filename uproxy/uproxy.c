@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,16 +6,118 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <errno.h>
-#include <semaphore.h>
 #include <dirent.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <stdatomic.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <resolv.h>
+#include <arpa/nameser.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <zlib.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 #define BUFSIZE 4096
+#define HEADSIZE 16384		//largest response head the proxy will reframe
+#define REQSIZE 16384		//largest request head taken from a client, and so the longest uri
+#define KEEPALIVE_TIMEOUT 30	//seconds an idle persistent client connection is kept, and a server may go silent mid-response
+#define ORIGIN_SIZE 300		//room for a "host:port" origin key
+#define RELAY_BUFSIZE 65536	//buffer for relaying bodies that can't be spliced
+#define PIPE_SIZE (1 << 20)	//pipe capacity asked for when splicing bodies
+#define CONDSIZE 512		//room for the conditional headers of a revalidation
+#define MAX_HEADERS 64		//most header lines a request may have
+
+//metrics, which each thread counts in a block of its own and readers add up, see the metrics section
+enum {
+	STAT_REQUESTS,
+	STAT_RAM_HITS, STAT_MAP_HITS, STAT_DISK_HITS, STAT_MISSES, STAT_COALESCED, STAT_REVALIDATIONS,
+	STAT_POOL_HITS, STAT_POOL_MISSES,
+	STAT_DNS_HITS, STAT_DNS_LOOKUPS, STAT_DNS_JOINED,
+	STAT_CONNECT_FALLBACKS, STAT_ORIGINS_DOWN,
+	STAT_CLIENT_BYTES, STAT_SERVER_BYTES,	//sent to clients, received from servers
+	STAT_OPENED, STAT_CLOSED,		//client connections
+	STAT_LOCKS, STAT_LOCKS_CONTENDED,	//cache locks
+	STAT_LOG_RECORDS, STAT_LOG_DROPPED,	//access log records written, and lost to a full ring
+	STAT_SEGMENT_BYTES, STAT_COMPACTED_BYTES, STAT_SEGMENTS_FREED,	//log store appends, and what compaction moved and gave back
+	STAT_RANGES, STAT_RANGE_FILLS,		//partial responses from the cache, and whole downloads started for ranges that missed
+	STAT_VARIANTS, STAT_VARIANT_HITS,	//gzip variants made, and hits answered from one
+	STAT_COMPRESS_IN, STAT_COMPRESS_OUT,	//body bytes the variants were made from, and their size compressed
+	STAT_COUNTERS
+};
+enum {HIST_CONNECT, HIST_FIRST_BYTE, HIST_LOCK_WAIT, HIST_DNS, HISTS};
+#define HIST_BUCKETS 280	//log-linear, up to 2^37 us (38 hours)
+
+//one thread's counts, on cache lines of its own
+typedef struct thread_stats {
+	atomic_ulong counters[STAT_COUNTERS];
+	atomic_ulong hists[HISTS][HIST_BUCKETS];
+	atomic_ulong hist_sums[HISTS];	//microseconds
+	struct thread_stats *prev, *next;
+} __attribute__((aligned(64))) thread_stats;
+
+void stats_init(void);
+void stat_add(int, unsigned long);
+void stat_time(int, unsigned long);
+void stats_collect(thread_stats *);
+void print_hist(thread_stats *, int, char *);
+unsigned long now_us(void);
+void cache_rdlock(pthread_rwlock_t *);
+void cache_wrlock(pthread_rwlock_t *);
+void cache_lock(pthread_mutex_t *);
+void *admin_thread(void *);
+
+//one request's line in the access log (-l), laid out as it is written to the file, see the access log section
+#define ACCESS_MAGIC "uproxy-access-1\n"	//starts every log file, changed whenever the record changes
+#define ACCESS_URI 218		//bytes of the uri kept, which fill a record out to 256 bytes
+
+//how a request was answered
+#define ACCESS_NONE 0		//without looking in the cache, like most errors
+#define ACCESS_MEMORY 1
+#define ACCESS_DISK 2
+#define ACCESS_MISS 3
+#define ACCESS_SHARED 4		//from another request's download in progress
+#define ACCESS_REVALIDATED 5	//from a stale copy the server confirmed
+#define ACCESS_MAPPED 6		//from a mapping of the cached file the hot-object tier holds
+
+typedef struct {
+	uint64_t time;		//when the request was read, in microseconds since the epoch. 0 while no request is open
+	uint64_t total_us;	//from reading the request to finishing the response
+	uint64_t bytes;		//sent to the client, head and body
+	uint32_t connect_us;	//connecting to the server, 0 if there was no connect
+	uint32_t first_byte_us;	//from sending the server the request to having its response head, 0 if it wasn't asked
+	uint16_t status;	//sent to the client, 0 if the server's response was passed on without being parsed
+	uint16_t cache;		//ACCESS_*
+	uint16_t uri_len;	//of the whole uri, which is cut short if it doesn't fit in uri
+	char uri[ACCESS_URI];
+} access_record;
+
+int access_init(void);
+void access_start(access_record *);
+void access_finish(access_record *);
+void access_uri(char *, int);
+void access_status(int);
+void access_cache(int);
+void upstream_time(int, unsigned long);
+void client_sent(unsigned long);
+void *access_writer(void *);
 
 //function to ensure entire response is written to client
 int socket_write(int sock, char *message, int stream_size) {
@@ -31,12 +134,14 @@ int socket_write(int sock, char *message, int stream_size) {
 		bytes_written += new_bytes_written;
 		unsent_bytes = stream_size - bytes_written;
 	}
+	client_sent(stream_size);
 	return 0;
 }
 
 //hash function for caching server responses
 //from Dan Bernstein, http://www.cse.yorku.ca/~oz/hash.html
-unsigned long fileHash(unsigned char *str) {
+unsigned long fileHash(const char *s) {
+    const unsigned char *str = (const unsigned char *) s;
     unsigned long hash = 5381;
     int c;
 
@@ -46,34 +151,442 @@ unsigned long fileHash(unsigned char *str) {
     return hash;
 }
 
-//these three function declarations are for general functionality
+//a request head parsed where it was read, as offsets into that buffer, so nothing is copied. parsing picks up
+//where it left off each time more of the request arrives
+typedef struct {
+	int name, name_len;	//offsets into the request buffer
+	int value, value_len;
+	int line_len;		//the whole line, with its line ending
+	int id;			//which of the headers below it is, worked out once while parsing
+} header_span;
+
+//request headers the proxy itself acts on, see header_id
+#define HDR_OTHER 0
+#define HDR_CONNECTION 1
+#define HDR_PROXY_CONNECTION 2
+#define HDR_KEEP_ALIVE 3
+#define HDR_IF_NONE_MATCH 4
+#define HDR_IF_MODIFIED_SINCE 5
+#define HDR_RANGE 6
+#define HDR_IF_RANGE 7
+
+typedef struct {
+	char *buf;		//the buffer the offsets are into
+	int state;
+	int pos;		//start of the first line not parsed yet
+	int method, method_len;
+	int target, target_len;
+	int version, version_len;
+	int head_len;		//length up to and including the blank line, once state is REQ_DONE
+	int nheaders;
+	header_span headers[MAX_HEADERS];
+} request_head;
+
+//request parser states
+#define REQ_LINE 0		//waiting for the request line
+#define REQ_HEADERS 1		//reading header lines
+#define REQ_DONE 2		//the whole head is parsed
+
+//the request sent on to the server, as pieces that mostly point into the client's request, written out with writev
+#define FORWARD_IOVS (MAX_HEADERS + 8)
+
+typedef struct {
+	struct iovec iov[FORWARD_IOVS];
+	int iovcnt;
+	long len;			//bytes in all the pieces
+	char conditionals[CONDSIZE];	//headers of our own for a revalidation, see find_stale
+} forward_request;
+
+//these function declarations are for general functionality
 void *proxy_func(void *);
-int parse_get_request(char*,char**,char**,char**,char*);
+int read_request(int, char *, int *, request_head *);
+void request_init(request_head *, char *);
+int request_parse(request_head *, int);
+int parse_get_request(request_head *, char **, char **);
+int request_keep_alive(char *, request_head *);
 void send_error_message(int, int, char*);
+int format_error_message(char *, int, char *);
+
+//delimiter scanning and header name matching for the parsers, vectorized where the cpu allows. see the scanning section
+char *scan_init(char *);
+int name_equal(char *, char *, int);
+int header_id(char *, int);
+
+//these functions find where a response ends and reframe its head for a persistent client connection
+typedef struct {
+	int status;
+	int head_len;		//length of the status line and headers, including the blank line
+	long content_length;	//-1 if there is no Content-Length header
+	int chunked;
+	int keep_alive;		//whether the server means to keep its connection open
+} response_head;
+
+//body framing modes
+#define BODY_NONE 0		//no body at all (1xx, 204, 304)
+#define BODY_LENGTH 1		//Content-Length bytes
+#define BODY_CHUNKED 2		//chunked transfer coding
+#define BODY_CLOSE 3		//everything until the server closes
+
+#define LENGTH_CHUNKED -2	//a content length for rewrite_response_head, saying the body is sent chunked
+
+typedef struct {
+	int mode;
+	long remaining;		//bytes left in the body, or in the current chunk
+	int chunk_state;
+	int done;
+} body_framer;
+
+//the part of a cached body a request's Range header picked, see range_select
+typedef struct {
+	int status;		//206 for one range of the body, 416 if none of it can be sent, or 0 for all of it
+	long start, len;	//the bytes of the body to send
+	long total;		//the whole body's length
+} byte_range;
+
+int parse_response_head(char *, int, response_head *);
+void body_framer_init(body_framer *, response_head *);
+int body_consume(body_framer *, char *, int, FILE *);
+int rewrite_response_head(char *, response_head *, char *, int, int, long, byte_range *, int);
+char *header_value(char *, char *, char *);
+int value_has_token(char *, char *, char *);
+char *value_trim_end(char *, char *);
+
+//what the cache needs to know about a response besides the response itself, worked out from its head when it is stored
+typedef struct {
+	int storable;		//0 if a shared cache must not keep it (no-store, private, Vary: *, uncacheable status)
+	int explicit;		//set if the response gave its own lifetime rather than getting the default
+	long lifetime;		//seconds it stays fresh from when it is stored
+	int validators;		//has an ETag or Last-Modified to revalidate with once stale
+	char *vary;		//malloc'd Vary names and the request's values for them, NULL if it doesn't vary
+	int compressible;	//set if a gzip variant should be made of it, see the compression section
+} cache_meta;
+
+void response_meta(char *, response_head *, request_head *, cache_meta *);
+char *response_header(char *, response_head *, char *, char **);
+char *request_header(request_head *, char *, char **);
+char *directive_value(char *, char *, char *);
+time_t parse_http_date(char *, char *);
+char *vary_key(char *, char *, request_head *);
+int vary_matches(char *, request_head *);
+
+//a cached response opened for reading, from a file of its own or from a record in a log segment
+typedef struct {
+	int fd;
+	off_t start, end;	//where the response lies in fd, past the uri line
+	int segment;		//log segment fd belongs to, -1 if it is the response's own file
+	int compressible;	//see cache_meta, only set when opened through the index
+} cache_object;
 
-//function to reply to request when info is cached
-void send_cached_response(int, FILE *);
+//functions to reply to request when info is cached
+int send_cached_response(int, cache_object *, request_head *, int);
+int load_cached_head(cache_object *, request_head *, char *, int, int *, off_t *, long *);
+void range_select(request_head *, char *, response_head *, long, byte_range *);
+int range_fill(char *, unsigned long, request_head *);
+void range_init(void);
+void *range_fill_thread(void *);
+
+//gzip variants of cached responses, made in the background by a pool of threads. see the compression section
+#define VARIANT_GZIP " gzip"	//follows a response's uri in the cache key of its gzip variant
+
+int compress_wanted(request_head *);
+int compressible_type(char *, char *);
+void compress_init(void);
+void compress_queue(char *);
+void *compress_thread(void *);
+void compress_response(char *);
+void write_variant_head(FILE *, char *, response_head *);
+int serve_variant(int, char *, request_head *, int);
+
+//a download into the cache that other clients missing on the same uri can follow as it arrives
+typedef struct inflight {
+	char *uri;
+	unsigned long hash;
+	int fd;			//the cache file being written, -1 until the leader has opened one
+	int efd;		//eventfd bumped on every change, for event loop followers. -1 until one joins
+	long progress;		//bytes of the file written so far, including the uri line
+	int done, complete;
+	int refs;		//the leader's plus one per follower
+	pthread_cond_t cond;
+	struct inflight *next;
+} inflight;
+
+#define FLIGHT_LEAD 0		//no download in progress, the caller starts one
+#define FLIGHT_FOLLOW 1		//the caller follows another client's download
+#define FLIGHT_CACHED 2		//a download just finished, look in the cache again
+
+int inflight_join(char *, unsigned long, inflight **);
+void inflight_start(inflight *, FILE *);
+void inflight_publish(inflight *, FILE *);
+void inflight_finish(inflight *, int);
+void inflight_release(inflight *);
+long inflight_wait(inflight *, long, int, int *, int *);
+int inflight_head(inflight *, long, int, int, char *, int, int *, int *, off_t *);
+int send_inflight_response(int, inflight *, int, int);
+int serve_cached_file(int, char *, unsigned long, cache_object *, request_head *, int);
 
 //forward_and_cache forwards the client's request and caches the server's response
 //parse_uri, connect_to_host, blocklisted, and cache_response are all helper functions
-void forward_and_cache(char *, int, char *, char *);
+int forward_and_cache(char *, int, request_head *, char *, int, inflight *);
+void build_forward_request(forward_request *, char *, request_head *, char *, int);
+void forward_add(forward_request *, char *, long);
+int forward_send(int, forward_request *, long *);
 int parse_uri(char *, char **, char **);
+int check_origin(char *, char *);
 int connect_to_host(int *, char *);
+int origin_split(char *, char *, int *);
 int blocklisted(char *);
-void cache_response(char *, int, int);
+int recv_response_head(int, char *, int *, response_head *);
+int cache_response(char *, request_head *, int, int, int, char *, int, response_head *, int *, inflight *);
+FILE *open_cache_entry(char *, char *);
+void write_cache_head(FILE *, char *, response_head *);
+void close_cache_entry(char *, FILE *, char *, int, cache_meta *);
+void revalidated(char *, char *, response_head *, long);
+
+//zero-copy relay of a response body, from the server socket through a pipe to the client and teed into the cache
+typedef struct {
+	int pipe_fds[2];	//server to client
+	int tee_fds[2];		//copy of the same bytes on their way to the cache file, -1 if not caching
+	int cache_fd;
+	int cache_failed;	//set if the cache file could not be written
+	long size;		//most bytes the pipes hold
+	long pending;		//bytes in pipe_fds not yet sent to the client
+} splice_relay;
+
+int splice_relay_open(splice_relay *, FILE *);
+ssize_t splice_relay_fill(splice_relay *, int, long, unsigned int);
+int splice_relay_drain(splice_relay *, int, unsigned int);
+int splice_relay_send(splice_relay *, int);
+int splice_relay_discard(splice_relay *);
+void splice_relay_finish_cache(splice_relay *, FILE *);
+void splice_relay_close(splice_relay *);
 
-//these two functions are specific to working with the cache
-FILE *find(unsigned long, char *, int);
+//these functions are specific to working with the cache
+cache_object *find(unsigned long, char *, int, request_head *);
+cache_object *find_stale(unsigned long, char *, request_head *, char *, long *);
+cache_object *open_cache_file(char *, char *);
+int read_cached_head(cache_object *, char *, response_head *);
+void close_cache_object(cache_object *);
 void *clear_cache(void *);
 
-//binary semaphores used to synchonize cache access. See synchonization section of submitted file "notes" for more information
-sem_t wrt;
-sem_t mutex;
-sem_t search_mutex;
+//when an indexed file is due to expire, see the expiry schedule
+typedef struct {
+	time_t expires;
+	unsigned long hash;
+} expiry_item;
+
+int expiry_next(expiry_item *, int);
+
+//in-memory index of what the cache holds, so lookups don't have to probe the cache directory
+typedef struct cache_entry {
+	char *uri;
+	unsigned long hash;	//fileHash of the uri, which also names its file
+	char path[32];
+	long size;		//size of the cache file, or of the log record
+	int segment;		//log segment the response is in, -1 if it is in path
+	off_t offset;		//where its record starts in the segment
+	time_t inserted;
+	time_t expires;		//fresh until then
+	time_t evict;		//removed then, later than expires if it can be revalidated
+	int validators;
+	char *vary;		//see cache_meta. copies from index_lookup only keep whether it is NULL
+	int compressible;	//see cache_meta
+	struct cache_entry *next;
+} cache_entry;
+
+void index_init(void);
+void index_rebuild(void);
+int index_lookup(char *, unsigned long, cache_entry *, request_head *);
+cache_object *index_open(char *, unsigned long, cache_entry *, request_head *);
+int index_insert(char *, unsigned long, long, time_t, char *, cache_meta *, int, off_t);
+int index_at(char *, unsigned long, int, off_t);
+int index_move(char *, unsigned long, int, off_t, int, off_t);
+int index_refresh(char *, unsigned long, long);
+int index_expire(unsigned long, time_t, char *);
+void expiry_schedule(unsigned long, time_t);
+
+//hot-object tier: small, popular responses kept whole in memory in front of the disk cache
+typedef struct ram_object {
+	char *uri;
+	unsigned long hash;
+	char *data;		//the cached response, head and body, without the uri line
+	long size;
+	char *map;		//mapping of the cache file data points into, NULL if data is a copy
+	size_t map_len;
+	time_t expires;
+	response_head rh;
+	int head_ok;		//set if rh could be parsed from data
+	int compressible;	//see cache_meta
+	atomic_int refs;	//one for the tier itself while linked, plus one per reader
+	int linked;
+	struct ram_object *hnext;	//hash chain
+	struct ram_object *prev, *next;	//recency list, most recent first
+} ram_object;
+
+ram_object *ram_lookup(char *, unsigned long);
+ram_object *ram_promote(char *, unsigned long, cache_object *);
+void ram_release(ram_object *);
+void ram_remove_hash(unsigned long);
+int ram_head(ram_object *, request_head *, char *, int, int *, off_t *, long *);
+int send_ram_response(int, ram_object *, request_head *, int);
+long parse_size(char *);
+
+//blocklist, compiled from ./blocklist at startup and on SIGHUP (see the blocklist section)
+typedef struct blocklist blocklist;
+void blocklist_load(void);
+
+//cache keys, which request uris are rewritten into, with rules from ./cachekeys for queries (see the cache keys section)
+void cache_key(char *);
+int cacheable(char *);
+void key_rules_load(void);
+
+//host name lookups, made by a pool of resolver threads and cached for as long as the answers say they hold
+#define DNS_MAX_ADDRS 16	//most addresses kept for one name, IPv6 and IPv4 together
+
+typedef struct {
+	int family;		//AF_INET or AF_INET6
+	union {
+		struct in_addr v4;
+		struct in6_addr v6;
+	};
+} dns_addr;
+
+typedef struct {
+	int status;		//0 if the name resolved, otherwise the error to send the client
+	int naddrs;
+	dns_addr addrs[DNS_MAX_ADDRS];
+} dns_answer;
+
+typedef struct dns_entry {
+	char *name;
+	int shard;
+	dns_answer answer;	//the last lookup's, kept while a new one is under way
+	time_t expires;
+	int preloaded;		//loaded from /etc/hosts with -H, never expires
+	int pending;		//set while a resolver thread looks it up
+	int efd;		//eventfd written when the lookup finishes, for event loop waiters. -1 until one waits
+	int refs;		//waiters and the queued lookup, which keep it from being swept out
+	pthread_cond_t cond;
+	struct dns_entry *next;		//hash chain
+	struct dns_entry *queue_next;	//resolver queue
+} dns_entry;
+
+void dns_init(int);
+int dns_resolve(char *, dns_answer *);
+dns_entry *dns_start(char *, dns_answer *, int *);
+void dns_finish(dns_entry *, dns_answer *);
+void dns_release(dns_entry *);
+void *dns_thread(void *);
+
+//connects to a server by racing its addresses, see the connect race section
+typedef struct {
+	struct sockaddr_storage addrs[DNS_MAX_ADDRS];	//in the order they are tried
+	socklen_t lens[DNS_MAX_ADDRS];
+	int naddrs, next;		//next is the next address to start an attempt on
+	struct pollfd attempts[DNS_MAX_ADDRS];	//connects in progress
+	int which[DNS_MAX_ADDRS];	//the address each attempt is to
+	int watched[DNS_MAX_ADDRS];	//for the event loop, set once an attempt is in its epoll set
+	int nattempts;
+	long last_start, deadline;	//monotonic milliseconds
+	unsigned long started;		//microseconds, for the connect time histogram
+} connect_race;
+
+int race_start(connect_race *, dns_answer *, int);
+int race_step(connect_race *, int *);
+int race_wait(connect_race *);
+void race_abandon(connect_race *);
+
+//upstream connection pool, keeps idle keep-alive connections to each origin for reuse
+int pool_get(char *, int);
+void pool_put(char *, int);
+int pool_conn_alive(int);
+void *pool_reaper(void *);
+
+//event loop mode, an opt-in alternative to one thread per connection
+void run_event_loop(int, int, int);
+
+//waits on process-wide signals, SIGUSR1 prints statistics and SIGHUP reloads the blocklist
+void *signal_thread(void *);
+void print_stats(void);
+void usage(char *);
+
+//log store, which appends small responses to large segment files instead of giving each one a file.
+//a segment starts with a log_header, and each response follows the last as a log_record, its uri line, then the response
+#define LOG_MAGIC "uproxy-segment1\n"	//starts every segment, changed whenever the layout changes
+#define LOG_SEGMENTS 4096	//most segments there can be at once
+#define LOG_MIN_SEGMENT (1L << 20)
+#define LOG_LARGE 8		//responses over this fraction of a segment keep a file of their own
+#define LOG_PENDING 0x504e4447	//record whose response is still being copied in
+#define LOG_COMMITTED 0x434d5444	//record that is whole
+#define LOG_COMPACT_SECONDS 10	//between the compactor's passes over the segments
+#define LOG_RECORD_SIZE(n) ((long) sizeof(log_record) + (n))
+
+typedef struct {
+	char magic[sizeof(LOG_MAGIC) - 1];
+	uint64_t seq;		//order the segments were started in, later records win when the index is rebuilt
+} log_header;
+
+typedef struct {
+	uint32_t state;		//LOG_PENDING or LOG_COMMITTED. anything else ends the segment
+	uint32_t uri_len;
+	uint64_t size;		//of the whole record, this included
+	int64_t inserted;	//seconds since the epoch, moved up when the response is revalidated
+} log_record;
+
+int log_append(char *, int, off_t, long, time_t, off_t *);
+int log_take(int);
+void log_release(int);
+void log_live(int, long);
+void log_touch(int, off_t, time_t);
+void log_adopt(char *);
+void log_rebuild(void);
+void *log_compactor(void *);
+
+//how long a cached response stays fresh if it doesn't say, and how long a stale one is kept for revalidation, in seconds
+int cache_timeout;
+
+//byte budget for the hot-object tier's copies, 0 turns them off. see the hot-object section
+long ram_budget = 64L << 20;
+
+//address space for the hot-object tier's mappings of larger cache files, 0 turns them off (-M)
+long map_budget = 4L << 30;
+
+//size of the segments the log store appends to, 0 keeps every response in a file of its own (-s). see the log store section
+long log_segment_size;
+
+//names cache files while they are written, see open_cache_entry
+atomic_ulong temp_files;
 
-//global variables used for synchronization
-int writers = 0;
-int readers = 0;
+//set once the kernel refuses to splice, see the splice relay section
+atomic_int splice_unsupported;
+
+//the scanners scan_init picked, see the scanning section
+char *scan_line_memchr(char *, char *, char **);
+char *scan_blank_bytes(char *, char *);
+char *(*scan_line)(char *, char *, char **) = scan_line_memchr;
+char *(*scan_blank)(char *, char *) = scan_blank_bytes;
+char *scan_line_tail(char *, char *, char **);
+#ifdef __x86_64__
+char *scan_line_sse2(char *, char *, char **);
+char *scan_blank_sse2(char *, char *);
+char *scan_line_avx2(char *, char *, char **);
+char *scan_blank_avx2(char *, char *);
+#endif
+
+//upstream pool settings, see the pool section
+int pool_max_idle = 8;
+int pool_idle_timeout = 30;
+
+//milliseconds a connect to a server may take, over all of its addresses (-c)
+int connect_timeout = 10000;
+
+//threads making gzip variants of cached responses, 0 for none (-z). see the compression section
+int compress_threads;
+
+//loopback port that serves metrics, 0 for none (-a)
+int admin_port;
+
+//file the access log is written to, NULL for none (-l)
+char *access_path;
 
 typedef struct {
 	int client_sock;
@@ -86,25 +599,81 @@ int main(int argc, char *argv[]) {
 	int clientlen;
 	struct stat st = {0};
 	int timeout;
+	int opt, event_mode = 0, workers = 0, preload_hosts = 0;
+	sigset_t signals;
 	
-	if(argc != 3) {
-		printf("Usage %s <port #> <cache timeout in sec>\n", argv[0]);
-		exit(-1);
+	//options come before the port and timeout; -e switches to the event loop, -w sets its worker count,
+	//-p and -i set the upstream pool's idle connections per origin and idle timeout, -m sets the hot-object tier's budget,
+	//-M the address space it maps larger files into, -H loads /etc/hosts into the dns cache, -c sets the deadline in
+	//milliseconds for connecting to a server, -a serves metrics on a loopback port, -l writes an access log to a file,
+	//-s stores small responses in log segments of that size, -z makes gzip variants of cached text with that many threads
+	while((opt = getopt(argc, argv, "ew:p:i:m:M:Hc:a:l:s:z:")) != -1) {
+		switch(opt) {
+			case 'e':
+				event_mode = 1;
+				break;
+			case 'w':
+				workers = atoi(optarg);
+				break;
+			case 'p':
+				pool_max_idle = atoi(optarg);
+				break;
+			case 'i':
+				pool_idle_timeout = atoi(optarg);
+				break;
+			case 'm':
+				ram_budget = parse_size(optarg);
+				break;
+			case 'M':
+				map_budget = parse_size(optarg);
+				break;
+			case 'H':
+				preload_hosts = 1;
+				break;
+			case 'c':
+				connect_timeout = atoi(optarg);
+				if(connect_timeout <= 0) usage(argv[0]);
+				break;
+			case 'a':
+				admin_port = atoi(optarg);
+				if(admin_port <= 0 || admin_port > 65535) usage(argv[0]);
+				break;
+			case 'l':
+				access_path = optarg;
+				break;
+			case 's':
+				log_segment_size = parse_size(optarg);
+				if(log_segment_size > 0 && log_segment_size < LOG_MIN_SEGMENT) usage(argv[0]);
+				break;
+			case 'z':
+				compress_threads = atoi(optarg);
+				if(compress_threads < 0) usage(argv[0]);
+				break;
+			default:
+				usage(argv[0]);
+		}
 	}
 	
+	if(argc - optind != 2) usage(argv[0]);
+	
+	//a client hanging up mid-response should fail that write, not kill the whole proxy
+	signal(SIGPIPE, SIG_IGN);
+	
+	//every thread inherits this mask, so process-wide signals only reach signal_thread
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	
 	//if cache folder does not exist, create one
 	if (stat("./cache/", &st) == -1) {
     		mkdir("./cache/", 0777);
 	}
 	
-	//set up pthread attributes
+	//set up pthread attributes. nothing joins the threads, so they are detached to give their stacks back as they exit
 	pthread_attr_t attr;
     	pthread_attr_init(&attr);
-    	
-    	//initializes mutexes
-    	sem_init(&wrt, 0, 1);
-    	sem_init(&mutex, 0, 1);
-    	sem_init(&search_mutex, 0, 1);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 	
 	//create/open proxy socket
 	sockfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -118,23 +687,60 @@ int main(int argc, char *argv[]) {
 	//populate proxy info
 	proxy.sin_family = AF_INET;
 	proxy.sin_addr.s_addr = INADDR_ANY;
-	proxy.sin_port = htons(atoi(argv[1]));
+	proxy.sin_port = htons(atoi(argv[optind]));
 	
-	//bind proxy, set listen queue to 3
+	//bind proxy, set listen queue to 3 (or as deep as the kernel allows when serving from the event loop)
 	if(bind(sockfd, (struct sockaddr *)&proxy, sizeof(proxy)) < 0)
 		perror("binding socket");
 
-	listen(sockfd, 3);
+	listen(sockfd, event_mode ? SOMAXCONN : 3);
 	
 	clientlen = sizeof(client);
 	
-	timeout = atoi(argv[2]);
+	timeout = atoi(argv[optind + 1]);
 	if(timeout < 0) timeout = 0;
+	cache_timeout = timeout;
+	
+	stats_init();
+	if(access_path && access_init() < 0) exit(1);
+	scan_init(NULL);
+	blocklist_load();
+	key_rules_load();
+	dns_init(preload_hosts);
+	
+	//load what the cache already holds before any lookups happen
+	index_init();
+	index_rebuild();
 	
 	//run thread to periodically check cache files and clear any unnecessary ones
 	pthread_t d;
 	pthread_create(&d, &attr, clear_cache, (void *)&timeout);
 	
+	pthread_t sig;
+	pthread_create(&sig, &attr, signal_thread, (void *)&signals);
+	
+	//and one to close pooled server connections that have sat idle too long
+	pthread_t reaper;
+	if(pool_max_idle > 0) pthread_create(&reaper, &attr, pool_reaper, NULL);
+	
+	pthread_t admin;
+	if(admin_port > 0) pthread_create(&admin, &attr, admin_thread, NULL);
+	
+	pthread_t writer;
+	if(access_path) pthread_create(&writer, &attr, access_writer, NULL);
+	
+	//segments found by index_rebuild are compacted even with the log store turned off, until they are empty
+	pthread_t compactor;
+	pthread_create(&compactor, &attr, log_compactor, NULL);
+	
+	range_init();
+	compress_init();
+	
+	if(event_mode) {
+		run_event_loop(sockfd, timeout, workers);
+		return 0;
+	}
+	
 	while(1) {
 		proxy_args pa;
 		proxy_args *arg_ptr;
@@ -154,93 +760,355 @@ int main(int argc, char *argv[]) {
 		if(arg_ptr==NULL) perror("malloc before proxy thread creation");
 		*arg_ptr = pa;		
 		
-		pthread_create(&runner, &attr, proxy_func, (void *) arg_ptr);
-		
+		if(pthread_create(&runner, &attr, proxy_func, (void *) arg_ptr) != 0) {
+			perror("starting proxy thread");
+			close(client_sock);
+			free(arg_ptr);
+		}
+	}
+}
+
+void usage(char *prog) {
+	printf("Usage %s [-e] [-w <workers>] [-p <idle connections per origin>] [-i <idle timeout in sec>] [-m <memory cache bytes>] [-M <mapped cache bytes>] [-H] [-c <connect timeout in ms>] [-a <metrics port>] [-l <access log file>] [-s <log segment bytes>] [-z <compression threads>] <port #> <cache timeout in sec>\n", prog);
+	exit(-1);
+}
+
+//waits on the signals main blocked for every thread and handles them here, where it is safe to do real work
+void *signal_thread(void *set) {
+	int sig;
+	
+	while(1) {
+		if(sigwait((sigset_t *) set, &sig) != 0) continue;
+		if(sig == SIGUSR1) print_stats();
+		if(sig == SIGHUP) {
+			blocklist_load();
+			key_rules_load();
+		}
 	}
+	return NULL;
+}
+
+//dumps the proxy's counters to stderr
+void print_stats(void) {
+	thread_stats *t = malloc(sizeof(thread_stats));
+	unsigned long ram, mapped, disk, miss, total;
+	
+	if(t == NULL) return;
+	stats_collect(t);
+	ram = t->counters[STAT_RAM_HITS];
+	mapped = t->counters[STAT_MAP_HITS];
+	disk = t->counters[STAT_DISK_HITS];
+	miss = t->counters[STAT_MISSES];
+	total = ram + mapped + disk + miss;
+	
+	fprintf(stderr, "requests: %lu, client connections: %lu open of %lu, bytes: %lu to clients, %lu from servers\n",
+		t->counters[STAT_REQUESTS], t->counters[STAT_OPENED] - t->counters[STAT_CLOSED], t->counters[STAT_OPENED], t->counters[STAT_CLIENT_BYTES], t->counters[STAT_SERVER_BYTES]);
+	fprintf(stderr, "cache: %lu memory hits (%.1f%%), %lu mapped hits (%.1f%%), %lu disk hits (%.1f%%), %lu misses (%lu joined a download in progress, %lu revalidated a stale copy)\n",
+		ram, total ? 100.0 * ram / total : 0.0, mapped, total ? 100.0 * mapped / total : 0.0, disk, total ? 100.0 * disk / total : 0.0, miss, t->counters[STAT_COALESCED], t->counters[STAT_REVALIDATIONS]);
+	fprintf(stderr, "ranges: %lu served from the cache, %lu misses fetched whole in the background\n", t->counters[STAT_RANGES], t->counters[STAT_RANGE_FILLS]);
+	if(compress_threads > 0) fprintf(stderr, "compression: %lu gzip variants made, %lu bytes down to %lu, %lu hits served from them\n", t->counters[STAT_VARIANTS], t->counters[STAT_COMPRESS_IN], t->counters[STAT_COMPRESS_OUT], t->counters[STAT_VARIANT_HITS]);
+	fprintf(stderr, "cache locks: %lu taken, %lu waited for\n", t->counters[STAT_LOCKS], t->counters[STAT_LOCKS_CONTENDED]);
+	print_hist(t, HIST_LOCK_WAIT, "cache lock waits");
+	fprintf(stderr, "upstream pool: %lu hits, %lu misses\n", t->counters[STAT_POOL_HITS], t->counters[STAT_POOL_MISSES]);
+	fprintf(stderr, "dns: %lu cache hits, %lu lookups (and %lu waited on a lookup in progress)\n", t->counters[STAT_DNS_HITS], t->counters[STAT_DNS_LOOKUPS], t->counters[STAT_DNS_JOINED]);
+	print_hist(t, HIST_DNS, "dns lookups");
+	fprintf(stderr, "connects: %lu won by an address other than the first, %lu refused because every address was down\n", t->counters[STAT_CONNECT_FALLBACKS], t->counters[STAT_ORIGINS_DOWN]);
+	print_hist(t, HIST_CONNECT, "upstream connects");
+	print_hist(t, HIST_FIRST_BYTE, "upstream response heads");
+	if(access_path) fprintf(stderr, "access log: %lu records written, %lu dropped\n", t->counters[STAT_LOG_RECORDS], t->counters[STAT_LOG_DROPPED]);
+	if(log_segment_size > 0) fprintf(stderr, "log store: %lu bytes appended, %lu moved by compaction, %lu segments freed\n", t->counters[STAT_SEGMENT_BYTES], t->counters[STAT_COMPACTED_BYTES], t->counters[STAT_SEGMENTS_FREED]);
+	free(t);
+}
+
+//reads a byte count with an optional K, M or G suffix
+long parse_size(char *str) {
+	char *end;
+	long size = strtol(str, &end, 10);
+	
+	if(*end == 'k' || *end == 'K') size <<= 10;
+	else if(*end == 'm' || *end == 'M') size <<= 20;
+	else if(*end == 'g' || *end == 'G') size <<= 30;
+	return size < 0 ? 0 : size;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 //this is the main function for each thread except cache deleter thread
+//the client's connection is kept open between requests unless either side asks to close it,
+//and pipelined requests are answered in the order they arrive
 void *proxy_func(void *pa) {
-	int server_sock;
 	int client_sock = ((proxy_args *) pa)->client_sock;
 	int timeout = ((proxy_args *)pa)->timeout;
 	free(pa);
 	
-	char buffer[BUFSIZE], proxy_req[BUFSIZE];
-	char *command, *uri, *version;
-	int err;
+	char buffer[REQSIZE];
+	char *uri, *version;
+	int err, buf_len, req_len, keep_alive;
 	unsigned long int hash;
+	struct timeval idle;
+	request_head req;
+	access_record rec;
+	int one = 1;
 	
-	bzero(buffer, BUFSIZE);
-	bzero(proxy_req, BUFSIZE);
-	command = uri = version = NULL;
+	//an idle persistent connection gives up its thread after KEEPALIVE_TIMEOUT seconds, and so does a client
+	//that stops reading its response
+	idle.tv_sec = KEEPALIVE_TIMEOUT;
+	idle.tv_usec = 0;
+	if(setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle)) < 0) perror("setting receive timeout");
+	if(setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle)) < 0) perror("setting send timeout");
 	
-	//sometimes an empty message is received, ignore these and erroneous calls
-	if(recv(client_sock, buffer, BUFSIZE, 0) <= 0) {
-		if(close(client_sock) < 0) perror("closing socket");
-		return NULL;
-	}
+	//a response's head and body go out in separate writes, and Nagle would hold the body back until the client
+	//acks the head, which a client delaying its acks only does 40 ms later
+	if(setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) perror("setting nodelay");
+	stat_add(STAT_OPENED, 1);
+	
+	buf_len = 0;
+	req_len = 0;
+	keep_alive = 1;
+	rec.time = 0;
+	while(keep_alive) {
+		//the last response is finished, whichever way the loop came back around
+		access_finish(&rec);
 		
-	//parse_get_request returns any relevant error codes
-	err = parse_get_request(buffer, &command, &uri, &version, proxy_req);
+		//the request is used where it was read until it is answered, then dropped from in front of anything pipelined behind it
+		buf_len -= req_len;
+		memmove(buffer, buffer + req_len, buf_len);
 		
-	if(err!=0) {
-		send_error_message(client_sock, err, version);
-		if(close(client_sock) < 0) perror("closing socket");
-		return NULL;
+		//sometimes an empty message is received, ignore these and erroneous calls
+		req_len = read_request(client_sock, buffer, &buf_len, &req);
+		if(req_len != 0) access_start(&rec);
+		if(req_len < 0) send_error_message(client_sock, 400, NULL);
+		if(req_len <= 0) break;
+		stat_add(STAT_REQUESTS, 1);
+		uri = version = NULL;
+		
+		//parse_get_request returns any relevant error codes
+		err = parse_get_request(&req, &uri, &version);
+		access_uri(req.buf + req.target, req.target_len);
+			
+		if(err!=0) {
+			send_error_message(client_sock, err, version);
+			break;
+		}
+		
+		//everything from here on goes by the cache key, see the cache keys section
+		cache_key(uri);
+		keep_alive = request_keep_alive(version, &req);
+		
+		cache_object *cache_file;
+		ram_object *obj;
+		inflight *flight = NULL;
+		int role = FLIGHT_LEAD;
+		hash = fileHash(uri);
+		
+		//hot objects are answered straight from memory
+		if(timeout > 0 && (obj = ram_lookup(uri, hash)) != NULL) {
+			//a client that takes gzip is answered from the compressed variant where there is one, see the compression section
+			if(obj->compressible && (err = serve_variant(client_sock, uri, &req, keep_alive)) >= 0) {
+				ram_release(obj);
+				keep_alive = err;
+				continue;
+			}
+			stat_add(obj->map ? STAT_MAP_HITS : STAT_RAM_HITS, 1);
+			access_cache(obj->map ? ACCESS_MAPPED : ACCESS_MEMORY);
+			keep_alive = send_ram_response(client_sock, obj, &req, keep_alive);
+			ram_release(obj);
+			continue;
+		}
+		
+		cache_file = find(hash, uri, timeout, &req);
+		if(cache_file && cache_file->compressible && (err = serve_variant(client_sock, uri, &req, keep_alive)) >= 0) {
+			close_cache_object(cache_file);
+			keep_alive = err;
+			continue;
+		}
+		
+		//a range that misses is forwarded on its own with the whole object fetched behind it, see the byte ranges section.
+		//other concurrent misses on the same uri share one download, see the in-flight section
+		if(cache_file == NULL && timeout > 0 && request_header(&req, "Range", NULL)) {
+			if(range_fill(uri, hash, &req) == FLIGHT_CACHED) cache_file = find(hash, uri, timeout, &req);
+		}
+		else if(cache_file == NULL && timeout > 0 && cacheable(uri)) {
+			role = inflight_join(uri, hash, &flight);
+			if(role == FLIGHT_CACHED) cache_file = find(hash, uri, timeout, &req);
+		}
+		
+		if(cache_file) {
+			keep_alive = serve_cached_file(client_sock, uri, hash, cache_file, &req, keep_alive);
+		}
+		else if(role == FLIGHT_FOLLOW) {
+			stat_add(STAT_COALESCED, 1);
+			access_cache(ACCESS_SHARED);
+			err = send_inflight_response(client_sock, flight, keep_alive, strcmp(version, "HTTP/1.1") == 0);
+			inflight_release(flight);
+			
+			//nothing was sent because the download failed, or was a revalidation that refreshed the cached copy
+			//instead, or varies by request. look in the cache again, and failing that try it ourselves
+			if(err < 0 && (cache_file = find(hash, uri, timeout, &req)) != NULL)
+				keep_alive = serve_cached_file(client_sock, uri, hash, cache_file, &req, keep_alive);
+			else if(err < 0) {
+				stat_add(STAT_MISSES, 1);
+				access_cache(ACCESS_MISS);
+				keep_alive = forward_and_cache(version, client_sock, &req, uri, keep_alive, NULL);
+			}
+			else keep_alive = err;
+		}
+		else {
+			stat_add(STAT_MISSES, 1);
+			access_cache(ACCESS_MISS);
+			keep_alive = forward_and_cache(version, client_sock, &req, uri, keep_alive, role == FLIGHT_LEAD ? flight : NULL);
+		}
 	}
 	
-	FILE *cache_file;
-	hash = fileHash(uri);
-	
-	//see notes on synchonization for this part
-	sem_wait(&search_mutex);
-	cache_file = find(hash, uri, timeout);
+	access_finish(&rec);
+	if(close(client_sock) < 0) perror("closing socket");
+	stat_add(STAT_CLOSED, 1);
+	return NULL;
+}
+
+//reads from the client until buffer holds at least one complete request head, parsed into req
+//buffer keeps anything already read past that request, and buf_len tracks how much it holds
+//returns the length of the first request, 0 if the client closed or went idle, or -1 if it is malformed or does not fit
+int read_request(int client_sock, char *buffer, int *buf_len, request_head *req) {
+	int n, status;
 	
-	if(cache_file) {
-		sem_post(&search_mutex);
-		send_cached_response(client_sock, cache_file);
-		printf("Got file contents from cache\n");
-	}
-	else {
-		forward_and_cache(version, client_sock, proxy_req, uri);
-		sem_post(&search_mutex);
-		printf("Got file contents from network\n");
+	request_init(req, buffer);
+	while(1) {
+		status = request_parse(req, *buf_len);
+		if(status > 0) return req->head_len;
+		if(status < 0 || *buf_len >= REQSIZE - 1) return -1;
+		
+		n = recv(client_sock, buffer + *buf_len, REQSIZE - 1 - *buf_len, 0);
+		if(n <= 0) return 0;
+		*buf_len += n;
 	}
 }
 
-//this function parses get requests and puts each individual chunk into a string passed into the function by reference
-//if there is an error in the request, return the appropriate error number
-int parse_get_request(char *buffer, char **command, char **uri, char **version, char *proxy_req){
+//readies req to parse a request from the start of buf
+void request_init(request_head *req, char *buf) {
+	req->buf = buf;
+	req->state = REQ_LINE;
+	req->pos = 0;
+	req->nheaders = 0;
+	req->head_len = 0;
+}
+
+//parses whatever complete lines of the request head the first len bytes of req->buf hold that it hasn't already.
+//each call carries on from the last, so every byte is only looked at once however the request arrives.
+//returns 1 once the head is complete, 0 if more is needed, or -1 if it is malformed or has too many headers
+int request_parse(request_head *req, int len) {
+	char *buf = req->buf, *nl, *colon, *p, *end;
+	header_span *h;
+	int line, line_end;
+	
+	while(req->state != REQ_DONE) {
+		nl = scan_line(buf + req->pos, buf + len, &colon);
+		if(nl == NULL) return 0;
+		line = req->pos;
+		line_end = nl - buf;
+		if(line_end > line && buf[line_end - 1] == '\r') line_end--;
+		req->pos = nl + 1 - buf;
+		
+		if(req->state == REQ_LINE) {
+			//empty lines in front of a request are ignored
+			if(line_end == line) continue;
+			
+			//method, target and version, separated by whitespace
+			p = buf + line;
+			end = buf + line_end;
+			req->method = p - buf;
+			p = scan_blank(p, end);
+			req->method_len = p - buf - req->method;
+			while(p < end && (*p == ' ' || *p == '\t')) p++;
+			req->target = p - buf;
+			p = scan_blank(p, end);
+			req->target_len = p - buf - req->target;
+			while(p < end && (*p == ' ' || *p == '\t')) p++;
+			req->version = p - buf;
+			p = scan_blank(p, end);
+			req->version_len = p - buf - req->version;
+			
+			if(req->method_len == 0 || req->target_len == 0 || req->version_len == 0) return -1;
+			req->state = REQ_HEADERS;
+			continue;
+		}
+		
+		if(line_end == line) {
+			req->head_len = req->pos;
+			req->state = REQ_DONE;
+			break;
+		}
+		
+		//a header is a name, a colon and a value. folded continuation lines are no longer allowed
+		p = colon;
+		if(p == NULL || p == buf + line || buf[line] == ' ' || buf[line] == '\t' || p[-1] == ' ' || p[-1] == '\t') return -1;
+		if(req->nheaders == MAX_HEADERS) return -1;
+		
+		h = &req->headers[req->nheaders++];
+		h->name = line;
+		h->name_len = p - buf - line;
+		h->id = header_id(buf + line, h->name_len);
+		for(p++; p < buf + line_end && (*p == ' ' || *p == '\t'); p++);
+		h->value = p - buf;
+		h->value_len = value_trim_end(p, buf + line_end) - p;
+		h->line_len = req->pos - line;
+	}
+	return 1;
+}
 
-	//make sure no overflows are attempted
-	if(buffer[BUFSIZE - 1] != 0) return 400;
-	strcpy(proxy_req, buffer);
+//decides whether the client wants its connection kept open after this request
+//HTTP/1.1 connections persist unless they ask to close, HTTP/1.0 ones only if they ask for keep-alive
+int request_keep_alive(char *version, request_head *req) {
+	int keep_alive = version != NULL && strcmp(version, "HTTP/1.1")==0;
+	char *value;
+	int i;
 	
-	*command = strtok(buffer, " \t\n\r");
-	if(*command==NULL) return 400;
-	if(strcmp(*command, "HEAD")==0 || strcmp(*command, "POST")==0 || strcmp(*command, "PUT")==0) return 405;
-	if(strcmp(*command, "GET")!=0) return 400;
+	for(i = 0; i < req->nheaders; i++) {
+		header_span *h = &req->headers[i];
+		
+		value = req->buf + h->value;
+		if(h->id == HDR_CONNECTION || h->id == HDR_PROXY_CONNECTION) {
+			if(value_has_token(value, value + h->value_len, "close")) keep_alive = 0;
+			else if(value_has_token(value, value + h->value_len, "keep-alive")) keep_alive = 1;
+		}
+	}
+	return keep_alive;
+}
+
+//checks a parsed request is a GET this proxy can answer and gives its uri and version as strings, which are
+//terminated where they lie in the request's buffer. if there is an error in the request, return the appropriate error number
+int parse_get_request(request_head *req, char **uri, char **version) {
+	char *method = req->buf + req->method;
 	
-	*uri = strtok(NULL, " \t\n\r");
-	if(*uri==NULL) return 400;
+	if((req->method_len == 4 && strncmp(method, "HEAD", 4)==0) || (req->method_len == 4 && strncmp(method, "POST", 4)==0) || (req->method_len == 3 && strncmp(method, "PUT", 3)==0)) return 405;
+	if(req->method_len != 3 || strncmp(method, "GET", 3)!=0) return 400;
 	
-	*version = strtok(NULL, " \t\n\r");
-	if(*version==NULL) return 400;
+	//the request line is never sent on as it is, so the separators after the target and version can be overwritten
+	*uri = req->buf + req->target;
+	(*uri)[req->target_len] = '\0';
+	*version = req->buf + req->version;
+	(*version)[req->version_len] = '\0';
 	if(strcmp(*version, "HTTP/1.0")!=0 && strcmp(*version, "HTTP/1.1")!=0) {
 		*version = NULL;
 		return 505;
 	}
 	
 	return 0;
-}	
+}
 
 //formats and sends an error message based on error number
 void send_error_message(int client_sock, int err, char *version) {
 	char message[256];
 	int stream_size;
+	
+	stream_size = format_error_message(message, err, version);
+	access_status(err);
+	if(socket_write(client_sock, message, stream_size) < 0) perror("writing to socket, line 254ish");
+}
+
+//writes the status line for an error number into message, which must hold at least 256 bytes
+//returns the length of the formatted message
+int format_error_message(char *message, int err, char *version) {
 	if(version == NULL) strcpy(message, "HTTP/1.1");
 	else strcpy(message, version);
 
@@ -248,339 +1116,6268 @@ void send_error_message(int client_sock, int err, char *version) {
 	else if(err==403) strcat(message, " 403 Forbidden\r\n");
 	else if(err==404) strcat(message, " 404 Not Found\r\n");
 	else if(err==405) strcat(message, " 405 Method Not Allowed\r\n");
+	else if(err==502) strcat(message, " 502 Bad Gateway\r\n");
+	else if(err==504) strcat(message, " 504 Gateway Timeout\r\n");
 	else if(err==505) strcat(message, " 505 HTTP Version Not Supported\r\n");
 	else perror("programmer messed up error codes, :(");
 	
 	strcat(message, "\r\n");
 	
-	stream_size = strlen(message);
-	if(socket_write(client_sock, message, stream_size) < 0) perror("writing to socket, line 254ish");
+	return strlen(message);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-//this function simply takes the cached file, cuts off the first line (which has the URI as a form of error detection),
-//and sends the remainder of the file, which is the cached response
-void send_cached_response(int sock, FILE *fp) {
-	int start_offset;
-	int response_size;
-	int bytes_read, unread_bytes, new_bytes_read;
-	
-	start_offset = ftell(fp);
-	fseek(fp, 0, SEEK_END);
-	response_size = ftell(fp) - start_offset;
-	fseek(fp, start_offset, SEEK_SET);
-	
-	//make message buffer big enough to contain entire response
-	char message[response_size];
-	
-	bytes_read = fread(message, 1, response_size, fp);
-	if(bytes_read < 0) perror("reading file");
-	
-	//make sure entire file is read
-	unread_bytes = response_size - bytes_read;
-	while(unread_bytes > 0) {
-		new_bytes_read = fread(message, 1, unread_bytes, fp);
-		if(new_bytes_read < 0) perror("reading cached file");
-		
-		bytes_read += new_bytes_read;
-		unread_bytes = response_size - bytes_read;
+//scanning: the request parser finds line ends, colons and blanks with these rather than a byte at a time. on x86-64
+//scan_init picks AVX2 or SSE2 versions, which test 32 or 16 bytes at once, and everywhere else memchr does the work
+
+//switches to the scanners named by want ("avx2", "sse2" or "memchr"), or the widest this cpu runs if want is NULL.
+//returns the name of the ones now in use, or NULL if the cpu can't run the ones asked for
+char *scan_init(char *want) {
+#ifdef __x86_64__
+	if(want == NULL) want = __builtin_cpu_supports("avx2") ? "avx2" : "sse2";
+	if(strcmp(want, "avx2") == 0) {
+		if(!__builtin_cpu_supports("avx2")) return NULL;
+		scan_line = scan_line_avx2;
+		scan_blank = scan_blank_avx2;
+		return want;
 	}
+	if(strcmp(want, "sse2") == 0) {
+		scan_line = scan_line_sse2;
+		scan_blank = scan_blank_sse2;
+		return want;
+	}
+#endif
+	if(want != NULL && strcmp(want, "memchr") != 0) return NULL;
+	scan_line = scan_line_memchr;
+	scan_blank = scan_blank_bytes;
+	return "memchr";
+}
+
+//finds the end of the line starting at p, returning where its '\n' is, or NULL if end comes first.
+//colon is set to the line's first ':', or NULL if it has none
+char *scan_line_memchr(char *p, char *end, char **colon) {
+	char *nl = memchr(p, '\n', end - p);
 	
-	if(socket_write(sock, message, response_size)<0)
-		perror("writing to socket around line 287");
-	if(fclose(fp)!=0) perror("closing file");
-	if(close(sock) < 0) perror("closing socket");
-	
-	//see synchronization
-	sem_wait(&mutex);
-	readers--;
-	if(readers==0) sem_post(&wrt);
-	sem_post(&mutex);
+	*colon = nl ? memchr(p, ':', nl - p) : NULL;
+	return nl;
 }
 
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//returns where the first space or tab from p is, or end if there is none
+char *scan_blank_bytes(char *p, char *end) {
+	while(p < end && *p != ' ' && *p != '\t') p++;
+	return p;
+}
 
-//if requested file is not found in cache, forward request to server and response back to client
-//then cache server's response
-void forward_and_cache(char *version, int client_sock, char *proxy_req, char *uri) {
-	char *hostname, *file;
-	char proxy_forward[BUFSIZE], buffer[BUFSIZE];
-	int server_sock;
-	char uri_copy[strlen(uri)+1];
-	char *header_line;
-	int err;
+//finishes a line scan over the few bytes the vector loops leave before end, keeping any colon they already found
+char *scan_line_tail(char *p, char *end, char **colon) {
+	char *nl = memchr(p, '\n', end - p);
 	
-	strcpy(uri_copy, uri);
+	if(nl && *colon == NULL) *colon = memchr(p, ':', nl - p);
+	return nl;
+}
+
+#ifdef __x86_64__
+//SSE2 is part of x86-64, so these always run there
+char *scan_line_sse2(char *p, char *end, char **colon) {
+	__m128i nl = _mm_set1_epi8('\n'), co = _mm_set1_epi8(':'), v;
+	unsigned int n, c;
 	
-	//set up connection to server
-	err = parse_uri(uri_copy, &hostname, &file);
-	if(err!=0) {
-		send_error_message(client_sock, err, version);
-		if(close(client_sock) < 0) perror("closing socket");
-		return;
+	*colon = NULL;
+	for(; end - p >= 16; p += 16) {
+		v = _mm_loadu_si128((__m128i *) p);
+		n = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		c = _mm_movemask_epi8(_mm_cmpeq_epi8(v, co));
+		
+		//colons after the line end are on the next line
+		if(n) c &= (n & -n) - 1;
+		if(c && *colon == NULL) *colon = p + __builtin_ctz(c);
+		if(n) return p + __builtin_ctz(n);
 	}
+	return scan_line_tail(p, end, colon);
+}
+
+char *scan_blank_sse2(char *p, char *end) {
+	__m128i sp = _mm_set1_epi8(' '), ht = _mm_set1_epi8('\t'), v;
+	unsigned int m;
 	
-	err = connect_to_host(&server_sock, hostname);
-	if(err!=0) {
-		send_error_message(client_sock, err, version);
-		if(close(client_sock) < 0) perror("closing socket");
-		return;
+	for(; end - p >= 16; p += 16) {
+		v = _mm_loadu_si128((__m128i *) p);
+		m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, ht)));
+		if(m) return p + __builtin_ctz(m);
 	}
+	return scan_blank_bytes(p, end);
+}
+
+//the same thirty two bytes at a time, compiled for AVX2 whatever the rest of the file is built for
+__attribute__((target("avx2")))
+char *scan_line_avx2(char *p, char *end, char **colon) {
+	__m256i nl = _mm256_set1_epi8('\n'), co = _mm256_set1_epi8(':'), v;
+	unsigned int n, c;
 	
-	//next two chunks of code formulate http request from proxy to server
-	bzero(proxy_forward, BUFSIZE);
-	strcpy(proxy_forward, "GET /");
-	if(file!=NULL) strcat(proxy_forward, file);
-	strcat(proxy_forward, " ");
-	if(version!=NULL) strcat(proxy_forward, version);
-	else strcat(proxy_forward, "HTTP/1.1");
-	strcat(proxy_forward, "\r\n");
-	
-	header_line = strtok(proxy_req, "\r\n"); //scan past first header line
-	
-	//copy over headers, ignoring anything related to persistent connections
-	while((header_line = strtok(NULL, "\r\n")) != NULL) {
-		if(strcasecmp(header_line, "Proxy-Connection: keep-alive")!=0 && strcasecmp(header_line, "Connection: keep-alive")!=0) {
-			strcat(proxy_forward, header_line);
-			strcat(proxy_forward, "\r\n");
-		}
-		if(strcasecmp(header_line, "Connection: keep-alive")==0)
-			strcat(proxy_forward, "Connection: close\r\n");
+	*colon = NULL;
+	for(; end - p >= 32; p += 32) {
+		v = _mm256_loadu_si256((__m256i *) p);
+		n = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		c = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, co));
+		
+		if(n) c &= (n & -n) - 1;
+		if(c && *colon == NULL) *colon = p + __builtin_ctz(c);
+		if(n) return p + __builtin_ctz(n);
 	}
-	strcat(proxy_forward, "\r\n");
-	
-	if(socket_write(server_sock, proxy_forward, strlen(proxy_forward)) < 0) perror("writing to socket line 349ish");
-	
-	cache_response(uri, client_sock, server_sock);
-	
-	if(close(server_sock) < 0) perror("closing socket");
-	if(close(client_sock) < 0) perror("closing socket");
+	return scan_line_tail(p, end, colon);
 }
 
-//parses uri, checks uri is of valid format
-int parse_uri(char *uri, char **hostname, char **file) {
-	char *protocol;
+__attribute__((target("avx2")))
+char *scan_blank_avx2(char *p, char *end) {
+	__m256i sp = _mm256_set1_epi8(' '), ht = _mm256_set1_epi8('\t'), v;
+	unsigned int m;
 	
-	protocol = strtok(uri, ":/");
-	if(protocol==NULL || strcmp(protocol, "http")!= 0)
-		return 400;
+	for(; end - p >= 32; p += 32) {
+		v = _mm256_loadu_si256((__m256i *) p);
+		m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, ht)));
+		if(m) return p + __builtin_ctz(m);
+	}
+	return scan_blank_bytes(p, end);
+}
+#endif
+
+//compares n bytes of two header names ignoring ASCII case, without the locale lookups strncasecmp makes
+int name_equal(char *a, char *b, int n) {
+	unsigned char x, y;
+	int i;
 	
-	*hostname = strtok(NULL, "/");
-	if(*hostname==NULL)
-		return 404;
+#ifdef __x86_64__
+	//sixteen bytes at a time, with A-Z folded to lower case in both
+	__m128i before_a = _mm_set1_epi8('A' - 1), after_z = _mm_set1_epi8('Z' + 1), bit = _mm_set1_epi8(0x20), va, vb;
 	
-	*file = strtok(NULL, " \r\n");
-	return 0;
+	for(; n >= 16; a += 16, b += 16, n -= 16) {
+		va = _mm_loadu_si128((__m128i *) a);
+		vb = _mm_loadu_si128((__m128i *) b);
+		va = _mm_or_si128(va, _mm_and_si128(bit, _mm_and_si128(_mm_cmpgt_epi8(va, before_a), _mm_cmplt_epi8(va, after_z))));
+		vb = _mm_or_si128(vb, _mm_and_si128(bit, _mm_and_si128(_mm_cmpgt_epi8(vb, before_a), _mm_cmplt_epi8(vb, after_z))));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff) return 0;
+	}
+#endif
+	for(i = 0; i < n; i++) {
+		x = a[i];
+		y = b[i];
+		if(x - 'A' < 26u) x |= 0x20;
+		if(y - 'A' < 26u) y |= 0x20;
+		if(x != y) return 0;
+	}
+	return 1;
 }
 
-//determines host IP and port for server and sets up connection
-int connect_to_host(int *server_sock, char *hostname) {
-	char stackbuffer = '\0';
+//sorts a request header by name into one of the HDR_ constants, so the ones the proxy acts on are recognized once
+//while parsing rather than compared against every time the request is looked at
+int header_id(char *name, int len) {
+	switch(len) {
+		case 5:
+			if(name_equal(name, "Range", 5)) return HDR_RANGE;
+			break;
+		case 8:
+			if(name_equal(name, "If-Range", 8)) return HDR_IF_RANGE;
+			break;
+		case 10:
+			if(name_equal(name, "Connection", 10)) return HDR_CONNECTION;
+			if(name_equal(name, "Keep-Alive", 10)) return HDR_KEEP_ALIVE;
+			break;
+		case 13:
+			if(name_equal(name, "If-None-Match", 13)) return HDR_IF_NONE_MATCH;
+			break;
+		case 16:
+			if(name_equal(name, "Proxy-Connection", 16)) return HDR_PROXY_CONNECTION;
+			break;
+		case 17:
+			if(name_equal(name, "If-Modified-Since", 17)) return HDR_IF_MODIFIED_SINCE;
+			break;
+	}
+	return HDR_OTHER;
+}
 
-	char host_port[strlen(hostname)+1];
-	struct addrinfo hints, *servinfo, *p;
-	char *host, *port, port_str[8];
-	
-	bzero(port_str, 8);
-	strcpy(host_port, hostname);
-	host = strtok(host_port, ":");
-	port = strtok(NULL, ":");
-	if(port==NULL) strcpy(port_str, "http");
-	else strcpy(port_str, port);
-	
-	if(blocklisted(host)) return 403;
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
+//parses the status line and the headers that decide how a response is framed
+//returns 1 once the whole head is in buf, 0 if more is needed, -1 if it is malformed or larger than HEADSIZE
+int parse_response_head(char *buf, int len, response_head *rh) {
+	char *end, *line, *next, *value;
 	
-	if (getaddrinfo(host, port_str, &hints, &servinfo) != 0) {
-	    return 404;
-	}
+	end = memmem(buf, len, "\r\n\r\n", 4);
+	if(end == NULL) return len >= HEADSIZE ? -1 : 0;
+	if(len < 12 || strncmp(buf, "HTTP/1.", 7) != 0) return -1;
 	
-	/*p = servinfo;
-	struct sockaddr_in *h = (struct sockaddr_in *)p->ai_addr;
-	char *ip = inet_ntoa(h->sin_addr);
-	printf("ip is %s\n", ip);
-	int n = 0;*/
+	rh->head_len = end + 4 - buf;
+	rh->status = atoi(buf + 9);
+	rh->content_length = -1;
+	rh->chunked = 0;
+	rh->keep_alive = buf[7] == '1';
 	
-	for(p = servinfo; p != NULL; p = p->ai_next) {
-   		if ((*server_sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-		        perror("socket");
-        		continue;
-    		}
-
-        	if (connect(*server_sock, p->ai_addr, p->ai_addrlen) == -1) {
-        		perror("connect");
-        		if(close(*server_sock) < 0) perror("closing socket");
-        		continue;
-    		}
-
-    		break;
+	line = memchr(buf, '\n', rh->head_len) + 1;
+	while(line < end + 2) {
+		next = memchr(line, '\n', end + 2 - line);
+		if(next == NULL) break;
+		
+		if((value = header_value(line, next, "Content-Length"))) rh->content_length = strtol(value, NULL, 10);
+		else if((value = header_value(line, next, "Transfer-Encoding"))) rh->chunked = value_has_token(value, next, "chunked");
+		else if((value = header_value(line, next, "Connection"))) {
+			if(value_has_token(value, next, "close")) rh->keep_alive = 0;
+			else if(value_has_token(value, next, "keep-alive")) rh->keep_alive = 1;
+		}
+		line = next + 1;
 	}
-	
-	return 0;
+	return 1;
 }
 
-//checks hostnames against blocklist
-int blocklisted(char *host) {
-	FILE *bl = fopen("./blocklist", "r");
-	if(bl==NULL) return 0;
+//if line is a header called name, returns where its value starts, otherwise NULL
+char *header_value(char *line, char *line_end, char *name) {
+	int n = strlen(name);
 	
-	char buffer[128];
-	
-	bzero(buffer, 128);
-	while(fgets(buffer, 50, bl)!=NULL) {
-		if(buffer[127]!='\0')
-			perror("OVERFLOW IN BLOCKLISTED FUNCTION");
+	if(line_end - line <= n || line[n] != ':' || !name_equal(line, name, n)) return NULL;
+	line += n + 1;
+	while(line < line_end && (*line == ' ' || *line == '\t')) line++;
+	return line;
+}
+
+//checks whether a comma separated header value contains token, ignoring case
+int value_has_token(char *value, char *value_end, char *token) {
+	int n = strlen(token);
 	
-		buffer[strlen(buffer) - 1] = '\0';
-		if(strcasecmp(host, buffer)==0) {
-			fclose(bl);
-			return 403;
+	while(value < value_end) {
+		while(value < value_end && (*value == ' ' || *value == '\t' || *value == ',')) value++;
+		if(value_end - value >= n && strncasecmp(value, token, n) == 0) {
+			char c = value + n < value_end ? value[n] : '\0';
+			if(c == ',' || c == ' ' || c == '\t' || c == ';' || c == '\r' || c == '\n' || c == '\0') return 1;
 		}
+		while(value < value_end && *value != ',') value++;
 	}
-	fclose(bl);
 	return 0;
 }
 
-//this function caches the response from the server and forwards it to client
-void cache_response(char *uri_copy, int client_sock, int server_sock) {
-	//check that file is not dynamic content
-	char *uri = strtok(uri_copy, "?");
-	char *dynamic = strtok(NULL, "?");
+//picks how the body following this head is delimited
+void body_framer_init(body_framer *f, response_head *rh) {
+	f->remaining = 0;
+	f->chunk_state = 0;
+	f->done = 0;
 	
-	int byte_transfer;
-	unsigned long int hash = fileHash(uri_copy);
-	char hash_str[100];
-	strcpy(hash_str, "./cache/");
-	sprintf(hash_str + 8, "%lu", hash);
-	char buffer[BUFSIZE];
-	FILE *fp;
+	if(rh->status / 100 == 1 || rh->status == 204 || rh->status == 304) f->mode = BODY_NONE;
+	else if(rh->chunked) f->mode = BODY_CHUNKED;
+	else if(rh->content_length >= 0) {
+		f->mode = BODY_LENGTH;
+		f->remaining = rh->content_length;
+	}
+	else f->mode = BODY_CLOSE;
 	
-	//see synchronization notes
-	sem_wait(&mutex);
-	writers++;
-	sem_post(&mutex);
+	if(f->mode == BODY_NONE || (f->mode == BODY_LENGTH && f->remaining == 0)) f->done = 1;
+}
+
+//states for walking chunked framing
+#define CHUNK_SIZE 0		//reading the hex chunk size
+#define CHUNK_EXT 1		//skipping a chunk extension to the end of the size line
+#define CHUNK_DATA 2		//inside chunk data
+#define CHUNK_DATA_END 3	//skipping the CRLF after chunk data
+#define CHUNK_TRAILER 4		//at the start of a trailer line, or the final blank line
+#define CHUNK_TRAILER_LINE 5	//inside a trailer line
+#define CHUNK_LAST_LF 6		//expecting the LF that ends the message
+
+//walks len bytes of body, which are passed through untouched, looking for the end of the message.
+//unless store is NULL, the body's content is written to it as well, without any chunked framing or trailers
+//returns how many of them belong to this message (setting f->done once it ends), or -1 on bad chunk framing
+int body_consume(body_framer *f, char *buf, int len, FILE *store) {
+	int i = 0, n, digit;
 	
-	if(!dynamic) {
-		bzero(buffer, BUFSIZE);
-		strcpy(buffer, uri_copy);
-		strcat(buffer, "\n");
-		fp = fopen(hash_str, "w");
-		fwrite(buffer, 1, strlen(buffer), fp);
+	if(f->done) return 0;
+	if(f->mode == BODY_CLOSE) {
+		if(store) fwrite(buf, 1, len, store);
+		return len;
 	}
-	
-	bzero(buffer, BUFSIZE);
-	while((byte_transfer = recv(server_sock, buffer, BUFSIZE, 0)) > 0) {
-		//write response from server to both client socket and cache file
-		if(socket_write(client_sock, buffer, byte_transfer) < 0) perror("writing to socket, line 476ish");
-		if(!dynamic) fwrite(buffer, 1, byte_transfer, fp);
-		bzero(buffer, BUFSIZE);
+	if(f->mode == BODY_LENGTH) {
+		n = len < f->remaining ? len : f->remaining;
+		f->remaining -= n;
+		if(f->remaining == 0) f->done = 1;
+		if(store) fwrite(buf, 1, n, store);
+		return n;
 	}
 	
-	if(!dynamic) fclose(fp);
+	while(i < len && !f->done) {
+		char c = buf[i];
+		
+		switch(f->chunk_state) {
+			case CHUNK_SIZE:
+				if(c >= '0' && c <= '9') digit = c - '0';
+				else if(c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+				else if(c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+				else digit = -1;
+				
+				if(digit >= 0) {
+					if(f->remaining > (1L << 40)) return -1;
+					f->remaining = f->remaining * 16 + digit;
+				}
+				else if(c == '\n') f->chunk_state = f->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+				else if(c == ';' || c == ' ' || c == '\t' || c == '\r') f->chunk_state = CHUNK_EXT;
+				else return -1;
+				i++;
+				break;
+			case CHUNK_EXT:
+				if(c == '\n') f->chunk_state = f->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+				i++;
+				break;
+			case CHUNK_DATA:
+				n = len - i < f->remaining ? len - i : f->remaining;
+				if(store) fwrite(buf + i, 1, n, store);
+				f->remaining -= n;
+				i += n;
+				if(f->remaining == 0) f->chunk_state = CHUNK_DATA_END;
+				break;
+			case CHUNK_DATA_END:
+				if(c == '\n') f->chunk_state = CHUNK_SIZE;
+				i++;
+				break;
+			case CHUNK_TRAILER:
+				if(c == '\r') f->chunk_state = CHUNK_LAST_LF;
+				else if(c == '\n') f->done = 1;
+				else f->chunk_state = CHUNK_TRAILER_LINE;
+				i++;
+				break;
+			case CHUNK_TRAILER_LINE:
+				if(c == '\n') f->chunk_state = CHUNK_TRAILER;
+				i++;
+				break;
+			case CHUNK_LAST_LF:
+				if(c != '\n') return -1;
+				f->done = 1;
+				i++;
+				break;
+		}
+	}
+	return i;
+}
+
+//copies a response head into out without its hop-by-hop connection headers, then says whether the
+//client's connection stays open. if content_length is not negative, a Content-Length header is added,
+//and if it is LENGTH_CHUNKED, a Transfer-Encoding header for a body the caller sends chunked.
+//unless range is NULL or picked the whole body, the head is turned into a 206 or 416 for the range instead.
+//vary_encoding adds Vary: Accept-Encoding, for a compressible response that clients taking gzip get a variant of.
+//every parsed response a client gets has its head made here, so this is also where its status is logged and 206s are counted
+//returns the length of the new head, or -1 if it does not fit in out_size bytes
+int rewrite_response_head(char *head, response_head *rh, char *out, int out_size, int keep_alive, long content_length, byte_range *range, int vary_encoding) {
+	char *line, *next, *end = head + rh->head_len - 2;
+	int len = 0, n, partial = range && range->status;
+	
+	access_status(partial ? range->status : rh->status);
+	line = head;
+	if(partial) {
+		//the server's status line is swapped for our own, and its length for the range's
+		len = snprintf(out, out_size, "HTTP/1.1 %s\r\n", range->status == 206 ? "206 Partial Content" : "416 Range Not Satisfiable");
+		if(len >= out_size) return -1;
+		line = memchr(head, '\n', end - head);
+		line = line ? line + 1 : end;
+		content_length = range->len;
+	}
+	while(line < end) {
+		next = memchr(line, '\n', end - line);
+		next = next ? next + 1 : end;
+		
+		if(line == head || (!header_value(line, next, "Connection") && !header_value(line, next, "Proxy-Connection") && !header_value(line, next, "Keep-Alive")
+			&& (!partial || (!header_value(line, next, "Content-Length") && !header_value(line, next, "Content-Range"))))) {
+			if(len + (next - line) > out_size) return -1;
+			memcpy(out + len, line, next - line);
+			len += next - line;
+		}
+		line = next;
+	}
+	
+	if(partial) {
+		if(range->status == 206) n = snprintf(out + len, out_size - len, "Content-Range: bytes %ld-%ld/%ld\r\n", range->start, range->start + range->len - 1, range->total);
+		else n = snprintf(out + len, out_size - len, "Content-Range: bytes */%ld\r\n", range->total);
+		if(n >= out_size - len) return -1;
+		len += n;
+	}
+	
+	if(vary_encoding) {
+		n = snprintf(out + len, out_size - len, "Vary: Accept-Encoding\r\n");
+		if(n >= out_size - len) return -1;
+		len += n;
+	}
+	
+	if(content_length >= 0 || content_length == LENGTH_CHUNKED) {
+		if(content_length >= 0) n = snprintf(out + len, out_size - len, "Content-Length: %ld\r\n", content_length);
+		else n = snprintf(out + len, out_size - len, "Transfer-Encoding: chunked\r\n");
+		if(n >= out_size - len) return -1;
+		len += n;
+	}
 	
-	sem_wait(&mutex);
-	writers--;
-	sem_post(&mutex);
+	n = snprintf(out + len, out_size - len, "Connection: %s\r\n\r\n", keep_alive ? "keep-alive" : "close");
+	if(n >= out_size - len) return -1;
+	if(partial && range->status == 206) stat_add(STAT_RANGES, 1);
+	return len + n;
 }
 
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//backs up from the end of a header line over the CRLF and any trailing whitespace, returning where its value ends
+char *value_trim_end(char *value, char *line_end) {
+	while(line_end > value && (line_end[-1] == '\r' || line_end[-1] == '\n' || line_end[-1] == ' ' || line_end[-1] == '\t')) line_end--;
+	return line_end;
+}
 
-//this function finds the cached file if it exists
-FILE *find(unsigned long int hash, char *uri, int timeout) {
-	if(timeout==0) return NULL;
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	char hash_str[128], first_line[BUFSIZE];
-	FILE *fp;
-	struct stat file_info;
-	time_t cur_time;
+//freshness: a response says how long a cache may serve it with Cache-Control (s-maxage, then max-age) or Expires,
+//and can forbid keeping it with no-store or private. one that says nothing stays fresh for the timeout given on the
+//command line. a stale response with an ETag or Last-Modified is kept a timeout longer, so the next miss can ask the
+//server whether it changed (If-None-Match, If-Modified-Since) and a 304 makes it fresh again without sending the body.
+//a response with Vary only answers requests that send the same values for the headers it names
+
+//works out what the cache should do with a response from its head. request is the request it answers, for Vary,
+//or NULL if that isn't known, in which case a response that varies is not storable. meta->vary must be freed
+void response_meta(char *head, response_head *rh, request_head *request, cache_meta *meta) {
+	char *end = head + rh->head_len - 2, *line, *next, *value, *p;
+	long max_age = -1, s_maxage = -1, age = 0;
+	time_t date = -1, expires = -1;
+	int expires_seen = 0, no_cache = 0, is_public = 0, no_transform = 0, text = 0, encoded = 0;
 	
-	strcpy(hash_str, "./cache/");
-	sprintf(hash_str + 8, "%lu", hash);
+	meta->storable = 1;
+	meta->explicit = 1;
+	meta->lifetime = cache_timeout;
+	meta->validators = 0;
+	meta->vary = NULL;
+	meta->compressible = 0;
 	
-	sem_wait(&mutex);
-	if(writers > 0) {
-		sem_post(&mutex);
-		sem_wait(&wrt);
-		sem_wait(&mutex);
-	} else if (readers==0) {
-		sem_post(&mutex);
-		sem_wait(&wrt);
-		sem_wait(&mutex);
+	line = memchr(head, '\n', rh->head_len) + 1;
+	while(line < end) {
+		next = memchr(line, '\n', end + 2 - line);
+		if(next == NULL) break;
+		
+		if((value = header_value(line, next, "Cache-Control"))) {
+			if(value_has_token(value, next, "no-store") || value_has_token(value, next, "private")) meta->storable = 0;
+			if(value_has_token(value, next, "no-cache")) no_cache = 1;
+			if(value_has_token(value, next, "public")) is_public = 1;
+			if(value_has_token(value, next, "no-transform")) no_transform = 1;
+			if((p = directive_value(value, next, "s-maxage"))) s_maxage = strtol(p, NULL, 10);
+			if((p = directive_value(value, next, "max-age"))) max_age = strtol(p, NULL, 10);
+		}
+		else if((value = header_value(line, next, "Expires"))) {
+			expires_seen = 1;
+			expires = parse_http_date(value, next);
+		}
+		else if((value = header_value(line, next, "Date"))) date = parse_http_date(value, next);
+		else if((value = header_value(line, next, "Age"))) age = strtol(value, NULL, 10);
+		else if(header_value(line, next, "ETag") || header_value(line, next, "Last-Modified")) meta->validators = 1;
+		else if((value = header_value(line, next, "Vary")) && value < value_trim_end(value, next)) {
+			if(value_has_token(value, next, "*") || request == NULL || meta->vary) meta->storable = 0;
+			else if((meta->vary = vary_key(value, value_trim_end(value, next), request)) == NULL) meta->storable = 0;
+		}
+		else if((value = header_value(line, next, "Content-Type"))) text = compressible_type(value, next);
+		else if((value = header_value(line, next, "Content-Encoding")) && !value_has_token(value, next, "identity")) encoded = 1;
+		line = next + 1;
 	}
-	readers++;
-	sem_post(&mutex);
 	
-	fp = fopen(hash_str, "r");
-	if(fp==NULL) {
-		sem_wait(&mutex);
-		readers--;
-		if(readers==0) sem_post(&wrt);
-		sem_post(&mutex);
-		return NULL;
+	//no-cache may be stored, but has to be revalidated before every use
+	if(no_cache) meta->lifetime = 0;
+	else if(s_maxage >= 0) meta->lifetime = s_maxage;
+	else if(max_age >= 0) meta->lifetime = max_age;
+	else if(expires_seen) meta->lifetime = expires < 0 ? 0 : expires - (date >= 0 ? date : time(NULL));	//a bad date means already expired
+	else meta->explicit = 0;
+	
+	//the response may have sat in other caches already
+	if(meta->explicit) meta->lifetime -= age;
+	if(meta->lifetime < 0) meta->lifetime = 0;
+	
+	//statuses a cache may keep without being told to, anything else only with a lifetime of its own.
+	//partial content and 304s only make sense next to a copy the cache already has
+	switch(rh->status) {
+		case 200: case 203: case 204: case 300: case 301: case 308: case 404: case 405: case 410: case 414: case 501:
+			break;
+		default:
+			if(!meta->explicit || rh->status < 200 || rh->status == 206 || rh->status == 304) meta->storable = 0;
 	}
 	
-	fgets(first_line, BUFSIZE, fp);
-	first_line[strlen(first_line) - 1] = '\0';
-		
-	stat(hash_str, &file_info);
+	//a request with credentials is private to that client unless the response says it can be shared
+	if(request && request_header(request, "Authorization", NULL) && !is_public && s_maxage < 0) meta->storable = 0;
+	
+	//a copy that is stale from the start and can't be revalidated is of no use
+	if(meta->lifetime == 0 && !meta->validators) meta->storable = 0;
+	
+	if(!meta->storable) {
+		free(meta->vary);
+		meta->vary = NULL;
+	}
+	
+	//a variant answers for the response under another key, which a response that varies couldn't be looked up by
+	meta->compressible = compress_threads > 0 && meta->storable && rh->status == 200 && text && !encoded && !no_transform && !meta->vary;
+}
+
+//finds the header called name in a parsed response head, returning where its value starts and, unless value_end is NULL,
+//where it ends. returns NULL if there is no such header
+char *response_header(char *head, response_head *rh, char *name, char **value_end) {
+	char *end = head + rh->head_len - 2, *line, *next, *value;
+	
+	line = memchr(head, '\n', rh->head_len) + 1;
+	while(line < end) {
+		next = memchr(line, '\n', end + 2 - line);
+		if(next == NULL) break;
 		
-	time(&cur_time);
+		if((value = header_value(line, next, name))) {
+			if(value_end) *value_end = value_trim_end(value, next);
+			return value;
+		}
+		line = next + 1;
+	}
+	return NULL;
+}
+
+//like response_header, for a parsed request
+char *request_header(request_head *req, char *name, char **value_end) {
+	int n = strlen(name), i;
+	header_span *h;
+	
+	for(i = 0; i < req->nheaders; i++) {
+		h = &req->headers[i];
+		if(h->name_len == n && name_equal(req->buf + h->name, name, n)) {
+			if(value_end) *value_end = req->buf + h->value + h->value_len;
+			return req->buf + h->value;
+		}
+	}
+	return NULL;
+}
+
+//if a comma separated header value has a directive called name with an argument, returns where the argument starts
+char *directive_value(char *value, char *value_end, char *name) {
+	int n = strlen(name);
+	
+	while(value < value_end) {
+		while(value < value_end && (*value == ' ' || *value == '\t' || *value == ',')) value++;
+		if(value_end - value > n && value[n] == '=' && strncasecmp(value, name, n) == 0) {
+			value += n + 1;
+			return *value == '"' ? value + 1 : value;
+		}
+		while(value < value_end && *value != ',') value++;
+	}
+	return NULL;
+}
+
+//parses an HTTP date such as "Sun, 06 Nov 1994 08:49:37 GMT", returns -1 if it can't
+time_t parse_http_date(char *value, char *line_end) {
+	char date[64];
+	struct tm tm;
+	int n = value_trim_end(value, line_end) - value;
+	
+	if(n <= 0 || n >= sizeof(date)) return -1;
+	memcpy(date, value, n);
+	date[n] = '\0';
+	
+	memset(&tm, 0, sizeof(tm));
+	if(strptime(date, "%a, %d %b %Y %H:%M:%S", &tm) == NULL) return -1;
+	return timegm(&tm);
+}
+
+//builds the key a response with Vary is stored under: the header names it listed, then the value request gave
+//for each of them, one per line. returns it malloc'd, or NULL if it is too long to bother with
+char *vary_key(char *names, char *names_end, request_head *request) {
+	char key[BUFSIZE + HEADSIZE], name[64], *end, *value, *value_end;
+	int len, n;
+	
+	len = names_end - names;
+	if(len >= HEADSIZE) return NULL;
+	memcpy(key, names, len);
+	
+	while(names < names_end) {
+		while(names < names_end && (*names == ' ' || *names == '\t' || *names == ',')) names++;
+		for(end = names; end < names_end && *end != ',' && *end != ' ' && *end != '\t'; end++);
+		if(end == names) break;
 		
-	if(strcmp(uri, first_line)==0 && difftime(cur_time, file_info.st_mtime) <= timeout)
-		return fp;
-	if(fp!=NULL) fclose(fp);
+		value = NULL;
+		if(end - names < sizeof(name)) {
+			memcpy(name, names, end - names);
+			name[end - names] = '\0';
+			value = request_header(request, name, &value_end);
+		}
+		n = value ? value_end - value : 0;
+		if(len + n + 1 >= sizeof(key)) return NULL;
+		key[len++] = '\n';
+		memcpy(key + len, value, n);
+		len += n;
+		names = end;
+	}
+	key[len] = '\0';
+	return strdup(key);
+}
+
+//checks whether request sends the same values for a stored response's Vary headers as the request it was stored for
+int vary_matches(char *vary, request_head *request) {
+	char *names_end = strchr(vary, '\n'), *key;
+	int match;
+	
+	if(names_end == NULL) names_end = vary + strlen(vary);
+	key = vary_key(vary, names_end, request);
+	match = key != NULL && strcmp(key, vary) == 0;
+	free(key);
+	return match;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//answers request from a cached response returned by find, through the memory tier when it is small enough
+//to be promoted into it. returns whether the client's connection can stay open
+int serve_cached_file(int sock, char *uri, unsigned long hash, cache_object *cache_file, request_head *request, int keep_alive) {
+	ram_object *obj;
+	
+	stat_add(STAT_DISK_HITS, 1);
+	access_cache(ACCESS_DISK);
+	if((obj = ram_promote(uri, hash, cache_file)) != NULL) {
+		close_cache_object(cache_file);
+		keep_alive = send_ram_response(sock, obj, request, keep_alive);
+		ram_release(obj);
+		return keep_alive;
+	}
+	return send_cached_response(sock, cache_file, request, keep_alive);
+}
+
+//this function takes a cached response, whose uri line (kept as a form of error detection) find has already
+//checked, and sends it reframed for the client, or the part of it request's Range asks for, closing it after.
+//the body goes straight from the file or log segment to the socket with sendfile, so it never passes through
+//this thread. returns whether the client's connection can stay open
+int send_cached_response(int sock, cache_object *obj, request_head *request, int keep_alive) {
+	char head[HEADSIZE + 256];
+	int head_len;
+	long body_len;
+	off_t offset;
+	ssize_t sent;
+	
+	head_len = load_cached_head(obj, request, head, sizeof(head), &keep_alive, &offset, &body_len);
+	if(head_len > 0 && socket_write(sock, head, head_len) < 0)
+		perror("writing to socket around line 287");
+	else {
+		while(body_len > 0) {
+			sent = sendfile(sock, obj->fd, &offset, body_len);
+			if(sent < 0 && errno == EINTR) continue;
+			if(sent <= 0) {
+				perror("sending cached file");
+				break;
+			}
+			client_sent(sent);
+			body_len -= sent;
+		}
+	}
+	if(body_len > 0) keep_alive = 0;
+	close_cache_object(obj);
+	
+	return keep_alive;
+}
+
+//reads the response head of a cached response and rewrites it for the client into out, giving the offset
+//in obj->fd the body starts at in body_off and the body's length in body_len. if request, unless it is NULL,
+//asks for a range of the body, the head is for that range and the offset and length are the range's.
+//a response that was cached without Content-Length gets one, since its length is now known.
+//if the head can't be reframed, returns 0 and leaves the whole response as the body with keep_alive cleared,
+//otherwise returns the length of the rewritten head
+int load_cached_head(cache_object *obj, request_head *request, char *out, int out_size, int *keep_alive, off_t *body_off, long *body_len) {
+	char head[HEADSIZE];
+	int head_len;
+	response_head rh;
+	byte_range range;
+	
+	if(read_cached_head(obj, head, &rh)) {
+		*body_off = obj->start + rh.head_len;
+		*body_len = obj->end - *body_off;
+		range_select(request, head, &rh, *body_len, &range);
+		head_len = rewrite_response_head(head, &rh, out, out_size, *keep_alive, rh.chunked || rh.content_length >= 0 ? -1 : *body_len, &range, obj->compressible);
+		if(head_len > 0) {
+			*body_off += range.start;
+			*body_len = range.len;
+			return head_len;
+		}
+	}
+	
+	*body_off = obj->start;
+	*body_len = obj->end - obj->start;
+	*keep_alive = 0;
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//byte ranges: a hit whose request has a Range header gets just that part of the cached body, as a 206 with the
+//body sent from its offset in the file, mapping or copy. only a single range of a complete 200 is served this way,
+//and If-Range has it served only while the cached copy is the one the client names. anything else gets the whole
+//response, which the spec allows. a range that misses is passed on to the server as it is, since the client may
+//be after a small part of a large object, and the whole object is downloaded into the cache behind it, by a small
+//pool of threads that follow the same in-flight rules as any other miss, so the next range is a hit. the pool takes
+//at most RANGE_QUEUE downloads waiting, and a range that misses while it is full is only forwarded
+
+#define RANGE_THREADS 4		//threads running background downloads
+#define RANGE_QUEUE 64		//most downloads waiting for one of them
+
+//a background download started by range_fill, with a copy of the request it was started for
+typedef struct range_job {
+	request_head req;
+	inflight *flight;
+	struct range_job *next;
+} range_job;
+
+//downloads waiting for the pool, oldest first
+range_job *range_queue, *range_queue_tail;
+int range_queued;
+pthread_mutex_t range_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t range_cond = PTHREAD_COND_INITIALIZER;
+
+__thread int client_detached;	//set in a background download's thread, whose client is /dev/null
+
+//works out which part of a cached response with a body of total bytes request's Range and If-Range headers ask for.
+//request may be NULL. head and rh are the cached response's head
+void range_select(request_head *request, char *head, response_head *rh, long total, byte_range *range) {
+	char *value, *end, *p, *validator, *validator_end;
+	long first, last;
+	time_t date;
+	
+	range->status = 0;
+	range->start = 0;
+	range->len = range->total = total;
+	if(request == NULL || rh->status != 200 || rh->chunked || (value = request_header(request, "Range", &end)) == NULL) return;
+	
+	//bytes=first-last, bytes=first- or bytes=-suffix. an invalid range is ignored rather than refused
+	end = value_trim_end(value, end);
+	if(end - value < 7 || strncasecmp(value, "bytes=", 6) != 0 || memchr(value, ',', end - value)) return;
+	p = value + 6;
+	if(*p == '-') {
+		if(p[1] < '0' || p[1] > '9') return;
+		last = strtol(p + 1, &p, 10);
+		first = last == 0 ? total : last < total ? total - last : 0;
+		last = total - 1;
+	}
+	else {
+		if(*p < '0' || *p > '9') return;
+		first = strtol(p, &p, 10);
+		if(*p++ != '-') return;
+		last = p < end && *p >= '0' && *p <= '9' ? strtol(p, &p, 10) : LONG_MAX;
+		if(last < first) return;
+		if(last >= total) last = total - 1;
+	}
+	if(p != end) return;
+	
+	//If-Range names the copy by a strong ETag, which has to match exactly, or by the Last-Modified date
+	if((value = request_header(request, "If-Range", &end))) {
+		end = value_trim_end(value, end);
+		if(*value == '"') {
+			validator = response_header(head, rh, "ETag", &validator_end);
+			if(validator == NULL) return;
+			validator_end = value_trim_end(validator, validator_end);
+			if(validator_end - validator != end - value || memcmp(validator, value, end - value) != 0) return;
+		}
+		else {
+			validator = response_header(head, rh, "Last-Modified", &validator_end);
+			if(validator == NULL || (date = parse_http_date(value, end)) < 0 || date != parse_http_date(validator, validator_end)) return;
+		}
+	}
+	
+	if(first >= total) {
+		range->status = 416;
+		range->len = 0;
+		return;
+	}
+	range->status = 206;
+	range->start = first;
+	range->len = last - first + 1;
+}
+
+//starts downloading the whole of uri into the cache in the background, for request, which asked for a range
+//of it and missed. nothing is started for a uri that isn't cached (see cacheable), if another client's download of uri is running,
+//or if the queue is full.
+//returns FLIGHT_CACHED if a download just finished and the cache should be looked in again, otherwise 0
+int range_fill(char *uri, unsigned long hash, request_head *request) {
+	range_job *job;
+	inflight *flight;
+	char *buf;
+	int i, n;
 	
-	sem_wait(&mutex);
-	readers--;
-	if(readers==0) sem_post(&wrt);
-	sem_post(&mutex);
+	if(!cacheable(uri)) return 0;
+	switch(inflight_join(uri, hash, &flight)) {
+		case FLIGHT_CACHED:
+			return FLIGHT_CACHED;
+		case FLIGHT_FOLLOW:
+			inflight_release(flight);
+			return 0;
+	}
+	
+	//the request is copied without its range, so the server sends all of it. uri and version are
+	//terminated in the request buffer, and so in the copy too
+	job = malloc(sizeof(range_job));
+	buf = job ? malloc(request->head_len) : NULL;
+	if(buf == NULL) {
+		perror("malloc for range download");
+		inflight_finish(flight, 0);
+		free(job);
+		return 0;
+	}
+	memcpy(buf, request->buf, request->head_len);
+	job->req = *request;
+	job->req.buf = buf;
+	for(i = n = 0; i < request->nheaders; i++)
+		if(request->headers[i].id != HDR_RANGE && request->headers[i].id != HDR_IF_RANGE) job->req.headers[n++] = request->headers[i];
+	job->req.nheaders = n;
+	job->flight = flight;
+	job->next = NULL;
+	
+	pthread_mutex_lock(&range_lock);
+	if(range_queued >= RANGE_QUEUE) {
+		pthread_mutex_unlock(&range_lock);
+		inflight_finish(flight, 0);
+		free(job->req.buf);
+		free(job);
+		return 0;
+	}
+	if(range_queue_tail) range_queue_tail->next = job;
+	else range_queue = job;
+	range_queue_tail = job;
+	range_queued++;
+	pthread_cond_signal(&range_cond);
+	pthread_mutex_unlock(&range_lock);
+	stat_add(STAT_RANGE_FILLS, 1);
+	return 0;
+}
+
+//starts the threads that run range_fill's downloads
+void range_init(void) {
+	pthread_t t;
+	int i;
 	
+	for(i = 0; i < RANGE_THREADS; i++)
+		if(pthread_create(&t, NULL, range_fill_thread, NULL) != 0) perror("starting range download thread");
+		else pthread_detach(t);
+}
+
+//runs downloads queued by range_fill, oldest first, each as a miss whose response goes nowhere but the cache
+void *range_fill_thread(void *arg) {
+	range_job *job;
+	int sink;
+	
+	client_detached = 1;
+	while(1) {
+		pthread_mutex_lock(&range_lock);
+		while(range_queue == NULL) pthread_cond_wait(&range_cond, &range_lock);
+		job = range_queue;
+		range_queue = job->next;
+		if(range_queue == NULL) range_queue_tail = NULL;
+		range_queued--;
+		pthread_mutex_unlock(&range_lock);
+		
+		if((sink = open("/dev/null", O_WRONLY)) < 0) {
+			perror("opening /dev/null");
+			inflight_finish(job->flight, 0);
+		}
+		else {
+			forward_and_cache(job->req.buf + job->req.version, sink, &job->req, job->req.buf + job->req.target, 0, job->flight);
+			close(sink);
+		}
+		free(job->req.buf);
+		free(job);
+	}
 	return NULL;
 }
 
-//this function periodically scans the entire cache directory and removes any files
-//with timestamps that have expired past the given cache expiration time
-void *clear_cache (void *timeout_ptr) {
-	int timeout = *(int *) timeout_ptr;
-	struct dirent *d;
-	DIR *dh = opendir("./cache");
-	if(!dh) perror("opening directory");
-	struct stat file_info;
-	time_t cur_time;
-	char filepath[128];
-	strcpy(filepath, "./cache/");
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//compression: with -z, a cached response that is text of some kind (see compressible_type), isn't encoded already
+//and doesn't forbid transforming it gets a gzip variant, made by a pool of -z threads once the response is stored so
+//neither the client nor the download waits on it. the variant is a cache entry of its own, keyed by the response's
+//uri with VARIANT_GZIP after it, which no request target can hold, so it is stored, promoted, served and expired
+//like any other response. a hit on a compressible response from a client whose Accept-Encoding takes gzip is
+//answered from the variant instead, and queues it to be made if it is missing, which is how variants come back
+//after expiring, or after a restart, which can't index them again since they vary
+
+#define COMPRESS_MIN 256	//bodies smaller than this aren't worth compressing
+#define COMPRESS_QUEUE 1024	//most responses waiting for the pool, more are dropped until it catches up
+#define COMPRESS_BUCKETS 256	//hash buckets finding a uri among the jobs
+
+//a response waiting for the pool, or being compressed
+typedef struct compress_job {
+	char *uri;
+	unsigned long hash;
+	struct compress_job *next;	//in the queue, until a thread takes it
+	struct compress_job *hnext;	//in its bucket, until it is done
+} compress_job;
+
+//jobs waiting, oldest first. every job is in the table by uri hash until it is done, so the same uri isn't
+//queued twice while it waits or runs, and compress_count counts them
+compress_job *compress_jobs, *compress_jobs_tail, *compress_table[COMPRESS_BUCKETS];
+int compress_count;
+pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t compress_cond = PTHREAD_COND_INITIALIZER;
+
+//starts the compression threads
+void compress_init(void) {
+	pthread_t t;
+	int i;
+	
+	for(i = 0; i < compress_threads; i++)
+		if(pthread_create(&t, NULL, compress_thread, NULL) != 0) perror("starting compression thread");
+		else pthread_detach(t);
+}
+
+//checks whether a Content-Type value is text that compresses well: text/*, json, javascript, xml and anything +json or +xml
+int compressible_type(char *value, char *line_end) {
+	char *types[] = {"application/json", "application/javascript", "application/x-javascript", "application/xml", NULL};
+	char *end = value;
+	int n, i;
+	
+	while(end < line_end && *end != ';' && *end != ' ' && *end != '\t' && *end != '\r' && *end != '\n') end++;
+	n = end - value;
+	if(n > 5 && strncasecmp(value, "text/", 5) == 0) return 1;
+	if((n > 5 && strncasecmp(end - 5, "+json", 5) == 0) || (n > 4 && strncasecmp(end - 4, "+xml", 4) == 0)) return 1;
+	for(i = 0; types[i]; i++)
+		if(n == strlen(types[i]) && strncasecmp(value, types[i], n) == 0) return 1;
+	return 0;
+}
+
+//checks whether compression is on and request's Accept-Encoding takes gzip, which a weight of 0 turns down
+int compress_wanted(request_head *request) {
+	char *value, *end, *token, *q;
+	
+	if(compress_threads <= 0 || (value = request_header(request, "Accept-Encoding", &end)) == NULL) return 0;
+	while(value < end) {
+		token = value;
+		while(value < end && *value != ',') value++;
+		if(value_has_token(token, value, "gzip") || value_has_token(token, value, "x-gzip")) {
+			q = memchr(token, '=', value - token);
+			return q == NULL || strtod(q + 1, NULL) > 0;
+		}
+		value++;
+	}
+	return 0;
+}
+
+//answers a hit on a compressible response of uri from its gzip variant, if the client takes gzip and there is one.
+//if there isn't, it is queued to be made. returns whether the client's connection can stay open, or -1 if nothing
+//was sent and the response itself should be
+int serve_variant(int sock, char *uri, request_head *request, int keep_alive) {
+	char variant[strlen(uri) + sizeof(VARIANT_GZIP)];
+	unsigned long hash;
+	cache_object *obj;
+	ram_object *o;
+	
+	if(!compress_wanted(request)) return -1;
+	sprintf(variant, "%s" VARIANT_GZIP, uri);
+	hash = fileHash(variant);
+	
+	if((o = ram_lookup(variant, hash)) != NULL) {
+		stat_add(o->map ? STAT_MAP_HITS : STAT_RAM_HITS, 1);
+		stat_add(STAT_VARIANT_HITS, 1);
+		access_cache(o->map ? ACCESS_MAPPED : ACCESS_MEMORY);
+		keep_alive = send_ram_response(sock, o, request, keep_alive);
+		ram_release(o);
+		return keep_alive;
+	}
+	if((obj = find(hash, variant, 1, request)) != NULL) {
+		stat_add(STAT_VARIANT_HITS, 1);
+		return serve_cached_file(sock, variant, hash, obj, request, keep_alive);
+	}
+	compress_queue(uri);
+	return -1;
+}
+
+//queues uri's cached response to have its gzip variant made, unless it already is
+void compress_queue(char *uri) {
+	compress_job *job, **bucket;
+	unsigned long hash;
+	
+	if(compress_threads <= 0) return;
+	hash = fileHash(uri);
+	bucket = &compress_table[hash % COMPRESS_BUCKETS];
+	pthread_mutex_lock(&compress_lock);
+	for(job = *bucket; job; job = job->hnext)
+		if(job->hash == hash && strcmp(job->uri, uri) == 0) break;
+	
+	if(job == NULL && compress_count < COMPRESS_QUEUE && (job = calloc(1, sizeof(compress_job))) != NULL) {
+		if((job->uri = strdup(uri)) == NULL) free(job);
+		else {
+			job->hash = hash;
+			job->hnext = *bucket;
+			*bucket = job;
+			if(compress_jobs_tail) compress_jobs_tail->next = job;
+			else compress_jobs = job;
+			compress_jobs_tail = job;
+			compress_count++;
+			pthread_cond_signal(&compress_cond);
+		}
+	}
+	pthread_mutex_unlock(&compress_lock);
+}
+
+//runs queued jobs, oldest first
+void *compress_thread(void *arg) {
+	compress_job *job, **link;
 	
 	while(1) {
-		sem_wait(&mutex);
-		writers++;
-		sem_post(&mutex);
-		sem_wait(&wrt);
+		pthread_mutex_lock(&compress_lock);
+		while(compress_jobs == NULL) pthread_cond_wait(&compress_cond, &compress_lock);
+		job = compress_jobs;
+		compress_jobs = job->next;
+		if(compress_jobs == NULL) compress_jobs_tail = NULL;
+		pthread_mutex_unlock(&compress_lock);
+		
+		compress_response(job->uri);
+		
+		pthread_mutex_lock(&compress_lock);
+		for(link = &compress_table[job->hash % COMPRESS_BUCKETS]; *link != job; link = &(*link)->hnext);
+		*link = job->hnext;
+		compress_count--;
+		pthread_mutex_unlock(&compress_lock);
+		free(job->uri);
+		free(job);
+	}
+	return NULL;
+}
 
-		rewinddir(dh);
+//makes the gzip variant of uri's cached response, as long as it is still fresh and big enough to be worth it
+void compress_response(char *uri) {
+	char variant[strlen(uri) + sizeof(VARIANT_GZIP)], path[100], head[HEADSIZE];
+	char in[RELAY_BUFSIZE], out[RELAY_BUFSIZE];
+	unsigned long hash = fileHash(uri);
+	cache_object *obj;
+	cache_entry entry;
+	response_head rh;
+	cache_meta meta;
+	z_stream z;
+	off_t offset;
+	FILE *fp;
+	int n, ok, err = Z_OK;
+	size_t len;
 	
-		while((d = readdir(dh)) != NULL) {
-			if(d->d_name[0] == '.') continue;
-			strcpy(filepath + 8, d->d_name);
-			stat(filepath, &file_info);
-			
-			time(&cur_time);
-			
-			if(difftime(cur_time, file_info.st_mtime) > timeout) {
-				remove(filepath);
+	obj = index_open(uri, hash, &entry, NULL);
+	if(obj == NULL) return;
+	sprintf(variant, "%s" VARIANT_GZIP, uri);
+	if(time(NULL) >= entry.expires || !read_cached_head(obj, head, &rh) || obj->end - obj->start - rh.head_len < COMPRESS_MIN
+		|| (fp = open_cache_entry(variant, path)) == NULL) {
+		close_cache_object(obj);
+		return;
+	}
+	write_variant_head(fp, head, &rh);
+	
+	//a window of 15 + 16 asks for a gzip wrapper rather than a zlib one
+	memset(&z, 0, sizeof(z));
+	ok = deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+	offset = obj->start + rh.head_len;
+	while(ok) {
+		n = pread(obj->fd, in, obj->end - offset < sizeof(in) ? obj->end - offset : sizeof(in), offset);
+		if(n < 0) perror("reading response to compress");
+		if(n <= 0) {
+			ok = 0;
+			break;
+		}
+		offset += n;
+		z.next_in = (unsigned char *) in;
+		z.avail_in = n;
+		do {
+			z.next_out = (unsigned char *) out;
+			z.avail_out = sizeof(out);
+			err = deflate(&z, offset == obj->end ? Z_FINISH : Z_NO_FLUSH);
+			len = sizeof(out) - z.avail_out;
+			if(err == Z_STREAM_ERROR || fwrite(out, 1, len, fp) != len) ok = 0;
+		} while(ok && z.avail_out == 0);
+		if(offset == obj->end) break;
+	}
+	
+	//a variant cut short by a full disk or a stream left unfinished would be served whole on every hit
+	if(ok && (err != Z_STREAM_END || fflush(fp) != 0)) {
+		perror("writing gzip variant");
+		ok = 0;
+	}
+	if(ok) {
+		stat_add(STAT_VARIANTS, 1);
+		stat_add(STAT_COMPRESS_IN, z.total_in);
+		stat_add(STAT_COMPRESS_OUT, z.total_out);
+	}
+	deflateEnd(&z);
+	close_cache_object(obj);
+	
+	//the variant stays fresh for as long as the response it was made of, and is revalidated along with it
+	meta.storable = 1;
+	meta.explicit = 1;
+	meta.lifetime = entry.expires - time(NULL);
+	meta.validators = entry.validators;
+	meta.vary = NULL;
+	meta.compressible = 0;
+	close_cache_entry(variant, fp, path, ok, &meta);
+}
+
+//writes the head of a gzip variant, made from the head of the response it is made of: the same headers without the
+//length, which hits work out from the variant's own size, with the encoding added and a strong ETag of its own,
+//since an ETag names one exact body
+void write_variant_head(FILE *fp, char *head, response_head *rh) {
+	char *line, *next, *end = head + rh->head_len - 2, *value, *quote;
+	
+	for(line = head; line < end; line = next) {
+		next = memchr(line, '\n', end - line);
+		next = next ? next + 1 : end;
+		if(header_value(line, next, "Content-Length")) continue;
+		
+		if((value = header_value(line, next, "ETag")) && (quote = memrchr(value, '"', next - value)) != NULL && quote > value) {
+			fwrite(line, 1, quote - line, fp);
+			fputs("-gzip", fp);
+			fwrite(quote, 1, next - quote, fp);
+		}
+		else fwrite(line, 1, next - line, fp);
+	}
+	fputs("Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n\r\n", fp);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//if requested file is not found in cache, forward request to server and response back to client
+//then cache server's response. flight, unless NULL, is the download other clients are following and
+//is finished here. if the cache holds a stale copy that can be revalidated, the server is only asked
+//whether it changed. returns whether the client's connection can stay open
+int forward_and_cache(char *version, int client_sock, request_head *req, char *uri, int keep_alive, inflight *flight) {
+	char *hostname, *file;
+	char head[HEADSIZE], origin[ORIGIN_SIZE];
+	int server_sock, reused, head_fill, head_status, reusable;
+	char uri_copy[strlen(uri)+1];
+	int err;
+	long stale_lifetime, sent;
+	unsigned long sent_at;
+	response_head rh;
+	forward_request forward;
+	cache_object *stale = NULL;
+	struct timeval idle = {KEEPALIVE_TIMEOUT, 0};
+	
+	strcpy(uri_copy, uri);
+	
+	//set up connection to server
+	err = parse_uri(uri_copy, &hostname, &file);
+	if(err==0) err = check_origin(hostname, origin);
+	if(err!=0) {
+		inflight_finish(flight, 0);
+		send_error_message(client_sock, err, version);
+		return 0;
+	}
+	
+	if(cache_timeout > 0) stale = find_stale(fileHash(uri), uri, req, forward.conditionals, &stale_lifetime);
+	build_forward_request(&forward, version, req, file, stale != NULL);
+	
+	//a pooled connection the server quietly dropped is retried once on a fresh connection
+	server_sock = pool_get(origin, 0);
+	reused = server_sock >= 0;
+	while(1) {
+		if(server_sock < 0) {
+			err = connect_to_host(&server_sock, origin);
+			if(err!=0) {
+				inflight_finish(flight, 0);
+				if(stale) close_cache_object(stale);
+				send_error_message(client_sock, err, version);
+				return 0;
 			}
 		}
 		
-		sem_post(&wrt);  //if deadlock, try switching these and see what happens
-		sem_wait(&mutex);
-		writers--;
-		sem_post(&mutex);
+		//a server that goes silent fails the download rather than holding this thread, and every follower of it, forever
+		if(setsockopt(server_sock, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle)) < 0) perror("setting server receive timeout");
+		
+		head_fill = 0;
+		head_status = 0;
+		sent = 0;
+		if(forward_send(server_sock, &forward, &sent) < 0) perror("writing request to server");
+		else {
+			sent_at = now_us();
+			head_status = recv_response_head(server_sock, head, &head_fill, &rh);
+			if(head_status == 1) upstream_time(HIST_FIRST_BYTE, now_us() - sent_at);
+		}
 		
-		if(timeout==0) break;
+		if(head_fill > 0 || !reused) break;
+		if(close(server_sock) < 0) perror("closing socket");
+		server_sock = -1;
+		reused = 0;
+	}
+	
+	if(stale && head_status == 1 && rh.status == 304) {
+		//the cached copy is still good, so it is refreshed and sent instead of the server's reply
+		revalidated(uri, head, &rh, stale_lifetime);
+		inflight_finish(flight, 0);
+		reusable = rh.keep_alive && head_fill == rh.head_len;
+		keep_alive = send_cached_response(client_sock, stale, req, keep_alive);
+	}
+	else {
+		if(stale) close_cache_object(stale);
+		keep_alive = cache_response(uri, req, client_sock, server_sock, keep_alive, head, head_fill, head_status == 1 ? &rh : NULL, &reusable, flight);
+	}
+	
+	if(reusable) pool_put(origin, server_sock);
+	else if(close(server_sock) < 0) perror("closing socket");
+	return keep_alive;
+}
+
+//lays out the http request from proxy to server in f, as pieces of the client's request rather than a copy of it.
+//file must stay put until f is sent. if revalidate is set, f->conditionals replaces any conditional headers of the client's own
+void build_forward_request(forward_request *f, char *version, request_head *req, char *file, int revalidate) {
+	int i, id;
+	
+	f->iovcnt = 0;
+	f->len = 0;
+	forward_add(f, "GET /", 5);
+	if(file!=NULL) forward_add(f, file, strlen(file));
+	forward_add(f, " ", 1);
+	if(version==NULL) version = "HTTP/1.1";
+	forward_add(f, version, strlen(version));
+	forward_add(f, "\r\n", 2);
+	
+	//pass on headers, ignoring anything related to persistent connections. those only describe the
+	//client's connection to us, and the server's connection is kept open only if it can go back in the pool
+	for(i = 0; i < req->nheaders; i++) {
+		id = req->headers[i].id;
+		if(id == HDR_CONNECTION || id == HDR_PROXY_CONNECTION || id == HDR_KEEP_ALIVE) continue;
+		if(revalidate && (id == HDR_IF_NONE_MATCH || id == HDR_IF_MODIFIED_SINCE)) continue;
+		forward_add(f, req->buf + req->headers[i].name, req->headers[i].line_len);
+	}
+	
+	if(revalidate) forward_add(f, f->conditionals, strlen(f->conditionals));
+	if(pool_max_idle > 0) forward_add(f, "Connection: keep-alive\r\n\r\n", 26);
+	else forward_add(f, "Connection: close\r\n\r\n", 21);
+}
+
+//appends a piece to f, or grows the last piece if this one carries straight on from it, as the client's headers mostly do
+void forward_add(forward_request *f, char *data, long len) {
+	struct iovec *v = &f->iov[f->iovcnt];
+	
+	if(f->iovcnt > 0 && (char *) v[-1].iov_base + v[-1].iov_len == data) v[-1].iov_len += len;
+	else {
+		v->iov_base = data;
+		v->iov_len = len;
+		f->iovcnt++;
+	}
+	f->len += len;
+}
+
+//writes f to the server with writev, starting sent bytes in and adding to sent as it goes
+//returns 1 once all of it is written, 0 if a non-blocking socket is full, or -1 on error
+int forward_send(int sock, forward_request *f, long *sent) {
+	struct iovec iov[FORWARD_IOVS];
+	ssize_t written;
+	long skip;
+	int i;
+	
+	while(*sent < f->len) {
+		//the pieces still to go, starting partway into the first
+		skip = *sent;
+		for(i = 0; skip >= f->iov[i].iov_len; i++) skip -= f->iov[i].iov_len;
+		memcpy(iov, f->iov + i, (f->iovcnt - i) * sizeof(struct iovec));
+		iov[0].iov_base = (char *) iov[0].iov_base + skip;
+		iov[0].iov_len -= skip;
 		
-		sleep(timeout);
+		written = writev(sock, iov, f->iovcnt - i);
+		if(written < 0 && errno == EINTR) continue;
+		if(written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+		if(written < 0) return -1;
+		*sent += written;
+	}
+	return 1;
+}
+
+//parses uri, checks uri is of valid format
+int parse_uri(char *uri, char **hostname, char **file) {
+	char *protocol;
+	
+	protocol = strtok(uri, ":/");
+	if(protocol==NULL || strcmp(protocol, "http")!= 0)
+		return 400;
+	
+	*hostname = strtok(NULL, "/");
+	if(*hostname==NULL)
+		return 404;
+	
+	*file = strtok(NULL, " \r\n");
+	return 0;
+}
+
+//looks up an origin ("host:port", see check_origin) and connects to it, racing its addresses (see the connect race
+//section). returns 0 with a blocking socket in server_sock, or the error to send the client
+int connect_to_host(int *server_sock, char *origin) {
+	char host[ORIGIN_SIZE];
+	connect_race race;
+	dns_answer a;
+	int port, err;
+	
+	err = origin_split(origin, host, &port);
+	if(err==0) err = dns_resolve(host, &a);
+	if(err==0) err = race_start(&race, &a, port);
+	if(err!=0) return err;
+	
+	while((err = race_step(&race, server_sock)) == -1) {
+		if(poll(race.attempts, race.nattempts, race_wait(&race)) < 0 && errno != EINTR) {
+			perror("waiting on connect");
+			race_abandon(&race);
+			return 502;
+		}
+	}
+	if(err!=0) return err;
+	
+	if(fcntl(*server_sock, F_SETFL, fcntl(*server_sock, F_GETFL) & ~O_NONBLOCK) < 0) perror("making server socket blocking");
+	return 0;
+}
+
+//checks the uri's host against the blocklist and builds its lowercase "host:port" origin key
+//returns 0, or the error to send the client
+int check_origin(char *hostname, char *origin) {
+	char *port, *bracket;
+	int host_len, i;
+	
+	//an IPv6 address is bracketed, since it has colons of its own
+	if(hostname[0] == '[') {
+		bracket = strchr(hostname, ']');
+		if(bracket == NULL || (bracket[1] != '\0' && bracket[1] != ':')) return 400;
+		port = bracket[1] == ':' ? bracket + 1 : NULL;
 	}
+	else port = strchr(hostname, ':');
+	host_len = port ? port - hostname : strlen(hostname);
+	
+	if(host_len == 0 || host_len >= ORIGIN_SIZE - 8 || (port && strlen(port + 1) >= 6)) return 400;
+	
+	memcpy(origin, hostname, host_len);
+	origin[host_len] = '\0';
+	if(blocklisted(origin)) return 403;
+	
+	for(i = 0; i < host_len; i++)
+		if(origin[i] >= 'A' && origin[i] <= 'Z') origin[i] += 'a' - 'A';
+	sprintf(origin + host_len, ":%s", port && port[1] ? port + 1 : "80");
+	return 0;
+}
+
+//splits an origin key into its host, without the brackets of an IPv6 address, and its port.
+//returns 0, or 400 if the port isn't a number
+int origin_split(char *origin, char *host, int *port) {
+	char *colon = strrchr(origin, ':'), *end;
+	int bracketed = origin[0] == '[' && colon[-1] == ']';
+	
+	memcpy(host, origin + bracketed, colon - origin - 2 * bracketed);
+	host[colon - origin - 2 * bracketed] = '\0';
+	*port = strtol(colon + 1, &end, 10);
+	if(*end != '\0' || *port <= 0 || *port > 65535) return 400;
+	return 0;
+}
+
+//reads from the server until head holds its whole response head, leaving the count read in head_fill
+//returns 1 once the head is parsed into rh, 0 if the server closed first, -1 if the head can't be parsed
+int recv_response_head(int server_sock, char *head, int *head_fill, response_head *rh) {
+	int byte_transfer, status = 0;
+	
+	while((byte_transfer = recv(server_sock, head + *head_fill, HEADSIZE - *head_fill, 0)) > 0) {
+		stat_add(STAT_SERVER_BYTES, byte_transfer);
+		*head_fill += byte_transfer;
+		status = parse_response_head(head, *head_fill, rh);
+		if(status != 0) break;
+	}
+	return status;
+}
+
+//this function caches the response from the server and forwards it to client. the response head has
+//already been read into head (rh is NULL if it couldn't be parsed), and is reframed for the client.
+//request is what was sent to the server, which a response with Vary is stored against.
+//relaying stops where the response ends rather than waiting for the server to close, and reusable
+//says whether the server's connection is left clean for another request. if the client goes away, a response
+//being cached is still read to its end, since followers and later hits are waiting on it.
+//returns whether the client's connection can stay open
+int cache_response(char *uri_copy, request_head *request, int client_sock, int server_sock, int keep_alive, char *head, int head_fill, response_head *rh, int *reusable, inflight *flight) {
+	int byte_transfer, head_len, received, complete, spliced = 0, fp_failed = 0, client_gone = 0;
+	char hash_str[100];
+	char buffer[RELAY_BUFSIZE], client_head[HEADSIZE + 256];
+	char *body;
+	FILE *fp;
+	body_framer framer;
+	splice_relay relay;
+	cache_meta meta;
+	
+	//dynamic content, and anything the response says not to keep, is relayed but not cached
+	meta.vary = NULL;
+	fp = open_cache_entry(uri_copy, hash_str);
+	if(fp && rh) response_meta(head, rh, request, &meta);
+	if(fp && (rh == NULL || !meta.storable)) {
+		close_cache_entry(uri_copy, fp, hash_str, 0, NULL);
+		fp = NULL;
+	}
+	
+	//followers can't share a response that isn't cached, they fetch their own
+	if(fp) inflight_start(flight, fp);
+	else {
+		inflight_finish(flight, 0);
+		flight = NULL;
+	}
+	*reusable = 0;
+	
+	head_len = -1;
+	if(rh) {
+		body_framer_init(&framer, rh);
+		if(framer.mode == BODY_CLOSE) keep_alive = 0;
+		head_len = rewrite_response_head(head, rh, client_head, sizeof(client_head), keep_alive, -1, NULL, fp && meta.compressible);
+		*reusable = rh->keep_alive && framer.mode != BODY_CLOSE;
+	}
+	
+	if(head_fill == 0) {
+		//the server hung up without answering
+		send_error_message(client_sock, 502, NULL);
+		framer.done = 0;
+		framer.mode = BODY_LENGTH;
+		byte_transfer = -1;
+	}
+	else if(head_len > 0) {
+		if(socket_write(client_sock, client_head, head_len) < 0) {
+			perror("writing response head to client");
+			client_gone = 1;
+		}
+		if(fp) write_cache_head(fp, head, rh);
+		
+		//whatever came in behind the head is the start of the body
+		body = head + rh->head_len;
+		byte_transfer = body_consume(&framer, body, head_fill - rh->head_len, fp);
+		if(byte_transfer != head_fill - rh->head_len) *reusable = 0;
+	}
+	else {
+		//a head that can't be parsed is passed along untouched, and the server's close ends it
+		framer.mode = BODY_CLOSE;
+		framer.done = 0;
+		keep_alive = 0;
+		*reusable = 0;
+		body = head;
+		byte_transfer = head_fill;
+	}
+	
+	if(byte_transfer > 0 && !client_gone && socket_write(client_sock, body, byte_transfer) < 0) {
+		perror("writing start of body to client");
+		client_gone = 1;
+	}
+	if(client_gone && fp == NULL) byte_transfer = -1;
+	inflight_publish(flight, fp);
+	
+	//bodies delimited by length or by the server closing don't need to be looked at, so they are spliced.
+	//chunked bodies have to be parsed to find their end and take the buffered path below
+	if(byte_transfer >= 0 && !framer.done && (framer.mode == BODY_LENGTH || framer.mode == BODY_CLOSE) && splice_relay_open(&relay, fp) == 0) {
+		spliced = 1;
+		while(!framer.done) {
+			received = splice_relay_fill(&relay, server_sock, framer.mode == BODY_LENGTH && framer.remaining < relay.size ? framer.remaining : relay.size, 0);
+			if(received < 0 && errno == EINTR) continue;
+			if(received < 0 && atomic_load(&splice_unsupported)) {
+				//nothing was lost, carry on with the buffered relay
+				spliced = 0;
+				received = 0;
+				break;
+			}
+			if(received <= 0) break;
+			byte_transfer = body_consume(&framer, NULL, received, NULL);
+			inflight_publish(flight, fp);
+			
+			if(!client_gone && splice_relay_send(&relay, client_sock) < 0) {
+				perror("splicing to client");
+				client_gone = 1;
+			}
+			if(client_gone && (fp == NULL || relay.cache_failed || splice_relay_discard(&relay) < 0)) {
+				received = -1;
+				break;
+			}
+		}
+		if(received < 0) byte_transfer = -1;
+		if(fp) splice_relay_finish_cache(&relay, fp);
+		if(relay.cache_failed) fp_failed = 1;
+		splice_relay_close(&relay);
+	}
+	
+	while(!spliced && byte_transfer >= 0 && !framer.done && (received = recv(server_sock, buffer, RELAY_BUFSIZE, 0)) > 0) {
+		stat_add(STAT_SERVER_BYTES, received);
+		//the body goes to the cache file as it is walked, and on to the client as it came
+		byte_transfer = body_consume(&framer, buffer, received, fp);
+		if(byte_transfer < 0) break;
+		
+		//anything the server sends past the end of the response means its connection can't be trusted
+		if(byte_transfer != received) *reusable = 0;
+		
+		if(!client_gone && socket_write(client_sock, buffer, byte_transfer) < 0) {
+			perror("writing body to client");
+			client_gone = 1;
+		}
+		inflight_publish(flight, fp);
+		if(client_gone && fp == NULL) {
+			byte_transfer = -1;
+			break;
+		}
+	}
+	if(byte_transfer >= 0 && !framer.done) byte_transfer = received;
+	
+	//a response cut short is not worth keeping, and leaves the client's framing broken
+	complete = framer.done || (framer.mode == BODY_CLOSE && byte_transfer == 0);
+	if(!complete || client_gone) keep_alive = 0;
+	if(!framer.done) *reusable = 0;
+	
+	//the index has the finished entry before followers are let go, so later misses find it there
+	inflight_publish(flight, fp);
+	if(fp) close_cache_entry(uri_copy, fp, hash_str, complete && !fp_failed, &meta);
+	inflight_finish(flight, fp && complete && !fp_failed);
+	free(meta.vary);
+	
+	return keep_alive;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//splice moves a body from the server socket into a pipe and from the pipe to the client socket inside the kernel,
+//and tee copies what is in the pipe into a second pipe that is spliced into the cache file, so neither the
+//client's copy nor the cache's ever passes through our buffers. splicing is given up on for good the first
+//time the kernel refuses it (splice_unsupported), and callers fall back to their buffered relay
+
+//creates the pipes for relaying one body, caching it into fp unless fp is NULL
+//returns 0, or -1 if the body should be relayed through a buffer instead
+int splice_relay_open(splice_relay *r, FILE *fp) {
+	long size;
+	
+	if(atomic_load(&splice_unsupported)) return -1;
+	
+	r->tee_fds[0] = r->tee_fds[1] = -1;
+	r->cache_fd = -1;
+	r->cache_failed = 0;
+	r->pending = 0;
+	if(pipe2(r->pipe_fds, O_CLOEXEC) < 0) {
+		perror("creating relay pipe");
+		return -1;
+	}
+	
+	//bigger pipes mean fewer calls per body, but the limit on them is up to the system
+	fcntl(r->pipe_fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+	r->size = fcntl(r->pipe_fds[1], F_GETPIPE_SZ);
+	
+	if(fp) {
+		//the head has to reach the file before any of the body does
+		if(fflush(fp) != 0 || pipe2(r->tee_fds, O_CLOEXEC) < 0) {
+			perror("setting up cache pipe");
+			r->cache_failed = 1;
+		}
+		else {
+			//tee only copies as much as the second pipe has room for, so both are kept the same size
+			fcntl(r->tee_fds[1], F_SETPIPE_SZ, r->size);
+			size = fcntl(r->tee_fds[1], F_GETPIPE_SZ);
+			if(size < r->size) r->size = size;
+			r->cache_fd = fileno(fp);
+		}
+	}
+	if(r->size <= 0) r->size = BUFSIZE;
+	
+	return 0;
+}
+
+//moves up to len bytes from the server into the pipe, and copies them into the cache file on the way
+//only call this once splice_relay_drain has emptied the pipe. returns the number of bytes moved, 0 once
+//the server has closed, or -1 with errno set. flags are passed on to splice, e.g. SPLICE_F_NONBLOCK
+ssize_t splice_relay_fill(splice_relay *r, int server_sock, long len, unsigned int flags) {
+	ssize_t n, copied, moved;
+	
+	n = splice(server_sock, NULL, r->pipe_fds[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE | flags);
+	if(n < 0 && (errno == EINVAL || errno == ENOSYS) && r->pending == 0) {
+		//this kernel or socket can't splice, nothing has been consumed so the caller can still fall back
+		atomic_store(&splice_unsupported, 1);
+		return -1;
+	}
+	if(n <= 0) return n;
+	stat_add(STAT_SERVER_BYTES, n);
+	r->pending += n;
+	
+	if(r->cache_fd >= 0) {
+		copied = tee(r->pipe_fds[0], r->tee_fds[1], n, 0);
+		for(moved = 0; copied == n && moved < n; moved += copied) {
+			copied = splice(r->tee_fds[0], NULL, r->cache_fd, NULL, n - moved, SPLICE_F_MOVE);
+			if(copied <= 0) break;
+		}
+		if(moved < n) {
+			//the client still gets its copy, the cache entry is dropped at the end
+			perror("splicing into cache file");
+			r->cache_fd = -1;
+			r->cache_failed = 1;
+		}
+	}
+	return n;
+}
+
+//sends what is waiting in the pipe to the client
+//returns 1 once the pipe is empty, 0 if some is still pending, -1 on error
+int splice_relay_drain(splice_relay *r, int client_sock, unsigned int flags) {
+	ssize_t n;
+	
+	while(r->pending > 0) {
+		n = splice(r->pipe_fds[0], NULL, client_sock, NULL, r->pending, SPLICE_F_MOVE | flags);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+		if(n <= 0) return -1;
+		client_sent(n);
+		r->pending -= n;
+	}
+	return 1;
+}
+
+//splice_relay_drain for a blocking client socket. splice keeps retrying on a full socket rather than keeping to its
+//send timeout, so this waits on the socket itself and gives up on a client that takes nothing for KEEPALIVE_TIMEOUT
+//seconds. returns 0 once the pipe is empty, or -1 on error or timeout
+int splice_relay_send(splice_relay *r, int client_sock) {
+	struct pollfd p = {client_sock, POLLOUT, 0};
+	ssize_t n;
+	
+	while(r->pending > 0) {
+		if(poll(&p, 1, KEEPALIVE_TIMEOUT * 1000) == 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		n = splice(r->pipe_fds[0], NULL, client_sock, NULL, r->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+		if(n <= 0) return -1;
+		client_sent(n);
+		r->pending -= n;
+	}
+	return 0;
+}
+
+//throws away what is waiting in the pipe, for a client that has gone away while the cache still takes the body
+//returns 0 once the pipe is empty, or -1 on error
+int splice_relay_discard(splice_relay *r) {
+	char buf[RELAY_BUFSIZE];
+	ssize_t n;
+	
+	while(r->pending > 0) {
+		n = read(r->pipe_fds[0], buf, r->pending < RELAY_BUFSIZE ? r->pending : RELAY_BUFSIZE);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return -1;
+		r->pending -= n;
+	}
+	return 0;
+}
+
+//done caching through the relay, leaves fp positioned at the end of what was spliced into it
+void splice_relay_finish_cache(splice_relay *r, FILE *fp) {
+	if(r->tee_fds[0] >= 0) {
+		close(r->tee_fds[0]);
+		close(r->tee_fds[1]);
+		r->tee_fds[0] = r->tee_fds[1] = -1;
+	}
+	r->cache_fd = -1;
+	
+	//the stream didn't see the spliced bytes, so make it look at the file again
+	fseek(fp, 0, SEEK_END);
+}
+
+void splice_relay_close(splice_relay *r) {
+	if(r->tee_fds[0] >= 0) {
+		close(r->tee_fds[0]);
+		close(r->tee_fds[1]);
+	}
+	close(r->pipe_fds[0]);
+	close(r->pipe_fds[1]);
+}
+
+//opens a new cache file for uri and writes the uri as its first line, leaving its path in hash_str.
+//the file is written under a temporary name and only renamed into place by close_cache_entry once it is
+//complete, so readers only ever open whole files and the entry it replaces keeps being served meanwhile
+//returns NULL without creating anything if the uri is dynamic content no cache key rule lets be cached
+FILE *open_cache_entry(char *uri, char *hash_str) {
+	unsigned long int hash = fileHash(uri);
+	char first_line[REQSIZE];
+	FILE *fp;
+	
+	//check that file is not dynamic content, see the cache keys section
+	if(!cacheable(uri)) return NULL;
+	
+	//the counter keeps two writers of the same hash apart
+	sprintf(hash_str, "./cache/%lu.tmp%lu", hash, atomic_fetch_add(&temp_files, 1));
+	
+	fp = fopen(hash_str, "w+");	//followers of an in-flight download read it back through a duplicate of this descriptor
+	if(fp==NULL) {
+		perror("opening cache file");
+		return NULL;
+	}
+	
+	bzero(first_line, REQSIZE);
+	strcpy(first_line, uri);
+	strcat(first_line, "\n");
+	fwrite(first_line, 1, strlen(first_line), fp);
+	
+	return fp;
+}
+
+//writes a response head to a cache file from open_cache_entry. a chunked body is stored without its framing (see
+//body_consume), so its head is stored without Transfer-Encoding, and without any Content-Length the chunking overrode.
+//hits then give the client the stored body's exact length
+void write_cache_head(FILE *fp, char *head, response_head *rh) {
+	char *line, *next, *end = head + rh->head_len;
+	
+	if(!rh->chunked) {
+		fwrite(head, 1, rh->head_len, fp);
+		return;
+	}
+	for(line = head; line < end; line = next) {
+		next = memchr(line, '\n', end - line);
+		next = next ? next + 1 : end;
+		if(line == head || (!header_value(line, next, "Transfer-Encoding") && !header_value(line, next, "Content-Length")))
+			fwrite(line, 1, next - line, fp);
+	}
+}
+
+//closes a cache file from open_cache_entry, adding it to the index with meta if the response was complete
+//and throwing it away if not, in which case meta can be NULL. with the log store on, a small enough
+//response is copied from the file into a segment and the file is thrown away either way
+void close_cache_entry(char *uri, FILE *fp, char *hash_str, int complete, cache_meta *meta) {
+	long size = ftell(fp);
+	time_t now = time(NULL);
+	off_t offset;
+	int segment = -1;
+	
+	if(fflush(fp) != 0) complete = 0;
+	if(complete && size <= log_segment_size / LOG_LARGE) segment = log_append(uri, fileno(fp), 0, size, now, &offset);
+	if(fclose(fp) != 0) {
+		perror("closing cache file");
+		complete = 0;
+	}
+	
+	//a response the log store couldn't take stays in its file
+	if(segment >= 0) {
+		remove(hash_str);
+		stat_add(STAT_SEGMENT_BYTES, LOG_RECORD_SIZE(size));
+		if(complete) index_insert(uri, fileHash(uri), LOG_RECORD_SIZE(size), now, NULL, meta, segment, offset);
+		log_release(segment);
+	}
+	else if(!complete || index_insert(uri, fileHash(uri), size, now, hash_str, meta, -1, 0) < 0) {
+		remove(hash_str);
+		complete = 0;
+	}
+	
+	if(complete && meta->compressible) compress_queue(uri);
+}
+
+//the server answered a revalidation of uri's stale copy with 304, so the copy is fresh again. the 304's own
+//lifetime is used if it gives one, otherwise the stored response's, which find_stale put in lifetime
+void revalidated(char *uri, char *head, response_head *rh, long lifetime) {
+	char variant[strlen(uri) + sizeof(VARIANT_GZIP)];
+	cache_meta meta;
+	
+	response_meta(head, rh, NULL, &meta);
+	index_refresh(uri, fileHash(uri), meta.explicit ? meta.lifetime : lifetime);
+	
+	//a gzip variant is of the same response, so it is still good too
+	if(compress_threads > 0) {
+		sprintf(variant, "%s" VARIANT_GZIP, uri);
+		index_refresh(variant, fileHash(variant), meta.explicit ? meta.lifetime : lifetime);
+	}
+	stat_add(STAT_REVALIDATIONS, 1);
+	access_cache(ACCESS_REVALIDATED);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//this function finds the cached response if it exists and is fresh, for request unless it is NULL
+//the index answers misses and expired entries without touching the disk
+cache_object *find(unsigned long int hash, char *uri, int timeout, request_head *request) {
+	if(timeout==0) return NULL;
+
+	cache_entry entry;
+	cache_object *obj = index_open(uri, hash, &entry, request);
+	
+	if(obj && time(NULL) >= entry.expires) {
+		close_cache_object(obj);
+		return NULL;
+	}
+	return obj;
+}
+
+//opens a cache file and checks its uri line, returns NULL unless it is there and holds uri
+cache_object *open_cache_file(char *path, char *uri) {
+	int len = strlen(uri) + 1;
+	char first_line[len];
+	cache_object *obj;
+	struct stat file_info;
+	int fd;
+	
+	//files only appear under their final name once complete, and an open file stays readable after being
+	//replaced or removed, so there is nothing to lock. the uri line is still checked, in case the file was
+	//replaced by another uri's after the index was read
+	fd = open(path, O_RDONLY);
+	if(fd < 0) return NULL;
+	if(pread(fd, first_line, len, 0) == len && memcmp(first_line, uri, len - 1) == 0 && first_line[len - 1] == '\n' && fstat(fd, &file_info) == 0) {
+		obj = malloc(sizeof(cache_object));
+		if(obj) {
+			obj->fd = fd;
+			obj->start = len;
+			obj->end = file_info.st_size;
+			obj->segment = -1;
+			obj->compressible = 0;
+			return obj;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+void close_cache_object(cache_object *obj) {
+	if(obj->segment >= 0) log_release(obj->segment);
+	else if(close(obj->fd) < 0) perror("closing file");
+	free(obj);
+}
+
+//opens uri's cached response if the index has an entry for request that is stale but can be revalidated, and writes the
+//headers that ask the server whether it changed into conditionals, which must hold CONDSIZE bytes.
+//lifetime gets how long the stored response said it stays fresh, for a 304 that doesn't say again
+cache_object *find_stale(unsigned long hash, char *uri, request_head *request, char *conditionals, long *lifetime) {
+	char head[HEADSIZE], *value, *value_end;
+	cache_entry entry;
+	response_head rh;
+	cache_meta meta;
+	cache_object *obj;
+	int len = 0, n;
+	
+	if((obj = index_open(uri, hash, &entry, request)) == NULL) return NULL;
+	if(!entry.validators || time(NULL) < entry.expires || !read_cached_head(obj, head, &rh)) {
+		close_cache_object(obj);
+		return NULL;
+	}
+	
+	if((value = response_header(head, &rh, "ETag", &value_end)) != NULL) {
+		n = snprintf(conditionals, CONDSIZE, "If-None-Match: %.*s\r\n", (int) (value_end - value), value);
+		if(n < CONDSIZE) len = n;
+	}
+	if((value = response_header(head, &rh, "Last-Modified", &value_end)) != NULL) {
+		n = snprintf(conditionals + len, CONDSIZE - len, "If-Modified-Since: %.*s\r\n", (int) (value_end - value), value);
+		if(n < CONDSIZE - len) len += n;
+	}
+	conditionals[len] = '\0';
+	if(len == 0) {
+		close_cache_object(obj);
+		return NULL;
+	}
+	
+	response_meta(head, &rh, NULL, &meta);
+	*lifetime = meta.lifetime;
+	return obj;
+}
+
+//parses the response head of a cached response into head, which must hold HEADSIZE bytes, and rh.
+//returns 1 if it could be parsed
+int read_cached_head(cache_object *obj, char *head, response_head *rh) {
+	int n;
+	
+	n = pread(obj->fd, head, obj->end - obj->start < HEADSIZE ? obj->end - obj->start : HEADSIZE, obj->start);
+	return n > 0 && parse_response_head(head, n, rh) == 1;
+}
+
+//this function removes cache files as they expire. the index schedules each file's expiry when it is added,
+//so instead of scanning the whole directory, each wakeup only touches the files that are due
+void *clear_cache (void *timeout_ptr) {
+	expiry_item due[256];
+	char dead[64];
+	time_t now;
+	int n, i;
+	
+	while(1) {
+		n = expiry_next(due, 256);
+		now = time(NULL);
+		for(i = 0; i < n; i++)
+			if(index_expire(due[i].hash, now, dead) && remove(dead) < 0) perror("removing expired cache file");
+	}
+}
+
+//expiry schedule: a min-heap of when each file the index has taken in is due to expire, which clear_cache waits on.
+//an entry replaced before its time leaves its old item in the heap, which index_expire then finds isn't due yet
+
+expiry_item *expiry_heap;
+long expiry_count, expiry_cap;
+pthread_mutex_t expiry_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t expiry_cond = PTHREAD_COND_INITIALIZER;
+
+void expiry_schedule(unsigned long hash, time_t expires) {
+	expiry_item *heap, item;
+	long i;
+	
+	pthread_mutex_lock(&expiry_lock);
+	if(expiry_count == expiry_cap) {
+		heap = realloc(expiry_heap, (expiry_cap ? expiry_cap * 2 : 1024) * sizeof(expiry_item));
+		if(heap == NULL) {
+			perror("malloc for expiry schedule");
+			pthread_mutex_unlock(&expiry_lock);
+			return;
+		}
+		expiry_heap = heap;
+		expiry_cap = expiry_cap ? expiry_cap * 2 : 1024;
+	}
+	
+	//sift up from the end
+	item.hash = hash;
+	item.expires = expires;
+	for(i = expiry_count++; i > 0 && expiry_heap[(i - 1) / 2].expires > expires; i = (i - 1) / 2)
+		expiry_heap[i] = expiry_heap[(i - 1) / 2];
+	expiry_heap[i] = item;
+	
+	//a new earliest deadline means clear_cache is sleeping too long
+	if(i == 0) pthread_cond_signal(&expiry_cond);
+	pthread_mutex_unlock(&expiry_lock);
+}
+
+//waits until at least one item is due, then takes up to max due items off the heap into due and returns how many
+int expiry_next(expiry_item *due, int max) {
+	struct timespec until;
+	expiry_item last;
+	long i, child;
+	int n = 0;
+	
+	pthread_mutex_lock(&expiry_lock);
+	while(expiry_count == 0 || expiry_heap[0].expires >= time(NULL)) {
+		if(expiry_count == 0) pthread_cond_wait(&expiry_cond, &expiry_lock);
+		else {
+			//files expire once the time is past their deadline, so wake a second after it
+			until.tv_sec = expiry_heap[0].expires + 1;
+			until.tv_nsec = 0;
+			pthread_cond_timedwait(&expiry_cond, &expiry_lock, &until);
+		}
+	}
+	
+	while(n < max && expiry_count > 0 && expiry_heap[0].expires < time(NULL)) {
+		due[n++] = expiry_heap[0];
+		
+		//sift the last item down from the top
+		last = expiry_heap[--expiry_count];
+		for(i = 0; (child = 2 * i + 1) < expiry_count; i = child) {
+			if(child + 1 < expiry_count && expiry_heap[child + 1].expires < expiry_heap[child].expires) child++;
+			if(last.expires <= expiry_heap[child].expires) break;
+			expiry_heap[i] = expiry_heap[child];
+		}
+		expiry_heap[i] = last;
+	}
+	pthread_mutex_unlock(&expiry_lock);
+	
+	return n;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//the cache index maps each cached uri to its file or log record, size, insertion time and expiry. it is split into
+//shards, each with its own lock and hash table, so lookups for different uris rarely wait on one another.
+//it is rebuilt from ./cache at startup and kept in step as responses are written and removed
+
+#define INDEX_SHARDS 64
+
+typedef struct {
+	pthread_rwlock_t lock;
+	cache_entry **buckets;
+	unsigned long nbuckets;
+	unsigned long count;
+} index_shard;
+
+index_shard cache_index[INDEX_SHARDS];
+
+cache_entry *index_find(index_shard *, char *, unsigned long, request_head *, cache_entry *);
+void index_grow(index_shard *);
+void index_unlink_hash(index_shard *, unsigned long);
+
+void index_init(void) {
+	int i;
+	
+	for(i = 0; i < INDEX_SHARDS; i++) {
+		pthread_rwlock_init(&cache_index[i].lock, NULL);
+		cache_index[i].nbuckets = 256;
+		cache_index[i].buckets = calloc(256, sizeof(cache_entry *));
+		cache_index[i].count = 0;
+		if(cache_index[i].buckets == NULL) {
+			perror("malloc for cache index");
+			exit(-1);
+		}
+	}
+}
+
+//reads the uri line and response head of every file already in ./cache and indexes it, using the file's mtime as its
+//insertion time, then does the same for the log store's segments. a response with Vary isn't indexed again,
+//since the request it was stored for is not known
+void index_rebuild(void) {
+	DIR *dh = opendir("./cache");
+	struct dirent *d;
+	struct stat file_info;
+	char filepath[300], first_line[REQSIZE], head[HEADSIZE];
+	unsigned long hash;
+	char *end;
+	FILE *fp;
+	cache_object obj;
+	response_head rh;
+	cache_meta meta;
+	
+	if(!dh) {
+		perror("opening directory");
+		return;
+	}
+	
+	while((d = readdir(dh)) != NULL) {
+		if(strncmp(d->d_name, "seg.", 4) == 0) log_adopt(d->d_name);
+		
+		//cache files are named by the hash of their uri, anything else isn't ours
+		hash = strtoul(d->d_name, &end, 10);
+		if(d->d_name[0] < '0' || d->d_name[0] > '9') continue;
+		snprintf(filepath, sizeof(filepath), "./cache/%s", d->d_name);
+		
+		//a file that was still being written when the last run stopped will never be finished
+		if(strncmp(end, ".tmp", 4) == 0) {
+			remove(filepath);
+			continue;
+		}
+		if(*end != '\0') continue;
+		fp = fopen(filepath, "r");
+		if(fp == NULL) continue;
+		
+		if(fgets(first_line, REQSIZE, fp) != NULL && fstat(fileno(fp), &file_info) == 0) {
+			obj.fd = fileno(fp);
+			obj.start = strlen(first_line);
+			obj.end = file_info.st_size;
+			first_line[strcspn(first_line, "\n")] = '\0';
+			meta.storable = 0;
+			if(fileHash(first_line) == hash && read_cached_head(&obj, head, &rh))
+				response_meta(head, &rh, NULL, &meta);
+			if(meta.storable)
+				index_insert(first_line, hash, file_info.st_size, file_info.st_mtime, NULL, &meta, -1, 0);
+			
+			//a file that can't be indexed is still removed once it would have expired
+			else expiry_schedule(hash, file_info.st_mtime + cache_timeout);
+		}
+		fclose(fp);
+	}
+	closedir(dh);
+	log_rebuild();
+}
+
+//copies the index entry for uri into entry, returns 0 if there isn't one. unless request is NULL,
+//an entry that varies only counts if request matches what it was stored for
+int index_lookup(char *uri, unsigned long hash, cache_entry *entry, request_head *request) {
+	index_shard *shard = &cache_index[hash % INDEX_SHARDS];
+	cache_entry *e;
+	
+	cache_rdlock(&shard->lock);
+	e = index_find(shard, uri, hash, request, entry);
+	pthread_rwlock_unlock(&shard->lock);
+	return e != NULL;
+}
+
+//looks up uri like index_lookup and opens the response the entry points at, returns NULL if either fails
+cache_object *index_open(char *uri, unsigned long hash, cache_entry *entry, request_head *request) {
+	index_shard *shard = &cache_index[hash % INDEX_SHARDS];
+	cache_object *obj = NULL;
+	cache_entry *e;
+	
+	cache_rdlock(&shard->lock);
+	e = index_find(shard, uri, hash, request, entry);
+	
+	//a segment isn't removed while the index points into it, so a reference taken under the lock keeps it open
+	if(e && e->segment >= 0 && (obj = malloc(sizeof(cache_object))) != NULL) {
+		obj->fd = log_take(e->segment);
+		obj->segment = e->segment;
+		obj->start = e->offset + sizeof(log_record) + strlen(uri) + 1;
+		obj->end = e->offset + e->size;
+	}
+	pthread_rwlock_unlock(&shard->lock);
+	
+	if(e && e->segment < 0) obj = open_cache_file(entry->path, uri);
+	if(obj) obj->compressible = entry->compressible;
+	return obj;
+}
+
+//finds the entry for uri and copies it into entry, the shard's lock must be held. unless request is NULL,
+//an entry that varies only counts if request matches what it was stored for
+cache_entry *index_find(index_shard *shard, char *uri, unsigned long hash, request_head *request, cache_entry *entry) {
+	cache_entry *e;
+	
+	for(e = shard->buckets[(hash / INDEX_SHARDS) % shard->nbuckets]; e; e = e->next) {
+		if(e->hash == hash && strcmp(e->uri, uri) == 0) {
+			if(e->vary && request && !vary_matches(e->vary, request)) return NULL;
+			*entry = *e;
+			entry->uri = NULL;
+			entry->vary = e->vary ? "" : NULL;
+			entry->next = NULL;
+			return e;
+		}
+	}
+	return NULL;
+}
+
+//doubles a shard's hash table, the shard's write lock must be held
+void index_grow(index_shard *shard) {
+	unsigned long nbuckets = shard->nbuckets * 2, i, b;
+	cache_entry **buckets = calloc(nbuckets, sizeof(cache_entry *));
+	cache_entry *e, *next;
+	
+	if(buckets == NULL) return;
+	for(i = 0; i < shard->nbuckets; i++) {
+		for(e = shard->buckets[i]; e; e = next) {
+			next = e->next;
+			b = (e->hash / INDEX_SHARDS) % nbuckets;
+			e->next = buckets[b];
+			buckets[b] = e;
+		}
+	}
+	free(shard->buckets);
+	shard->buckets = buckets;
+	shard->nbuckets = nbuckets;
+}
+
+//records a finished cache file for uri, fresh for as long as meta says. anything indexed under the same hash
+//shared its file, which now holds this uri, so it is dropped. unless from is NULL, the file is first renamed from
+//there into place, under the shard's lock so index_expire can't remove it in between. if segment isn't -1 the
+//response is instead the log record of size bytes at offset in that segment. returns -1 if it isn't indexed
+int index_insert(char *uri, unsigned long hash, long size, time_t inserted, char *from, cache_meta *meta, int segment, off_t offset) {
+	index_shard *shard = &cache_index[hash % INDEX_SHARDS];
+	cache_entry *e, **link;
+	time_t evict;
+	
+	e = calloc(1, sizeof(cache_entry));
+	if(e == NULL || (e->uri = strdup(uri)) == NULL || (meta->vary && (e->vary = strdup(meta->vary)) == NULL)) {
+		perror("malloc for cache index entry");
+		if(e) free(e->uri);
+		free(e);
+		return -1;
+	}
+	e->hash = hash;
+	snprintf(e->path, sizeof(e->path), "./cache/%lu", hash);
+	e->size = size;
+	e->segment = segment;
+	e->offset = offset;
+	e->inserted = inserted;
+	e->expires = inserted + meta->lifetime;
+	e->validators = meta->validators;
+	e->compressible = meta->compressible;
+	e->evict = evict = e->expires + (e->validators ? cache_timeout : 0);
+	
+	cache_wrlock(&shard->lock);
+	if(from && rename(from, e->path) < 0) {
+		perror("publishing cache file");
+		pthread_rwlock_unlock(&shard->lock);
+		free(e->uri);
+		free(e->vary);
+		free(e);
+		return -1;
+	}
+	index_unlink_hash(shard, hash);
+	if(shard->count >= shard->nbuckets * 2) index_grow(shard);
+	
+	link = &shard->buckets[(hash / INDEX_SHARDS) % shard->nbuckets];
+	e->next = *link;
+	*link = e;
+	shard->count++;
+	if(segment >= 0) log_live(segment, size);
+	pthread_rwlock_unlock(&shard->lock);
+	
+	//any copy of the old file in memory is out of date
+	ram_remove_hash(hash);
+	expiry_schedule(hash, evict);
+	return 0;
+}
+
+//makes uri's entry fresh for another lifetime seconds from now, after the server said its copy is still good.
+//the file's mtime, or the log record's insertion time, is what a restart goes by, so that moves too.
+//returns 0 if there is no entry
+int index_refresh(char *uri, unsigned long hash, long lifetime) {
+	index_shard *shard = &cache_index[hash % INDEX_SHARDS];
+	cache_entry *e;
+	time_t now = time(NULL), evict = 0;
+	char path[32];
+	int in_file = 0;
+	
+	cache_wrlock(&shard->lock);
+	for(e = shard->buckets[(hash / INDEX_SHARDS) % shard->nbuckets]; e; e = e->next) {
+		if(e->hash == hash && strcmp(e->uri, uri) == 0) {
+			e->inserted = now;
+			e->expires = now + lifetime;
+			e->evict = evict = e->expires + (e->validators ? cache_timeout : 0);
+			
+			//the record can't be moved by the compactor while the lock is held
+			if(e->segment >= 0) log_touch(e->segment, e->offset, now);
+			else in_file = 1;
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&shard->lock);
+	if(e == NULL) return 0;
+	
+	snprintf(path, sizeof(path), "./cache/%lu", hash);
+	if(in_file && utimes(path, NULL) < 0) perror("touching revalidated cache file");
+	expiry_schedule(hash, evict);
+	return 1;
+}
+
+//takes the cache file named by hash out of the index and out of the way if its entry has expired, or if it has
+//no entry at all. the check happens under the shard's lock, so a fresh file renamed into place by index_insert
+//is never taken by mistake. the file is only renamed to dead here, so the shard isn't held up by the unlink,
+//which is left to the caller. returns whether there is a file at dead to remove
+int index_expire(unsigned long hash, time_t now, char *dead) {
+	index_shard *shard = &cache_index[hash % INDEX_SHARDS];
+	cache_entry *e;
+	char path[32];
+	int expired = 1, moved = 0;
+	
+	snprintf(path, sizeof(path), "./cache/%lu", hash);
+	sprintf(dead, "./cache/%lu.tmp%lu", hash, atomic_fetch_add(&temp_files, 1));
+	
+	cache_wrlock(&shard->lock);
+	for(e = shard->buckets[(hash / INDEX_SHARDS) % shard->nbuckets]; e; e = e->next)
+		if(e->hash == hash) expired = now > e->evict;
+	
+	if(expired) {
+		index_unlink_hash(shard, hash);
+		moved = rename(path, dead) == 0;
+	}
+	pthread_rwlock_unlock(&shard->lock);
+	
+	if(expired) ram_remove_hash(hash);
+	return moved;
+}
+
+//unlinks and frees the entries for hash, the shard's write lock must be held
+void index_unlink_hash(index_shard *shard, unsigned long hash) {
+	cache_entry *e, **link;
+	
+	link = &shard->buckets[(hash / INDEX_SHARDS) % shard->nbuckets];
+	while((e = *link) != NULL) {
+		if(e->hash == hash) {
+			*link = e->next;
+			shard->count--;
+			if(e->segment >= 0) log_live(e->segment, -e->size);
+			free(e->uri);
+			free(e->vary);
+			free(e);
+		}
+		else link = &e->next;
+	}
+}
+
+//returns whether uri's entry is the log record at offset in segment
+int index_at(char *uri, unsigned long hash, int segment, off_t offset) {
+	index_shard *shard = &cache_index[hash % INDEX_SHARDS];
+	cache_entry *e;
+	int at = 0;
+	
+	cache_rdlock(&shard->lock);
+	for(e = shard->buckets[(hash / INDEX_SHARDS) % shard->nbuckets]; e; e = e->next)
+		if(e->hash == hash && strcmp(e->uri, uri) == 0) at = e->segment == segment && e->offset == offset;
+	pthread_rwlock_unlock(&shard->lock);
+	return at;
+}
+
+//points uri's entry at a copy of its log record the compactor made, unless the entry was replaced or dropped
+//while the copy was being made. returns whether it was moved
+int index_move(char *uri, unsigned long hash, int from, off_t from_offset, int to, off_t to_offset) {
+	index_shard *shard = &cache_index[hash % INDEX_SHARDS];
+	cache_entry *e;
+	int moved = 0;
+	
+	cache_wrlock(&shard->lock);
+	for(e = shard->buckets[(hash / INDEX_SHARDS) % shard->nbuckets]; e; e = e->next) {
+		if(e->hash == hash && strcmp(e->uri, uri) == 0 && e->segment == from && e->offset == from_offset) {
+			log_live(from, -e->size);
+			log_live(to, e->size);
+			e->segment = to;
+			e->offset = to_offset;
+			moved = 1;
+		}
+	}
+	pthread_rwlock_unlock(&shard->lock);
+	
+	//a mapping of the old record would keep the segment's disk space from being freed
+	if(moved) ram_remove_hash(hash);
+	return moved;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//the log store (-s) keeps small responses in large segment files, ./cache/seg.<n>, instead of a file each, so a
+//cache of millions of objects doesn't need millions of inodes or a directory that takes minutes to read, and a hit
+//doesn't need an open. finished responses are appended one after another to the active segment, which is
+//preallocated when it is started, and the index keeps each one's segment and offset. records are never changed
+//in place except for their insertion time, so a replaced or expired response only stops counting as live, and
+//the compactor moves what is still live out of mostly dead segments and then removes them whole.
+//readers take a reference to a segment under the index's lock, so the compactor can't close one being read
+
+#define SEG_FREE 0
+#define SEG_ACTIVE 1		//being appended to
+#define SEG_SEALED 2		//full, or found at startup
+
+typedef struct {
+	int state;
+	int fd;
+	uint64_t seq;
+	off_t fill;		//bytes appended so far, header included
+	atomic_long live;	//bytes of records the index points at
+	atomic_int refs;	//readers and writers using fd
+} log_segment;
+
+log_segment log_segments[LOG_SEGMENTS];
+int log_active = -1;
+uint64_t log_seq;
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int log_start(void);
+int log_copy(int, off_t, int, off_t, long);
+void log_compact(int);
+
+//appends the len bytes at offset in src, which start with uri's line, to the active segment as a record inserted
+//then, starting a new segment when it is full. *offset gets where the record starts. returns the segment with a
+//reference taken, so it can't be removed before the record is indexed, or -1 if the store is off or can't take it
+int log_append(char *uri, int src, off_t src_offset, long len, time_t inserted, off_t *offset) {
+	log_record rec;
+	log_segment *seg;
+	int n;
+	
+	if(log_segment_size <= 0) return -1;
+	rec.state = LOG_PENDING;
+	rec.uri_len = strlen(uri);
+	rec.size = LOG_RECORD_SIZE(len);
+	rec.inserted = inserted;
+	
+	cache_lock(&log_lock);
+	if(log_active >= 0 && log_segments[log_active].fill + rec.size > log_segment_size) {
+		log_segments[log_active].state = SEG_SEALED;
+		log_active = -1;
+	}
+	if(log_active < 0) log_active = log_start();
+	if((n = log_active) < 0) {
+		pthread_mutex_unlock(&log_lock);
+		return -1;
+	}
+	seg = &log_segments[n];
+	*offset = seg->fill;
+	seg->fill += rec.size;
+	atomic_fetch_add(&seg->refs, 1);
+	
+	//the record's head goes down first, so a rebuild after a crash can step over a record that was never finished
+	if(pwrite(seg->fd, &rec, sizeof(rec), *offset) != sizeof(rec)) {
+		perror("writing log record");
+		pthread_mutex_unlock(&log_lock);
+		log_release(n);
+		return -1;
+	}
+	pthread_mutex_unlock(&log_lock);
+	
+	rec.state = LOG_COMMITTED;
+	if(log_copy(src, src_offset, seg->fd, *offset + sizeof(rec), len) < 0 || pwrite(seg->fd, &rec.state, sizeof(rec.state), *offset) != sizeof(rec.state)) {
+		perror("writing log record");
+		log_release(n);
+		return -1;
+	}
+	return n;
+}
+
+//starts a new segment in a free slot and returns it, log_lock must be held. -1 if there is none or it can't be made
+int log_start(void) {
+	char path[32];
+	log_header h;
+	int n;
+	
+	for(n = 0; n < LOG_SEGMENTS && log_segments[n].state != SEG_FREE; n++);
+	if(n == LOG_SEGMENTS) return -1;
+	
+	snprintf(path, sizeof(path), "./cache/seg.%d", n);
+	log_segments[n].fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if(log_segments[n].fd < 0) {
+		perror("starting log segment");
+		return -1;
+	}
+	
+	//the blocks are allocated up front, so appends neither extend the file nor fragment it.
+	//a filesystem that can't preallocate just gets a sparse file of the same size
+	if(fallocate(log_segments[n].fd, 0, 0, log_segment_size) < 0 && ftruncate(log_segments[n].fd, log_segment_size) < 0) perror("sizing log segment");
+	
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, LOG_MAGIC, sizeof(h.magic));
+	h.seq = ++log_seq;
+	if(pwrite(log_segments[n].fd, &h, sizeof(h), 0) != sizeof(h)) {
+		perror("starting log segment");
+		close(log_segments[n].fd);
+		unlink(path);
+		return -1;
+	}
+	
+	log_segments[n].state = SEG_ACTIVE;
+	log_segments[n].seq = h.seq;
+	log_segments[n].fill = sizeof(h);
+	atomic_store(&log_segments[n].live, 0);
+	return n;
+}
+
+//copies len bytes between descriptors at the given offsets, in the kernel where it can
+int log_copy(int in, off_t in_offset, int out, off_t out_offset, long len) {
+	char buf[RELAY_BUFSIZE];
+	ssize_t n;
+	
+	while(len > 0) {
+		n = copy_file_range(in, &in_offset, out, &out_offset, len, 0);
+		if(n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+			n = pread(in, buf, len < sizeof(buf) ? len : sizeof(buf), in_offset);
+			if(n > 0 && pwrite(out, buf, n, out_offset) != n) n = -1;
+			if(n > 0) {
+				in_offset += n;
+				out_offset += n;
+			}
+		}
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+//takes a reference to segment n for reading and returns its descriptor. only index_open calls this, under the
+//shard's lock, while the index points into the segment
+int log_take(int n) {
+	atomic_fetch_add(&log_segments[n].refs, 1);
+	return log_segments[n].fd;
+}
+
+void log_release(int n) {
+	atomic_fetch_sub(&log_segments[n].refs, 1);
+}
+
+//adds to the bytes of segment n the index points at, which drops as records are replaced or expire
+void log_live(int n, long bytes) {
+	atomic_fetch_add(&log_segments[n].live, bytes);
+}
+
+//rewrites the insertion time of the record at offset in segment n, which a rebuild would otherwise go by
+void log_touch(int n, off_t offset, time_t inserted) {
+	int64_t t = inserted;
+	
+	if(pwrite(log_segments[n].fd, &t, sizeof(t), offset + offsetof(log_record, inserted)) != sizeof(t)) perror("touching revalidated log record");
+}
+
+//takes over a segment left in ./cache by the last run, named name, for log_rebuild to index
+void log_adopt(char *name) {
+	char path[300], *end;
+	log_header h;
+	long n = strtol(name + 4, &end, 10);
+	int fd;
+	
+	snprintf(path, sizeof(path), "./cache/%s", name);
+	if(*end != '\0' || end == name + 4 || n < 0 || n >= LOG_SEGMENTS) return;
+	
+	fd = open(path, O_RDWR);
+	if(fd < 0) {
+		perror("opening log segment");
+		return;
+	}
+	if(pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, LOG_MAGIC, sizeof(h.magic)) != 0) {
+		//a segment that never got its header has nothing in it, and one from another version can't be read
+		close(fd);
+		remove(path);
+		return;
+	}
+	
+	log_segments[n].state = SEG_SEALED;
+	log_segments[n].fd = fd;
+	log_segments[n].seq = h.seq;
+	log_segments[n].fill = sizeof(h);
+	if(h.seq > log_seq) log_seq = h.seq;
+}
+
+//indexes the whole records in the segments log_adopt took over, oldest segment first so a later copy of a uri
+//replaces an earlier one. a record that was still being written is stepped over, and anything that isn't a record
+//ends the segment. whatever isn't indexed is left for the compactor
+void log_rebuild(void) {
+	char uri[REQSIZE], head[HEADSIZE];
+	struct stat file_info;
+	log_record rec;
+	log_segment *seg;
+	cache_object obj;
+	cache_entry entry;
+	response_head rh;
+	cache_meta meta;
+	uint64_t last = 0, next;
+	unsigned long hash;
+	off_t offset;
+	int n, i;
+	
+	while(1) {
+		//the segment started next after last
+		for(n = -1, next = UINT64_MAX, i = 0; i < LOG_SEGMENTS; i++) {
+			if(log_segments[i].state == SEG_SEALED && log_segments[i].seq > last && log_segments[i].seq < next) {
+				n = i;
+				next = log_segments[i].seq;
+			}
+		}
+		if(n < 0) break;
+		last = next;
+		seg = &log_segments[n];
+		if(fstat(seg->fd, &file_info) < 0) continue;
+		
+		for(offset = seg->fill; offset + sizeof(rec) <= file_info.st_size; offset += rec.size) {
+			if(pread(seg->fd, &rec, sizeof(rec), offset) != sizeof(rec)) break;
+			if(rec.state != LOG_PENDING && rec.state != LOG_COMMITTED) break;
+			if(rec.size < LOG_RECORD_SIZE(rec.uri_len + 1) || offset + rec.size > file_info.st_size) break;
+			if(rec.state != LOG_COMMITTED || rec.uri_len >= REQSIZE) continue;
+			
+			if(pread(seg->fd, uri, rec.uri_len, offset + sizeof(rec)) != rec.uri_len) break;
+			uri[rec.uri_len] = '\0';
+			hash = fileHash(uri);
+			obj.fd = seg->fd;
+			obj.start = offset + sizeof(rec) + rec.uri_len + 1;
+			obj.end = offset + rec.size;
+			meta.storable = 0;
+			if(read_cached_head(&obj, head, &rh)) response_meta(head, &rh, NULL, &meta);
+			
+			//a file can hold the same uri too, and whichever was stored last wins
+			if(meta.storable && !(index_lookup(uri, hash, &entry, NULL) && entry.inserted > rec.inserted))
+				index_insert(uri, hash, rec.size, rec.inserted, NULL, &meta, n, offset);
+		}
+		seg->fill = offset;
+	}
+}
+
+//every LOG_COMPACT_SECONDS, compacts each sealed segment that is less than half live
+void *log_compactor(void *arg) {
+	int n, compact;
+	
+	while(1) {
+		sleep(LOG_COMPACT_SECONDS);
+		for(n = 0; n < LOG_SEGMENTS; n++) {
+			cache_lock(&log_lock);
+			compact = log_segments[n].state == SEG_SEALED && atomic_load(&log_segments[n].live) * 2 < log_segments[n].fill;
+			pthread_mutex_unlock(&log_lock);
+			if(compact) log_compact(n);
+		}
+	}
+	return NULL;
+}
+
+//appends the live records of segment n to the active segment and points the index at the copies, then removes
+//the segment once nothing points into it and nobody is reading it. with the store turned off, records can't be
+//moved, so a segment is only removed once everything in it has expired or been replaced
+void log_compact(int n) {
+	log_segment *seg = &log_segments[n];
+	char uri[REQSIZE], path[32];
+	log_record rec;
+	off_t offset, to;
+	int dest;
+	
+	for(offset = sizeof(log_header); log_segment_size > 0 && offset < seg->fill && atomic_load(&seg->live) > 0; offset += rec.size) {
+		if(pread(seg->fd, &rec, sizeof(rec), offset) != sizeof(rec) || rec.size < sizeof(rec)) break;
+		if(rec.state != LOG_COMMITTED || rec.uri_len >= REQSIZE) continue;
+		if(pread(seg->fd, uri, rec.uri_len, offset + sizeof(rec)) != rec.uri_len) break;
+		uri[rec.uri_len] = '\0';
+		
+		//most of the segment is dead, so check before copying
+		if(!index_at(uri, fileHash(uri), n, offset)) continue;
+		dest = log_append(uri, seg->fd, offset + sizeof(rec), rec.size - sizeof(rec), rec.inserted, &to);
+		if(dest < 0) break;
+		if(index_move(uri, fileHash(uri), n, offset, dest, to)) stat_add(STAT_COMPACTED_BYTES, rec.size);
+		log_release(dest);
+	}
+	
+	//nothing can take a new reference once the index doesn't point into the segment
+	cache_lock(&log_lock);
+	if(atomic_load(&seg->live) == 0 && atomic_load(&seg->refs) == 0) {
+		snprintf(path, sizeof(path), "./cache/seg.%d", n);
+		if(unlink(path) < 0) perror("removing log segment");
+		if(close(seg->fd) < 0) perror("closing log segment");
+		seg->state = SEG_FREE;
+		stat_add(STAT_SEGMENTS_FREED, 1);
+	}
+	pthread_mutex_unlock(&log_lock);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//the hot-object tier keeps whole responses in memory, so its hits need no file I/O at all. it holds at most
+//ram_budget bytes (-m) of copies, evicting least recently used objects first, and only copies objects up to a
+//sixteenth of the budget so one large file can't flush everything else out. larger objects are mapped instead,
+//read-only, up to map_budget bytes of address space (-M) under the same rules. a mapping costs no memory of its
+//own, since its pages are the page cache's, and every client hitting the object shares it. mappings are only
+//unmapped once they are evicted and their last reader is done. objects are promoted from the disk tier
+//when they are hit there, and dropped whenever the index drops, replaces or moves their file. objects evicted
+//from memory are still on disk. like the index, the tier is split into shards by hash, each with its own
+//lock, recency lists and share of the budgets, so hits on different objects rarely contend
+
+#define RAM_SHARDS 8
+#define RAM_BUCKETS 1024
+
+//a recency list, most recent first, and the bytes on it
+typedef struct {
+	ram_object *head, *tail;
+	long used;
+} ram_lru;
+
+typedef struct {
+	pthread_mutex_t lock;
+	ram_object *table[RAM_BUCKETS];
+	ram_lru copies, maps;
+} ram_shard;
+
+ram_shard ram_shards[RAM_SHARDS] = {[0 ... RAM_SHARDS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+
+//the recency list an object is on
+#define RAM_LRU(sh, o) ((o)->map ? &(sh)->maps : &(sh)->copies)
+
+void ram_unlink(ram_shard *, ram_object *);
+int ram_map(ram_object *, cache_object *);
+
+//finds a fresh object for uri and takes a reference to it, or returns NULL
+ram_object *ram_lookup(char *uri, unsigned long hash) {
+	ram_shard *sh = &ram_shards[hash % RAM_SHARDS];
+	ram_object *o;
+	ram_lru *l;
+	
+	if(ram_budget <= 0 && map_budget <= 0) return NULL;
+	
+	cache_lock(&sh->lock);
+	for(o = sh->table[(hash / RAM_SHARDS) % RAM_BUCKETS]; o; o = o->hnext)
+		if(o->hash == hash && strcmp(o->uri, uri) == 0) break;
+	
+	if(o && time(NULL) >= o->expires) {
+		ram_unlink(sh, o);
+		o = NULL;
+	}
+	else if(o) {
+		//move to the front of the recency list
+		l = RAM_LRU(sh, o);
+		if(o != l->head) {
+			o->prev->next = o->next;
+			if(o->next) o->next->prev = o->prev;
+			else l->tail = o->prev;
+			o->prev = NULL;
+			o->next = l->head;
+			l->head->prev = o;
+			l->head = o;
+		}
+		atomic_fetch_add(&o->refs, 1);
+	}
+	pthread_mutex_unlock(&sh->lock);
+	return o;
+}
+
+//copies or maps a cached response from find and adds it to the tier, evicting as needed
+//returns a referenced object, or NULL if the response is too big or memory is short
+ram_object *ram_promote(char *uri, unsigned long hash, cache_object *obj) {
+	ram_shard *sh = &ram_shards[hash % RAM_SHARDS];
+	long size = obj->end - obj->start, budget;
+	cache_entry entry;
+	ram_object *o, **link;
+	ram_lru *l;
+	int failed;
+	
+	if((ram_budget <= 0 || size > ram_budget / 16) && (map_budget <= 0 || size > map_budget / 16 || size == 0)) return NULL;
+	//a response that varies is only served after index_lookup has checked the request against it
+	if(!index_lookup(uri, hash, &entry, NULL) || entry.vary) return NULL;
+	
+	o = calloc(1, sizeof(ram_object));
+	if(o == NULL) return NULL;
+	o->size = size;
+	o->uri = strdup(uri);
+	if(ram_budget > 0 && size <= ram_budget / 16) {
+		o->data = malloc(size > 0 ? size : 1);
+		failed = o->data == NULL || pread(obj->fd, o->data, size, obj->start) != size;
+	}
+	else failed = ram_map(o, obj) < 0;
+	if(o->uri == NULL || failed) {
+		free(o->data);
+		free(o->uri);
+		free(o);
+		return NULL;
+	}
+	
+	o->hash = hash;
+	o->expires = entry.expires;
+	o->compressible = entry.compressible;
+	o->head_ok = parse_response_head(o->data, o->size < HEADSIZE ? o->size : HEADSIZE, &o->rh) == 1;
+	atomic_init(&o->refs, 2);
+	
+	cache_lock(&sh->lock);
+	
+	//another thread may have promoted the same uri first, this copy replaces it
+	for(link = &sh->table[(hash / RAM_SHARDS) % RAM_BUCKETS]; *link; link = &(*link)->hnext)
+		if((*link)->hash == hash && strcmp((*link)->uri, uri) == 0) break;
+	if(*link) ram_unlink(sh, *link);
+	
+	l = RAM_LRU(sh, o);
+	budget = (o->map ? map_budget : ram_budget) / RAM_SHARDS;
+	while(l->tail && l->used + o->size > budget) ram_unlink(sh, l->tail);
+	
+	o->hnext = sh->table[(hash / RAM_SHARDS) % RAM_BUCKETS];
+	sh->table[(hash / RAM_SHARDS) % RAM_BUCKETS] = o;
+	o->next = l->head;
+	if(l->head) l->head->prev = o;
+	l->head = o;
+	if(l->tail == NULL) l->tail = o;
+	o->linked = 1;
+	l->used += o->size;
+	pthread_mutex_unlock(&sh->lock);
+	
+	return o;
+}
+
+//maps the pages a cached response lies in, pointing o->data at the response. returns -1 if it can't be mapped
+int ram_map(ram_object *o, cache_object *obj) {
+	off_t first = obj->start & ~(off_t) (sysconf(_SC_PAGESIZE) - 1);
+	
+	o->map_len = obj->end - first;
+	o->map = mmap(NULL, o->map_len, PROT_READ, MAP_SHARED, obj->fd, first);
+	if(o->map == MAP_FAILED) {
+		perror("mapping cache file");
+		o->map = NULL;
+		return -1;
+	}
+	
+	//hits send the object front to back, so read ahead of them
+	if(madvise(o->map, o->map_len, MADV_SEQUENTIAL) < 0) perror("advising on cache file mapping");
+	o->data = o->map + (obj->start - first);
+	return 0;
+}
+
+//drops a reference taken by ram_lookup or ram_promote, freeing the object once it has been evicted and is unused
+void ram_release(ram_object *o) {
+	if(atomic_fetch_sub(&o->refs, 1) == 1) {
+		if(o->map == NULL) free(o->data);
+		else if(munmap(o->map, o->map_len) < 0) perror("unmapping cache file");
+		free(o->uri);
+		free(o);
+	}
+}
+
+//drops every object whose file is named by hash
+void ram_remove_hash(unsigned long hash) {
+	ram_shard *sh = &ram_shards[hash % RAM_SHARDS];
+	ram_object *o, *next;
+	
+	if(ram_budget <= 0 && map_budget <= 0) return;
+	
+	cache_lock(&sh->lock);
+	for(o = sh->table[(hash / RAM_SHARDS) % RAM_BUCKETS]; o; o = next) {
+		next = o->hnext;
+		if(o->hash == hash) ram_unlink(sh, o);
+	}
+	pthread_mutex_unlock(&sh->lock);
+}
+
+//takes an object out of its shard and drops the tier's reference, the shard's lock must be held
+void ram_unlink(ram_shard *sh, ram_object *o) {
+	ram_lru *l = RAM_LRU(sh, o);
+	ram_object **link;
+	
+	for(link = &sh->table[(o->hash / RAM_SHARDS) % RAM_BUCKETS]; *link != o; link = &(*link)->hnext);
+	*link = o->hnext;
+	
+	if(o->prev) o->prev->next = o->next;
+	else l->head = o->next;
+	if(o->next) o->next->prev = o->prev;
+	else l->tail = o->prev;
+	
+	o->linked = 0;
+	l->used -= o->size;
+	ram_release(o);
+}
+
+//rewrites an object's response head for the client into out and gives the body's offset and length in data, or
+//those of the range request asks for. works like load_cached_head, returning 0 with keep_alive cleared if the head can't be reframed
+int ram_head(ram_object *o, request_head *request, char *out, int out_size, int *keep_alive, off_t *body_off, long *body_len) {
+	int head_len = -1;
+	byte_range range;
+	
+	if(o->head_ok) {
+		*body_off = o->rh.head_len;
+		*body_len = o->size - o->rh.head_len;
+		range_select(request, o->data, &o->rh, *body_len, &range);
+		head_len = rewrite_response_head(o->data, &o->rh, out, out_size, *keep_alive, o->rh.chunked || o->rh.content_length >= 0 ? -1 : *body_len, &range, o->compressible);
+	}
+	if(head_len > 0) {
+		*body_off += range.start;
+		*body_len = range.len;
+		return head_len;
+	}
+	
+	*body_off = 0;
+	*body_len = o->size;
+	*keep_alive = 0;
+	return 0;
+}
+
+//sends a response held in memory to the client, head and body together in one writev where the socket takes it.
+//returns whether the client's connection can stay open
+int send_ram_response(int sock, ram_object *o, request_head *request, int keep_alive) {
+	char head[HEADSIZE + 256];
+	struct iovec iov[2];
+	int head_len, i = 0;
+	off_t body_off;
+	long body_len;
+	ssize_t n;
+	
+	head_len = ram_head(o, request, head, sizeof(head), &keep_alive, &body_off, &body_len);
+	iov[0].iov_base = head;
+	iov[0].iov_len = head_len;
+	iov[1].iov_base = o->data + body_off;
+	iov[1].iov_len = body_len;
+	
+	while(i < 2) {
+		n = writev(sock, iov + i, 2 - i);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0) {
+			perror("writing to socket");
+			return 0;
+		}
+		client_sent(n);
+		for(; i < 2 && n >= iov[i].iov_len; i++) n -= iov[i].iov_len;
+		if(i < 2) {
+			iov[i].iov_base += n;
+			iov[i].iov_len -= n;
+		}
+	}
+	return keep_alive;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//upstream connection pool: idle keep-alive connections are kept per origin ("host:port") so a cache miss
+//can skip the DNS lookup and TCP handshake. -p caps the idle connections kept per origin (0 turns pooling off)
+//and -i sets how many seconds one may sit idle before it is closed. pool_hits and pool_misses count how
+//often a miss found a warm connection
+
+typedef struct pooled_conn {
+	int sock;
+	time_t idle_since;
+	struct pooled_conn *next;
+} pooled_conn;
+
+typedef struct origin_pool {
+	char origin[ORIGIN_SIZE];
+	pooled_conn *idle;		//most recently used first
+	int idle_count;
+	struct origin_pool *next;
+} origin_pool;
+
+#define POOL_BUCKETS 256
+
+origin_pool *pool_table[POOL_BUCKETS];
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//takes a live idle connection to origin out of the pool, in blocking or non-blocking mode as asked
+//returns -1 if there isn't one
+int pool_get(char *origin, int nonblocking) {
+	origin_pool *op;
+	pooled_conn *pc;
+	int sock, flags;
+	time_t idle_since;
+	
+	if(pool_max_idle <= 0) return -1;
+	
+	while(1) {
+		pthread_mutex_lock(&pool_lock);
+		for(op = pool_table[fileHash(origin) % POOL_BUCKETS]; op; op = op->next)
+			if(strcmp(op->origin, origin) == 0) break;
+		pc = op ? op->idle : NULL;
+		if(pc) {
+			op->idle = pc->next;
+			op->idle_count--;
+		}
+		pthread_mutex_unlock(&pool_lock);
+		
+		if(pc == NULL) {
+			stat_add(STAT_POOL_MISSES, 1);
+			return -1;
+		}
+		
+		sock = pc->sock;
+		idle_since = pc->idle_since;
+		free(pc);
+		
+		//health check outside the lock, anything stale or already closed by the server is thrown away
+		if(time(NULL) - idle_since < pool_idle_timeout && pool_conn_alive(sock)) {
+			flags = fcntl(sock, F_GETFL);
+			fcntl(sock, F_SETFL, nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+			stat_add(STAT_POOL_HITS, 1);
+			return sock;
+		}
+		if(close(sock) < 0) perror("closing socket");
+	}
+}
+
+//returns a connection whose last response has been read completely to the pool, or closes it if the pool is full
+void pool_put(char *origin, int sock) {
+	origin_pool *op, **bucket;
+	pooled_conn *pc;
+	
+	if(pool_max_idle <= 0 || (pc = malloc(sizeof(pooled_conn))) == NULL) {
+		if(close(sock) < 0) perror("closing socket");
+		return;
+	}
+	pc->sock = sock;
+	pc->idle_since = time(NULL);
+	
+	pthread_mutex_lock(&pool_lock);
+	bucket = &pool_table[fileHash(origin) % POOL_BUCKETS];
+	for(op = *bucket; op; op = op->next)
+		if(strcmp(op->origin, origin) == 0) break;
+	if(op == NULL && (op = calloc(1, sizeof(origin_pool))) != NULL) {
+		strcpy(op->origin, origin);
+		op->next = *bucket;
+		*bucket = op;
+	}
+	
+	if(op && op->idle_count < pool_max_idle) {
+		pc->next = op->idle;
+		op->idle = pc;
+		op->idle_count++;
+		pc = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	
+	if(pc) {
+		if(close(sock) < 0) perror("closing socket");
+		free(pc);
+	}
+}
+
+//an idle connection should have nothing to read; end of file or stray data both mean it is unusable
+int pool_conn_alive(int sock) {
+	char c;
+	
+	return recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+//periodically closes pooled connections that have gone stale or been closed by their server
+void *pool_reaper(void *arg) {
+	origin_pool *op;
+	pooled_conn *pc, **link, *dead;
+	time_t now;
+	int i;
+	
+	while(1) {
+		sleep(pool_idle_timeout > 1 ? pool_idle_timeout / 2 : 1);
+		
+		dead = NULL;
+		now = time(NULL);
+		pthread_mutex_lock(&pool_lock);
+		for(i = 0; i < POOL_BUCKETS; i++) {
+			for(op = pool_table[i]; op; op = op->next) {
+				link = &op->idle;
+				while((pc = *link) != NULL) {
+					if(now - pc->idle_since >= pool_idle_timeout || !pool_conn_alive(pc->sock)) {
+						*link = pc->next;
+						op->idle_count--;
+						pc->next = dead;
+						dead = pc;
+					}
+					else link = &pc->next;
+				}
+			}
+		}
+		pthread_mutex_unlock(&pool_lock);
+		
+		while((pc = dead) != NULL) {
+			dead = pc->next;
+			if(close(pc->sock) < 0) perror("closing socket");
+			free(pc);
+		}
+	}
+	return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//blocklist: ./blocklist is compiled into memory at startup and again on SIGHUP, so checking a host never touches the
+//file. each line holds one entry, and # starts a comment:
+//	example.com		that name only
+//	.example.com		that name and every name under it, as does *.example.com
+//	192.0.2.1, 2001:db8::1	that address, when a uri gives it literally
+//	198.51.100.0/24		any address in the range, IPv4 or IPv6
+//names go in a hash set, and a host is checked by looking up it and then each of its parent domains, so a check costs
+//one lookup per label however long the list. address ranges go in two binary radix trees, IPv4 and IPv6, where a node
+//whose children are both BLOCK_ALL blocks everything under it and a check walks at most one node per address bit.
+//a reload builds the new blocklist on the side and swaps it in under blocklist_lock, which checks hold for reading
+
+#define BLOCKLIST_FILE "./blocklist"
+#define BLOCK_ALL 0xffffffffu	//child index that marks a node blocked along with everything under it
+#define BLOCK_V4 0		//roots of the radix trees
+#define BLOCK_V6 1
+
+typedef struct {
+	unsigned long hash;
+	int name;		//offset into names, -1 for an empty slot
+	int subdomains;		//set if names under this one are blocked as well
+} block_name;
+
+struct blocklist {
+	block_name *table;	//open addressing, a power of two long
+	unsigned long mask;
+	char *names;
+	int nnames, names_len, names_space;
+	unsigned int (*nodes)[2];	//radix tree nodes, each the index of its 0 and 1 children (0 for none)
+	int nnodes, nodes_space, nranges;
+};
+
+blocklist *active_blocklist;
+pthread_rwlock_t blocklist_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+blocklist *blocklist_compile(FILE *);
+void blocklist_free(blocklist *);
+int block_name_add(blocklist *, char *, int, block_name **, int *);
+int block_table_insert(blocklist *, block_name *);
+int block_name_match(blocklist *, char *, int);
+int block_range_add(blocklist *, char *);
+void block_range_insert(blocklist *, int, unsigned char *, int);
+int block_range_match(blocklist *, int, unsigned char *, int);
+
+//checks a uri's host, as the uri gave it, against the blocklist
+int blocklisted(char *host) {
+	char name[ORIGIN_SIZE], *p;
+	unsigned char addr[16];
+	int len = strlen(host), i, blocked = 0;
+	
+	if(len >= ORIGIN_SIZE) return 0;
+	pthread_rwlock_rdlock(&blocklist_lock);
+	if(active_blocklist == NULL) {
+		pthread_rwlock_unlock(&blocklist_lock);
+		return 0;
+	}
+	
+	if(host[0] == '[' && host[len - 1] == ']') {
+		memcpy(name, host + 1, len - 2);
+		name[len - 2] = '\0';
+	}
+	else {
+		for(i = 0; i <= len; i++) name[i] = host[i] >= 'A' && host[i] <= 'Z' ? host[i] + 'a' - 'A' : host[i];
+		if(len > 1 && name[len - 1] == '.') name[len - 1] = '\0';
+	}
+	
+	if(inet_pton(AF_INET, name, addr) == 1) blocked = block_range_match(active_blocklist, BLOCK_V4, addr, 32);
+	else if(inet_pton(AF_INET6, name, addr) == 1) {
+		//an IPv4 address written as IPv6 (::ffff:a.b.c.d) is checked as the IPv4 address it is
+		if(IN6_IS_ADDR_V4MAPPED((struct in6_addr *) addr)) blocked = block_range_match(active_blocklist, BLOCK_V4, addr + 12, 32);
+		else blocked = block_range_match(active_blocklist, BLOCK_V6, addr, 128);
+	}
+	else {
+		for(p = name; !blocked; p++) {
+			blocked = block_name_match(active_blocklist, p, p == name);
+			if((p = strchr(p, '.')) == NULL) break;
+		}
+	}
+	pthread_rwlock_unlock(&blocklist_lock);
+	return blocked;
+}
+
+//compiles ./blocklist and puts it in place of the one in use. a missing file blocks nothing, as it always has
+void blocklist_load(void) {
+	FILE *fp = fopen(BLOCKLIST_FILE, "r");
+	blocklist *bl = NULL, *old;
+	
+	if(fp != NULL) {
+		bl = blocklist_compile(fp);
+		fclose(fp);
+		if(bl == NULL) {
+			fprintf(stderr, "blocklist not loaded, keeping the one in use\n");
+			return;
+		}
+		fprintf(stderr, "loaded blocklist: %d names, %d address ranges\n", bl->nnames, bl->nranges);
+	}
+	
+	pthread_rwlock_wrlock(&blocklist_lock);
+	old = active_blocklist;
+	active_blocklist = bl;
+	pthread_rwlock_unlock(&blocklist_lock);
+	blocklist_free(old);
+}
+
+//reads a blocklist file into a new blocklist. returns NULL if memory runs out
+blocklist *blocklist_compile(FILE *fp) {
+	char line[512], *entry, *save;
+	unsigned char addr[4];
+	block_name *entries = NULL;
+	blocklist *bl = calloc(1, sizeof(blocklist));
+	int nentries, entries_space = 0, lineno = 0, size, len, i, ok = bl != NULL;
+	
+	//both roots start empty, and index 0 and 1 are never anyone's child, so 0 can mean none
+	if(ok) ok = (bl->nodes = calloc(bl->nodes_space = 1024, sizeof(*bl->nodes))) != NULL;
+	if(ok) bl->nnodes = 2;
+	
+	while(ok && fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if((entry = strchr(line, '#')) != NULL) *entry = '\0';
+		if((entry = strtok_r(line, " \t\r\n", &save)) == NULL) continue;
+		
+		if(strchr(entry, ':') || strchr(entry, '/') || inet_pton(AF_INET, entry, addr) == 1) {
+			if(!block_range_add(bl, entry)) {
+				fprintf(stderr, "blocklist line %d: %s is not an address or range\n", lineno, entry);
+				continue;
+			}
+			ok = bl->nodes != NULL;
+		}
+		else {
+			//a leading "." or "*." takes in the names under it
+			if(entry[0] == '*' && entry[1] == '.') entry++;
+			len = strlen(entry);
+			if(len > 1 && entry[len - 1] == '.') entry[--len] = '\0';
+			for(i = 0; i < len; i++)
+				if(entry[i] >= 'A' && entry[i] <= 'Z') entry[i] += 'a' - 'A';
+			ok = block_name_add(bl, entry + (entry[0] == '.'), entry[0] == '.', &entries, &entries_space);
+		}
+	}
+	
+	//the table is kept at most half full, so probes stay short. nnames ends up counting each name once
+	nentries = ok ? bl->nnames : 0;
+	for(size = 16; size < 2 * nentries; size *= 2);
+	if(ok) ok = (bl->table = malloc(size * sizeof(block_name))) != NULL;
+	if(ok) {
+		bl->mask = size - 1;
+		bl->nnames = 0;
+		for(i = 0; i < size; i++) bl->table[i].name = -1;
+		for(i = 0; i < nentries; i++) bl->nnames += block_table_insert(bl, &entries[i]);
+	}
+	free(entries);
+	if(!ok) {
+		perror("compiling blocklist");
+		blocklist_free(bl);
+		return NULL;
+	}
+	return bl;
+}
+
+void blocklist_free(blocklist *bl) {
+	if(bl == NULL) return;
+	free(bl->table);
+	free(bl->names);
+	free(bl->nodes);
+	free(bl);
+}
+
+//adds a name to the entries a blocklist's table is built from, its text to the blocklist's names.
+//returns 0 if memory runs out
+int block_name_add(blocklist *bl, char *name, int subdomains, block_name **entries, int *space) {
+	int len = strlen(name) + 1;
+	void *grown;
+	
+	if(len == 1) return 1;
+	if(bl->nnames == *space) {
+		*space = *space ? *space * 2 : 1024;
+		if((grown = realloc(*entries, *space * sizeof(block_name))) == NULL) return 0;
+		*entries = grown;
+	}
+	if(bl->names_len + len > bl->names_space) {
+		bl->names_space = bl->names_space ? bl->names_space * 2 : 16384;
+		if(bl->names_space < bl->names_len + len) bl->names_space = bl->names_len + len;
+		if((grown = realloc(bl->names, bl->names_space)) == NULL) return 0;
+		bl->names = grown;
+	}
+	
+	memcpy(bl->names + bl->names_len, name, len);
+	(*entries)[bl->nnames].hash = fileHash(name);
+	(*entries)[bl->nnames].name = bl->names_len;
+	(*entries)[bl->nnames++].subdomains = subdomains;
+	bl->names_len += len;
+	return 1;
+}
+
+//puts an entry in the table, folding it into an entry already there for the same name. returns 1 if it was a new name
+int block_table_insert(blocklist *bl, block_name *entry) {
+	unsigned long i;
+	block_name *slot;
+	
+	for(i = entry->hash & bl->mask; (slot = &bl->table[i])->name >= 0; i = (i + 1) & bl->mask) {
+		if(slot->hash == entry->hash && strcmp(bl->names + slot->name, bl->names + entry->name) == 0) {
+			slot->subdomains |= entry->subdomains;
+			return 0;
+		}
+	}
+	*slot = *entry;
+	return 1;
+}
+
+//whether name, lowercase, is blocked: by an entry for it exactly if exact is set, or else by one taking in subdomains
+int block_name_match(blocklist *bl, char *name, int exact) {
+	unsigned long hash = fileHash(name), i;
+	block_name *slot;
+	
+	for(i = hash & bl->mask; (slot = &bl->table[i])->name >= 0; i = (i + 1) & bl->mask)
+		if(slot->hash == hash && strcmp(bl->names + slot->name, name) == 0) return exact || slot->subdomains;
+	return 0;
+}
+
+//parses an address or "address/prefix bits" range and adds it to its family's tree. returns 0 if it isn't one, and
+//leaves nodes NULL if memory ran out
+int block_range_add(blocklist *bl, char *range) {
+	unsigned char addr[16];
+	char *slash = strchr(range, '/'), *end;
+	int v6 = strchr(range, ':') != NULL, bits = v6 ? 128 : 32, ok;
+	
+	if(slash != NULL) {
+		bits = strtol(slash + 1, &end, 10);
+		if(end == slash + 1 || *end != '\0' || bits < 0 || bits > (v6 ? 128 : 32)) return 0;
+		*slash = '\0';
+	}
+	ok = inet_pton(v6 ? AF_INET6 : AF_INET, range, addr) == 1;
+	if(slash != NULL) *slash = '/';
+	if(!ok) return 0;
+	block_range_insert(bl, v6 ? BLOCK_V6 : BLOCK_V4, addr, bits);
+	bl->nranges++;
+	return 1;
+}
+
+//blocks every address whose first bits match addr's in the tree at root
+void block_range_insert(blocklist *bl, int root, unsigned char *addr, int bits) {
+	unsigned int node = root, bit;
+	void *grown;
+	int i;
+	
+	for(i = 0; i < bits; i++) {
+		//already inside a blocked range
+		if(bl->nodes[node][0] == BLOCK_ALL) return;
+		
+		bit = addr[i / 8] >> (7 - i % 8) & 1;
+		if(bl->nodes[node][bit] == 0) {
+			if(bl->nnodes == bl->nodes_space) {
+				bl->nodes_space *= 2;
+				if((grown = realloc(bl->nodes, bl->nodes_space * sizeof(*bl->nodes))) == NULL) {
+					free(bl->nodes);
+					bl->nodes = NULL;
+					return;
+				}
+				bl->nodes = grown;
+			}
+			bl->nodes[bl->nnodes][0] = bl->nodes[bl->nnodes][1] = 0;
+			bl->nodes[node][bit] = bl->nnodes++;
+		}
+		node = bl->nodes[node][bit];
+	}
+	
+	//anything that was under this node is now covered by it
+	bl->nodes[node][0] = bl->nodes[node][1] = BLOCK_ALL;
+}
+
+//whether addr, bits long, falls in a blocked range of the tree at root
+int block_range_match(blocklist *bl, int root, unsigned char *addr, int bits) {
+	unsigned int node = root;
+	int i;
+	
+	for(i = 0; bl->nodes[node][0] != BLOCK_ALL; i++) {
+		if(i == bits || (node = bl->nodes[node][addr[i / 8] >> (7 - i % 8) & 1]) == 0) return 0;
+	}
+	return 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//cache keys: a request's uri is rewritten into its cache key before anything looks it up, and the server is asked for
+//the key too, so what is cached under a key is what the key was answered with. every uri gets its scheme and host
+//lowercased, a default port dropped, escapes of characters that never need escaping decoded and the other escapes'
+//hex uppercased, none of which changes what it names. ./cachekeys, loaded at startup and again on SIGHUP, says what
+//to do with query strings, which are otherwise left alone and keep a response out of the cache. each line holds a
+//pattern and its options, and # starts a comment:
+//	api.example.com/v1/	that host, for paths starting with /v1/
+//	.example.com		that name and every name under it, as does *.example.com, for any path
+//	*			every uri
+//options are any of:
+//	cache			responses to uris with a query are cached
+//	sort			the query's parameters are sorted by name, repeated names keeping their order
+//	strip=utm_*,fbclid	those parameters are dropped. a name ending in * drops every name starting with the rest
+//the first line whose pattern matches is the one used. there are few enough lines that they are tried in order.
+//a reload compiles the new rules on the side and swaps them in under key_rules_lock, which lookups hold for reading
+
+#define KEY_RULES_FILE "./cachekeys"
+#define KEY_PARAMS 64		//most parameters a query can keep and still be sorted or stripped
+
+typedef struct {
+	char *host;		//lowercase, NULL for any host
+	int subdomains;		//set if names under host match as well
+	char *path;		//prefix the path must start with, NULL for any path
+	int cache, sort;
+	char **strip;		//parameter names to drop, NULL terminated. NULL for none
+} key_rule;
+
+typedef struct {
+	key_rule *rules;
+	int nrules;
+} key_rules;
+
+//one parameter of a query being rewritten
+typedef struct {
+	char *p;
+	int len, name_len;
+} key_param;
+
+key_rules *active_key_rules;
+pthread_rwlock_t key_rules_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+key_rules *key_rules_compile(FILE *);
+void key_rules_free(key_rules *);
+key_rule *key_rule_find(key_rules *, char *);
+char *key_query(key_rule *, char *, char *);
+int key_stripped(key_rule *, char *, int);
+int hex_digit(char);
+
+//rewrites uri where it lies into its cache key, which is never longer
+void cache_key(char *uri) {
+	char key[strlen(uri) + 1], *in, *out, *host_end, *port, c;
+	key_rule *r;
+	char *query = NULL;
+	
+	if(strncasecmp(uri, "http://", 7) != 0) return;
+	memcpy(key, "http://", 7);
+	in = uri + 7;
+	out = key + 7;
+	
+	//the host lowercased, and its port unless it is the default. an IPv6 address has colons of its own
+	host_end = in + strcspn(in, "/?");
+	port = in[0] == '[' ? memchr(in, ']', host_end - in) : in;
+	if(port) port = memchr(port, ':', host_end - port);
+	while(in < (port ? port : host_end)) {
+		c = *in++;
+		*out++ = c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+	}
+	if(port && host_end - port > 1 && !(host_end - port == 3 && port[1] == '8' && port[2] == '0')) {
+		memcpy(out, port, host_end - port);
+		out += host_end - port;
+	}
+	
+	//the path and query, with escapes of letters, digits and -._~ decoded
+	for(in = host_end; *in; ) {
+		if(*in == '?' && query == NULL) query = out;
+		if(in[0] == '%' && hex_digit(in[1]) >= 0 && hex_digit(in[2]) >= 0) {
+			c = hex_digit(in[1]) * 16 + hex_digit(in[2]);
+			if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' || c == '~') *out++ = c;
+			else {
+				*out++ = '%';
+				*out++ = in[1] >= 'a' ? in[1] - 'a' + 'A' : in[1];
+				*out++ = in[2] >= 'a' ? in[2] - 'a' + 'A' : in[2];
+			}
+			in += 3;
+		}
+		else *out++ = *in++;
+	}
+	*out = '\0';
+	
+	if(query) {
+		pthread_rwlock_rdlock(&key_rules_lock);
+		r = key_rule_find(active_key_rules, key);
+		if(r && (r->sort || r->strip)) out = key_query(r, query, out);
+		pthread_rwlock_unlock(&key_rules_lock);
+		*out = '\0';
+	}
+	memcpy(uri, key, out - key + 1);
+}
+
+//checks whether responses to uri, a cache key, may be cached. one with a query is only cached under a rule that says so
+int cacheable(char *uri) {
+	key_rule *r;
+	int cache;
+	
+	if(strchr(uri, '?') == NULL) return 1;
+	pthread_rwlock_rdlock(&key_rules_lock);
+	r = key_rule_find(active_key_rules, uri);
+	cache = r && r->cache;
+	pthread_rwlock_unlock(&key_rules_lock);
+	return cache;
+}
+
+//finds the first rule whose pattern matches uri, a cache key. key_rules_lock must be held. returns NULL if none does
+key_rule *key_rule_find(key_rules *kr, char *uri) {
+	char *host = uri + 7, *path, *port;
+	int host_len, n, i;
+	key_rule *r;
+	
+	if(kr == NULL) return NULL;
+	path = host + strcspn(host, "/?");
+	port = memchr(host, host[0] == '[' ? ']' : ':', path - host);
+	host_len = port ? port - host + (host[0] == '[') : path - host;
+	
+	for(i = 0; i < kr->nrules; i++) {
+		r = &kr->rules[i];
+		if(r->host) {
+			n = strlen(r->host);
+			if(!(host_len == n || (r->subdomains && host_len > n && host[host_len - n - 1] == '.')) || memcmp(host + host_len - n, r->host, n) != 0) continue;
+		}
+		if(r->path && strncmp(path, r->path, strlen(r->path)) != 0) continue;
+		return r;
+	}
+	return NULL;
+}
+
+//rewrites the query that starts with the ? at query and runs to end as rule says, leaving out the ? as well if no
+//parameters are left. returns the new end. a query with more than KEY_PARAMS parameters to keep is left as it is
+char *key_query(key_rule *rule, char *query, char *end) {
+	char copy[end - query], *p, *amp, *eq;
+	key_param params[KEY_PARAMS], t;
+	int n = 0, len = end - query - 1, i, j, cmp;
+	
+	memcpy(copy, query + 1, len);
+	for(p = copy; p < copy + len; p = amp + 1) {
+		amp = memchr(p, '&', copy + len - p);
+		if(amp == NULL) amp = copy + len;
+		if(amp == p) continue;
+		
+		eq = memchr(p, '=', amp - p);
+		t.p = p;
+		t.len = amp - p;
+		t.name_len = eq ? eq - p : t.len;
+		if(key_stripped(rule, t.p, t.name_len)) continue;
+		if(n == KEY_PARAMS) return end;
+		params[n++] = t;
+	}
+	
+	//an insertion sort, which keeps parameters with the same name in the order they came in
+	for(i = 1; rule->sort && i < n; i++) {
+		t = params[i];
+		for(j = i; j > 0; j--) {
+			cmp = memcmp(params[j - 1].p, t.p, params[j - 1].name_len < t.name_len ? params[j - 1].name_len : t.name_len);
+			if(cmp < 0 || (cmp == 0 && params[j - 1].name_len <= t.name_len)) break;
+			params[j] = params[j - 1];
+		}
+		params[j] = t;
+	}
+	
+	end = query;
+	for(i = 0; i < n; i++) {
+		*end++ = i == 0 ? '?' : '&';
+		memcpy(end, params[i].p, params[i].len);
+		end += params[i].len;
+	}
+	return end;
+}
+
+//checks whether rule strips the query parameter called name
+int key_stripped(key_rule *rule, char *name, int name_len) {
+	int i, n;
+	
+	for(i = 0; rule->strip && rule->strip[i]; i++) {
+		n = strlen(rule->strip[i]);
+		if(rule->strip[i][n - 1] == '*' ? name_len >= n - 1 && memcmp(name, rule->strip[i], n - 1) == 0 : name_len == n && memcmp(name, rule->strip[i], n) == 0) return 1;
+	}
+	return 0;
+}
+
+//the value of a hex digit, -1 if c isn't one
+int hex_digit(char c) {
+	if(c >= '0' && c <= '9') return c - '0';
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+//compiles ./cachekeys and puts it in place of the rules in use. a missing file leaves every query alone
+void key_rules_load(void) {
+	FILE *fp = fopen(KEY_RULES_FILE, "r");
+	key_rules *kr = NULL, *old;
+	
+	if(fp != NULL) {
+		kr = key_rules_compile(fp);
+		fclose(fp);
+		if(kr == NULL) {
+			fprintf(stderr, "cache key rules not loaded, keeping the ones in use\n");
+			return;
+		}
+		fprintf(stderr, "loaded cache key rules: %d patterns\n", kr->nrules);
+	}
+	
+	pthread_rwlock_wrlock(&key_rules_lock);
+	old = active_key_rules;
+	active_key_rules = kr;
+	pthread_rwlock_unlock(&key_rules_lock);
+	key_rules_free(old);
+}
+
+//reads a cache key rules file into new rules. returns NULL if memory runs out
+key_rules *key_rules_compile(FILE *fp) {
+	char line[512], *entry, *save, *name, *names_save, *slash;
+	key_rules *kr = calloc(1, sizeof(key_rules));
+	key_rule *r, *grown;
+	int space = 0, lineno = 0, n, i, ok = kr != NULL;
+	
+	while(ok && fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if((entry = strchr(line, '#')) != NULL) *entry = '\0';
+		if((entry = strtok_r(line, " \t\r\n", &save)) == NULL) continue;
+		
+		if(kr->nrules == space) {
+			space = space ? space * 2 : 16;
+			if((grown = realloc(kr->rules, space * sizeof(key_rule))) == NULL) {
+				ok = 0;
+				break;
+			}
+			kr->rules = grown;
+		}
+		r = &kr->rules[kr->nrules++];
+		memset(r, 0, sizeof(key_rule));
+		
+		//the pattern is a host, or * for any, and then maybe the start of a path
+		if((slash = strchr(entry, '/')) != NULL) {
+			ok = (r->path = strdup(slash)) != NULL;
+			*slash = '\0';
+		}
+		if(entry[0] == '*' && entry[1] == '.') entry++;
+		if(entry[0] == '.') {
+			r->subdomains = 1;
+			entry++;
+		}
+		for(i = 0; entry[i]; i++)
+			if(entry[i] >= 'A' && entry[i] <= 'Z') entry[i] += 'a' - 'A';
+		if(ok && entry[0] != '\0' && strcmp(entry, "*") != 0) ok = (r->host = strdup(entry)) != NULL;
+		
+		while(ok && (entry = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+			if(strcmp(entry, "cache") == 0) r->cache = 1;
+			else if(strcmp(entry, "sort") == 0) r->sort = 1;
+			else if(strncmp(entry, "strip=", 6) == 0 && r->strip == NULL) {
+				for(n = 1, name = entry; (name = strchr(name, ',')) != NULL; name++) n++;
+				ok = (r->strip = calloc(n + 1, sizeof(char *))) != NULL;
+				for(i = 0, name = strtok_r(entry + 6, ",", &names_save); ok && name; name = strtok_r(NULL, ",", &names_save))
+					ok = (r->strip[i++] = strdup(name)) != NULL;
+			}
+			else fprintf(stderr, "cache key rules line %d: %s is not an option, or is repeated\n", lineno, entry);
+		}
+	}
+	
+	if(!ok) {
+		perror("malloc for cache key rules");
+		key_rules_free(kr);
+		return NULL;
+	}
+	return kr;
+}
+
+void key_rules_free(key_rules *kr) {
+	int i, j;
+	
+	if(kr == NULL) return;
+	for(i = 0; i < kr->nrules; i++) {
+		free(kr->rules[i].host);
+		free(kr->rules[i].path);
+		for(j = 0; kr->rules[i].strip && kr->rules[i].strip[j]; j++) free(kr->rules[i].strip[j]);
+		free(kr->rules[i].strip);
+	}
+	free(kr->rules);
+	free(kr);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//dns: host names are looked up by a few resolver threads, so a slow name server only holds up the clients waiting on
+//that name. answers are cached per name for as long as their records say (the smallest TTL among them), and names
+//that don't exist for as long as their zone's SOA says. a thread-per-connection client waits on the entry for a lookup
+//to finish, while an event loop connection watches an eventfd the lookup writes when it is done. like the system
+//resolver, /etc/hosts is read before asking the name server; -H loads it into the cache at startup instead, so those
+//names never reach a resolver thread. when no name server answers, getaddrinfo gets a last try
+
+#define DNS_SHARDS 16
+#define DNS_CHAINS 256		//hash chains per shard
+#define DNS_SWEEP 1024		//entries a shard holds before expired ones are swept out
+#define DNS_THREADS 4
+#define DNS_DEFAULT_TTL 60	//seconds an answer that came without a TTL is kept (/etc/hosts, getaddrinfo)
+#define DNS_NEGATIVE_TTL 30	//for a name that doesn't exist, if the server sent no SOA to say otherwise
+#define DNS_FAILURE_TTL 5	//for a name nothing could answer for, such as when the name server is down
+#define DNS_MAX_TTL 86400
+#define HOSTS_NAMES 16		//most names read from one /etc/hosts line
+
+typedef struct {
+	pthread_mutex_t lock;
+	dns_entry *chains[DNS_CHAINS];
+	int count;
+	int sweep_at;		//count that triggers the next sweep
+} dns_shard;
+
+dns_shard dns_shards[DNS_SHARDS] = {[0 ... DNS_SHARDS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER, .sweep_at = DNS_SWEEP}};
+
+//lookups waiting for a resolver thread, oldest first
+dns_entry *dns_queue, *dns_queue_tail;
+pthread_mutex_t dns_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dns_queue_cond = PTHREAD_COND_INITIALIZER;
+
+dns_entry *dns_entry_get(char *, int);
+void dns_sweep(dns_shard *);
+int dns_literal(char *, dns_answer *);
+void dns_queue_lookup(dns_entry *);
+long dns_lookup(char *, dns_answer *);
+long dns_query(char *, int, dns_answer *);
+int hosts_next(FILE *, char *, int, dns_addr *, char **);
+int hosts_lookup(char *, dns_answer *);
+void hosts_preload(void);
+
+//starts the resolver threads, loading /etc/hosts into the cache first if preload_hosts is set
+void dns_init(int preload_hosts) {
+	pthread_t t;
+	int i;
+	
+	if(preload_hosts) hosts_preload();
+	for(i = 0; i < DNS_THREADS; i++)
+		if(pthread_create(&t, NULL, dns_thread, NULL) != 0) perror("starting resolver thread");
+}
+
+//looks up host, a lowercase name, from the cache if it has a fresh answer and otherwise waiting for a resolver thread.
+//returns a->status
+int dns_resolve(char *host, dns_answer *a) {
+	dns_shard *sh = &dns_shards[fileHash(host) % DNS_SHARDS];
+	dns_entry *e;
+	
+	if(dns_literal(host, a)) return 0;
+	
+	pthread_mutex_lock(&sh->lock);
+	e = dns_entry_get(host, 1);
+	if(e == NULL) {
+		pthread_mutex_unlock(&sh->lock);
+		a->status = 502;
+		return a->status;
+	}
+	
+	if(!e->pending && (e->preloaded || time(NULL) < e->expires)) stat_add(STAT_DNS_HITS, 1);
+	else {
+		if(e->pending) stat_add(STAT_DNS_JOINED, 1);
+		else dns_queue_lookup(e);
+		e->refs++;
+		while(e->pending) pthread_cond_wait(&e->cond, &sh->lock);
+		e->refs--;
+	}
+	*a = e->answer;
+	pthread_mutex_unlock(&sh->lock);
+	return a->status;
+}
+
+//like dns_resolve for the event loop, without waiting. returns NULL with the answer in a if it can be had straight away.
+//otherwise returns host's entry, referenced, and sets efd to a descriptor of the caller's own that turns readable
+//once the lookup is done, for dns_finish to take the answer from
+dns_entry *dns_start(char *host, dns_answer *a, int *efd) {
+	dns_shard *sh = &dns_shards[fileHash(host) % DNS_SHARDS];
+	dns_entry *e;
+	
+	if(dns_literal(host, a)) return NULL;
+	
+	pthread_mutex_lock(&sh->lock);
+	e = dns_entry_get(host, 1);
+	if(e == NULL) {
+		pthread_mutex_unlock(&sh->lock);
+		a->status = 502;
+		return NULL;
+	}
+	
+	if(!e->pending && (e->preloaded || time(NULL) < e->expires)) {
+		stat_add(STAT_DNS_HITS, 1);
+		*a = e->answer;
+		pthread_mutex_unlock(&sh->lock);
+		return NULL;
+	}
+	if(e->pending) stat_add(STAT_DNS_JOINED, 1);
+	else dns_queue_lookup(e);
+	e->refs++;
+	
+	//each waiter registers its own duplicate, since epoll takes a descriptor only once
+	if(e->efd < 0) e->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	*efd = e->efd >= 0 ? dup(e->efd) : -1;
+	if(*efd < 0) {
+		//with nothing to watch, the only way left is to wait for the answer here
+		perror("eventfd for dns lookup");
+		while(e->pending) pthread_cond_wait(&e->cond, &sh->lock);
+		e->refs--;
+		*a = e->answer;
+		e = NULL;
+	}
+	pthread_mutex_unlock(&sh->lock);
+	return e;
+}
+
+//takes the answer for an entry dns_start returned, once its descriptor is readable, and lets go of the entry
+void dns_finish(dns_entry *e, dns_answer *a) {
+	dns_shard *sh = &dns_shards[e->shard];
+	
+	pthread_mutex_lock(&sh->lock);
+	*a = e->answer;
+	e->refs--;
+	pthread_mutex_unlock(&sh->lock);
+}
+
+//lets go of an entry dns_start returned without waiting for its answer
+void dns_release(dns_entry *e) {
+	dns_shard *sh = &dns_shards[e->shard];
+	
+	pthread_mutex_lock(&sh->lock);
+	e->refs--;
+	pthread_mutex_unlock(&sh->lock);
+}
+
+//answers for a host that is already an IPv4 or IPv6 address, without going near the cache
+int dns_literal(char *host, dns_answer *a) {
+	if(inet_pton(AF_INET, host, &a->addrs[0].v4) == 1) a->addrs[0].family = AF_INET;
+	else if(inet_pton(AF_INET6, host, &a->addrs[0].v6) == 1) a->addrs[0].family = AF_INET6;
+	else return 0;
+	a->status = 0;
+	a->naddrs = 1;
+	return 1;
+}
+
+//finds name's entry in its shard, which must be locked, creating an empty one if create is set
+dns_entry *dns_entry_get(char *name, int create) {
+	unsigned long hash = fileHash(name);
+	dns_shard *sh = &dns_shards[hash % DNS_SHARDS];
+	dns_entry **chain = &sh->chains[(hash / DNS_SHARDS) % DNS_CHAINS], *e;
+	
+	for(e = *chain; e != NULL; e = e->next)
+		if(strcmp(e->name, name) == 0) return e;
+	if(!create) return NULL;
+	
+	if(sh->count >= sh->sweep_at) dns_sweep(sh);
+	e = calloc(1, sizeof(dns_entry));
+	if(e == NULL || (e->name = strdup(name)) == NULL) {
+		perror("malloc for dns entry");
+		free(e);
+		return NULL;
+	}
+	e->shard = hash % DNS_SHARDS;
+	e->efd = -1;
+	pthread_cond_init(&e->cond, NULL);
+	e->next = *chain;
+	*chain = e;
+	sh->count++;
+	return e;
+}
+
+//drops a locked shard's expired entries that nobody is waiting on. if most of them are still fresh, the next
+//sweep waits until the shard has doubled, so a shard full of fresh names isn't swept on every new one
+void dns_sweep(dns_shard *sh) {
+	time_t now = time(NULL);
+	dns_entry **link, *e;
+	int i;
+	
+	for(i = 0; i < DNS_CHAINS; i++) {
+		link = &sh->chains[i];
+		while((e = *link) != NULL) {
+			if(e->preloaded || e->pending || e->refs > 0 || now < e->expires) {
+				link = &e->next;
+				continue;
+			}
+			*link = e->next;
+			pthread_cond_destroy(&e->cond);
+			free(e->name);
+			free(e);
+			sh->count--;
+		}
+	}
+	sh->sweep_at = sh->count * 2 > DNS_SWEEP ? sh->count * 2 : DNS_SWEEP;
+}
+
+//hands e to the resolver threads. its shard must be locked
+void dns_queue_lookup(dns_entry *e) {
+	stat_add(STAT_DNS_LOOKUPS, 1);
+	e->pending = 1;
+	e->refs++;
+	
+	pthread_mutex_lock(&dns_queue_lock);
+	e->queue_next = NULL;
+	if(dns_queue_tail) dns_queue_tail->queue_next = e;
+	else dns_queue = e;
+	dns_queue_tail = e;
+	pthread_cond_signal(&dns_queue_cond);
+	pthread_mutex_unlock(&dns_queue_lock);
+}
+
+//takes lookups off the queue one at a time, and wakes whoever is waiting on each once it is answered
+void *dns_thread(void *arg) {
+	unsigned long one = 1;
+	dns_entry *e;
+	dns_shard *sh;
+	dns_answer a;
+	long ttl;
+	
+	while(1) {
+		pthread_mutex_lock(&dns_queue_lock);
+		while(dns_queue == NULL) pthread_cond_wait(&dns_queue_cond, &dns_queue_lock);
+		e = dns_queue;
+		dns_queue = e->queue_next;
+		if(dns_queue == NULL) dns_queue_tail = NULL;
+		pthread_mutex_unlock(&dns_queue_lock);
+		
+		//an entry's name never changes, and the queued lookup's reference keeps it from being swept, so no lock is needed yet
+		ttl = dns_lookup(e->name, &a);
+		
+		sh = &dns_shards[e->shard];
+		pthread_mutex_lock(&sh->lock);
+		e->answer = a;
+		e->expires = time(NULL) + ttl;
+		e->pending = 0;
+		e->refs--;
+		pthread_cond_broadcast(&e->cond);
+		
+		//waiters keep their own duplicates, so the next lookup of this name gets a fresh eventfd that isn't already readable
+		if(e->efd >= 0) {
+			if(write(e->efd, &one, sizeof(one)) < 0) perror("waking dns waiters");
+			close(e->efd);
+			e->efd = -1;
+		}
+		pthread_mutex_unlock(&sh->lock);
+	}
+	return NULL;
+}
+
+//looks name up the way the system resolver would: /etc/hosts, then the name server, then whatever else getaddrinfo knows
+//of if no name server answered. records how long it took, and returns how many seconds the answer holds for
+long dns_lookup(char *name, dns_answer *a) {
+	unsigned long start = now_us();
+	struct addrinfo hints, *res, *p;
+	long ttl, ttl6, ttl4;
+	int had6;
+	
+	a->status = 0;
+	a->naddrs = 0;
+	
+	if(hosts_lookup(name, a)) {
+		ttl = DNS_DEFAULT_TTL;
+	}
+	else {
+		//IPv6 addresses first, since connect_race tries them first. a name that doesn't exist has no addresses of any
+		//type, so there is no asking after its IPv4 ones
+		ttl6 = dns_query(name, T_AAAA, a);
+		had6 = a->naddrs;
+		ttl4 = a->status == 404 ? ttl6 : dns_query(name, T_A, a);
+		ttl = -1;
+		if(a->naddrs > 0) {
+			//the answer holds for as long as the records of every family that had addresses do
+			if(had6 > 0) ttl = ttl6;
+			if(a->naddrs > had6 && (ttl < 0 || ttl4 < ttl)) ttl = ttl4;
+		}
+		else if(ttl6 >= 0 && ttl4 >= 0) {
+			a->status = 404;
+			ttl = ttl6 < ttl4 ? ttl6 : ttl4;
+		}
+	}
+	
+	if(ttl < 0) {
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		a->naddrs = 0;
+		if(getaddrinfo(name, NULL, &hints, &res) == 0) {
+			for(p = res; p != NULL && a->naddrs < DNS_MAX_ADDRS; p = p->ai_next) {
+				a->addrs[a->naddrs].family = p->ai_family;
+				if(p->ai_family == AF_INET) a->addrs[a->naddrs++].v4 = ((struct sockaddr_in *) p->ai_addr)->sin_addr;
+				else if(p->ai_family == AF_INET6) a->addrs[a->naddrs++].v6 = ((struct sockaddr_in6 *) p->ai_addr)->sin6_addr;
+			}
+			freeaddrinfo(res);
+		}
+		a->status = a->naddrs > 0 ? 0 : 404;
+		ttl = a->naddrs > 0 ? DNS_DEFAULT_TTL : DNS_FAILURE_TTL;
+	}
+	
+	stat_time(HIST_DNS, now_us() - start);
+	return ttl;
+}
+
+//asks the name server for name's addresses of one type, T_A or T_AAAA, adding them to a. returns how long the answer
+//holds for: the smallest TTL of the records it came in, or if there were no addresses the negative caching time of
+//the zone's SOA, and sets a's status to 404 if the name doesn't exist at all. returns -1 if no name server gave an
+//answer either way. the name is asked after as it is, so a reply is always about it; a name without a dot is left
+//to getaddrinfo, which tries it with the search domains
+long dns_query(char *name, int qtype, dns_answer *a) {
+	unsigned char query[HFIXEDSZ + NS_MAXCDNAME + QFIXEDSZ], msg[4096], *p, *end;
+	HEADER *h = (HEADER *) msg;
+	unsigned long rr_ttl, minimum;
+	long ttl = -1, negative_ttl = -1;
+	int len, n, i, answers, records, type, class, rdlen, found = 0;
+	
+	if(strchr(name, '.') == NULL) return -1;
+	if((len = res_mkquery(QUERY, name, C_IN, qtype, NULL, 0, NULL, query, sizeof(query))) < 0) return -1;
+	
+	//the reply to a name that doesn't exist or has no address still counts, with the SOA to go by
+	len = res_send(query, len, msg, sizeof(msg));
+	if(len < HFIXEDSZ || (h->rcode != NOERROR && h->rcode != NXDOMAIN)) return -1;
+	if(len > sizeof(msg)) len = sizeof(msg);
+	if(h->rcode == NXDOMAIN) a->status = 404;
+	end = msg + len;
+	
+	p = msg + HFIXEDSZ;
+	for(i = ntohs(h->qdcount); i > 0 && p < end; i--) {
+		if((n = dn_skipname(p, end)) < 0) break;
+		p += n + QFIXEDSZ;
+	}
+	
+	answers = ntohs(h->ancount);
+	records = answers + ntohs(h->nscount);
+	for(i = 0; i < records; i++) {
+		if(p >= end || (n = dn_skipname(p, end)) < 0 || p + n + RRFIXEDSZ > end) break;
+		p += n;
+		NS_GET16(type, p);
+		NS_GET16(class, p);
+		NS_GET32(rr_ttl, p);
+		NS_GET16(rdlen, p);
+		if(p + rdlen > end || class != C_IN) break;
+		if(rr_ttl > DNS_MAX_TTL) rr_ttl = DNS_MAX_TTL;
+		
+		//the addresses, and any CNAMEs that led to them, all have to still hold for the answer to
+		if(i < answers && (type == qtype || type == T_CNAME) && (ttl < 0 || rr_ttl < ttl)) ttl = rr_ttl;
+		if(i < answers && type == T_A && qtype == T_A && rdlen == 4 && a->naddrs < DNS_MAX_ADDRS) {
+			a->addrs[a->naddrs].family = AF_INET;
+			memcpy(&a->addrs[a->naddrs++].v4, p, 4);
+			found++;
+		}
+		if(i < answers && type == T_AAAA && qtype == T_AAAA && rdlen == 16 && a->naddrs < DNS_MAX_ADDRS) {
+			a->addrs[a->naddrs].family = AF_INET6;
+			memcpy(&a->addrs[a->naddrs++].v6, p, 16);
+			found++;
+		}
+		
+		//a negative answer lasts the smaller of the SOA's own TTL and its minimum field, the last thing in it
+		if(i >= answers && type == T_SOA && rdlen >= 20) {
+			minimum = ((unsigned long) p[rdlen - 4] << 24) | (p[rdlen - 3] << 16) | (p[rdlen - 2] << 8) | p[rdlen - 1];
+			negative_ttl = minimum < rr_ttl ? minimum : rr_ttl;
+		}
+		p += rdlen;
+	}
+	
+	if(found > 0) return ttl;
+	return negative_ttl >= 0 ? negative_ttl : DNS_NEGATIVE_TTL;
+}
+
+//reads fp, an open /etc/hosts, up to its next line with names for an address. the address goes in addr, and names gets up
+//to HOSTS_NAMES pointers into line for the names it gives. returns how many there are, or -1 at the end of the file
+int hosts_next(FILE *fp, char *line, int size, dns_addr *addr, char **names) {
+	char *p, *save;
+	int n;
+	
+	while(fgets(line, size, fp) != NULL) {
+		if((p = strchr(line, '#')) != NULL) *p = '\0';
+		p = strtok_r(line, " \t\r\n", &save);
+		if(p == NULL) continue;
+		if(inet_pton(AF_INET, p, &addr->v4) == 1) addr->family = AF_INET;
+		else if(inet_pton(AF_INET6, p, &addr->v6) == 1) addr->family = AF_INET6;
+		else continue;
+		
+		for(n = 0; n < HOSTS_NAMES && (p = strtok_r(NULL, " \t\r\n", &save)) != NULL; n++) names[n] = p;
+		if(n > 0) return n;
+	}
+	return -1;
+}
+
+//looks for name in /etc/hosts, returning 1 with the addresses of every line that has it in a, or 0 if none does
+int hosts_lookup(char *name, dns_answer *a) {
+	FILE *fp = fopen("/etc/hosts", "r");
+	char line[512], *names[HOSTS_NAMES];
+	dns_addr addr;
+	int n, i;
+	
+	if(fp == NULL) return 0;
+	while((n = hosts_next(fp, line, sizeof(line), &addr, names)) >= 0) {
+		for(i = 0; i < n; i++) {
+			if(strcasecmp(names[i], name) == 0 && a->naddrs < DNS_MAX_ADDRS) {
+				a->addrs[a->naddrs++] = addr;
+				break;
+			}
+		}
+	}
+	fclose(fp);
+	return a->naddrs > 0;
+}
+
+//loads every name in /etc/hosts into the cache, where they are kept for as long as the proxy runs
+void hosts_preload(void) {
+	FILE *fp = fopen("/etc/hosts", "r");
+	char line[512], *names[HOSTS_NAMES], *p;
+	dns_addr addr;
+	dns_shard *sh;
+	dns_entry *e;
+	int n, i, loaded = 0;
+	
+	if(fp == NULL) {
+		perror("opening /etc/hosts");
+		return;
+	}
+	while((n = hosts_next(fp, line, sizeof(line), &addr, names)) >= 0) {
+		for(i = 0; i < n; i++) {
+			//names are looked up as check_origin leaves them, in lower case
+			for(p = names[i]; *p; p++)
+				if(*p >= 'A' && *p <= 'Z') *p += 'a' - 'A';
+			
+			sh = &dns_shards[fileHash(names[i]) % DNS_SHARDS];
+			pthread_mutex_lock(&sh->lock);
+			if((e = dns_entry_get(names[i], 1)) != NULL && e->answer.naddrs < DNS_MAX_ADDRS) {
+				if(!e->preloaded) loaded++;
+				e->preloaded = 1;
+				e->answer.addrs[e->answer.naddrs++] = addr;
+			}
+			pthread_mutex_unlock(&sh->lock);
+		}
+	}
+	fclose(fp);
+	fprintf(stderr, "loaded %d names from /etc/hosts\n", loaded);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//connect races: a server's addresses are tried the RFC 8305 way, alternating IPv6 and IPv4 starting with IPv6. each
+//attempt gets CONNECT_STAGGER ms to itself before the next one starts alongside it, or only until it fails,
+//and the first to connect wins, so an address that drops packets costs a quarter of a second rather than a kernel
+//connect timeout. the whole race has connect_timeout ms (-c). an address whose attempt failed, or was still going at
+//the deadline, is marked down for DOWN_SECONDS: it is tried after all the others, and an origin with every address
+//down gets a 502 without any being tried
+
+#define CONNECT_STAGGER 250	//ms an attempt has before the next one starts
+#define DOWN_SECONDS 10
+#define DOWN_BUCKETS 64
+#define ADDR_KEY 20		//bytes of an address key, see addr_key
+
+typedef struct down_addr {
+	unsigned char key[ADDR_KEY];
+	time_t until;
+	struct down_addr *next;
+} down_addr;
+
+down_addr *down_table[DOWN_BUCKETS];
+pthread_mutex_t down_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int race_attempt(connect_race *);
+void race_drop(connect_race *, int);
+long monotonic_ms(void);
+int addr_key(struct sockaddr_storage *, unsigned char *);
+int addr_down(struct sockaddr_storage *);
+void addr_mark(struct sockaddr_storage *, int);
+
+//sets a race up over a's addresses, in the order they are to be tried. returns 0, or 502 if there is nothing worth trying
+int race_start(connect_race *r, dns_answer *a, int port) {
+	struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+	int v6[DNS_MAX_ADDRS], v4[DNS_MAX_ADDRS], down[DNS_MAX_ADDRS], n6 = 0, n4 = 0, n = 0, ndown = 0, i, pass;
+	
+	for(i = 0; i < a->naddrs; i++) {
+		if(a->addrs[i].family == AF_INET6) v6[n6++] = i;
+		else v4[n4++] = i;
+	}
+	
+	//one of each family in turn, as addresses to hand to connect
+	for(i = 0; i < n6 || i < n4; i++) {
+		if(i < n6) {
+			struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &addrs[n++];
+			
+			memset(sin6, 0, sizeof(*sin6));
+			sin6->sin6_family = AF_INET6;
+			sin6->sin6_port = htons(port);
+			sin6->sin6_addr = a->addrs[v6[i]].v6;
+		}
+		if(i < n4) {
+			struct sockaddr_in *sin = (struct sockaddr_in *) &addrs[n++];
+			
+			memset(sin, 0, sizeof(*sin));
+			sin->sin_family = AF_INET;
+			sin->sin_port = htons(port);
+			sin->sin_addr = a->addrs[v4[i]].v4;
+		}
+	}
+	for(i = 0; i < n; i++) ndown += down[i] = addr_down(&addrs[i]);
+	if(n == 0 || ndown == n) {
+		if(n > 0) stat_add(STAT_ORIGINS_DOWN, 1);
+		return 502;
+	}
+	
+	//addresses that are up keep their order ahead of the ones that are down
+	r->naddrs = 0;
+	for(pass = 0; pass < 2; pass++) {
+		for(i = 0; i < n; i++) {
+			if(down[i] != pass) continue;
+			r->addrs[r->naddrs] = addrs[i];
+			r->lens[r->naddrs++] = addrs[i].ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+		}
+	}
+	r->next = 0;
+	r->nattempts = 0;
+	r->last_start = 0;
+	r->deadline = monotonic_ms() + connect_timeout;
+	r->started = now_us();
+	return 0;
+}
+
+//moves a race on: collects attempts that have finished, and starts the next one if the last has had its head start,
+//one has just failed or none are left going. returns 0 with the winner in sock, -1 if it should be called again once an attempt's socket is
+//ready or race_wait has passed, or the error to send the client: 502 if every address failed, 504 at the deadline
+int race_step(connect_race *r, int *sock) {
+	socklen_t len;
+	long now;
+	int i, err, failed = 0;
+	
+	if(r->nattempts > 0 && poll(r->attempts, r->nattempts, 0) > 0) {
+		for(i = 0; i < r->nattempts; i++) {
+			if(r->attempts[i].revents == 0) continue;
+			
+			len = sizeof(err);
+			if(getsockopt(r->attempts[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+			if(err == 0) {
+				*sock = r->attempts[i].fd;
+				addr_mark(&r->addrs[r->which[i]], 0);
+				if(r->which[i] > 0) stat_add(STAT_CONNECT_FALLBACKS, 1);
+				upstream_time(HIST_CONNECT, now_us() - r->started);
+				race_drop(r, i);
+				race_abandon(r);
+				return 0;
+			}
+			addr_mark(&r->addrs[r->which[i]], 1);
+			close(r->attempts[i].fd);
+			race_drop(r, i--);
+			failed = 1;
+		}
+	}
+	
+	now = monotonic_ms();
+	if(now >= r->deadline) {
+		//attempts still going at the deadline are most likely to addresses that drop what is sent to them
+		for(i = 0; i < r->nattempts; i++) addr_mark(&r->addrs[r->which[i]], 1);
+		race_abandon(r);
+		return 504;
+	}
+	
+	//a failure hands its turn straight to the next address, even while an earlier attempt is still going
+	while(r->next < r->naddrs && (r->nattempts == 0 || failed || now - r->last_start >= CONNECT_STAGGER))
+		if(race_attempt(r)) break;
+	return r->nattempts > 0 ? -1 : 502;
+}
+
+//milliseconds until race_step has something to do that the attempts' sockets won't say
+int race_wait(connect_race *r) {
+	long now = monotonic_ms(), wait = r->deadline - now;
+	
+	if(r->next < r->naddrs && r->last_start + CONNECT_STAGGER - now < wait) wait = r->last_start + CONNECT_STAGGER - now;
+	return wait > 0 ? wait : 0;
+}
+
+//closes every attempt still going
+void race_abandon(connect_race *r) {
+	while(r->nattempts > 0)
+		if(close(r->attempts[--r->nattempts].fd) < 0) perror("closing socket");
+}
+
+//starts a non-blocking connect to the next address. returns 1 if it is under way, 0 if it failed straight off
+int race_attempt(connect_race *r) {
+	int i = r->next++, sock;
+	
+	sock = socket(r->addrs[i].ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(sock < 0) {
+		perror("socket");
+		return 0;
+	}
+	
+	//an unreachable network or a refused connection to a local address fails here rather than later
+	if(connect(sock, (struct sockaddr *) &r->addrs[i], r->lens[i]) < 0 && errno != EINPROGRESS) {
+		addr_mark(&r->addrs[i], 1);
+		if(close(sock) < 0) perror("closing socket");
+		return 0;
+	}
+	
+	r->attempts[r->nattempts].fd = sock;
+	r->attempts[r->nattempts].events = POLLOUT;
+	r->attempts[r->nattempts].revents = 0;
+	r->which[r->nattempts] = i;
+	r->watched[r->nattempts] = 0;
+	r->nattempts++;
+	r->last_start = monotonic_ms();
+	return 1;
+}
+
+//takes attempt i out of the race, without closing it
+void race_drop(connect_race *r, int i) {
+	r->nattempts--;
+	r->attempts[i] = r->attempts[r->nattempts];
+	r->which[i] = r->which[r->nattempts];
+	r->watched[i] = r->watched[r->nattempts];
+}
+
+long monotonic_ms(void) {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+//packs the family, port and address that identify an address into key, and returns which bucket of down_table it goes in
+int addr_key(struct sockaddr_storage *ss, unsigned char *key) {
+	unsigned int hash = 0;
+	int i;
+	
+	memset(key, 0, ADDR_KEY);
+	key[0] = ss->ss_family;
+	if(ss->ss_family == AF_INET6) {
+		memcpy(key + 2, &((struct sockaddr_in6 *) ss)->sin6_port, 2);
+		memcpy(key + 4, &((struct sockaddr_in6 *) ss)->sin6_addr, 16);
+	}
+	else {
+		memcpy(key + 2, &((struct sockaddr_in *) ss)->sin_port, 2);
+		memcpy(key + 4, &((struct sockaddr_in *) ss)->sin_addr, 4);
+	}
+	for(i = 0; i < ADDR_KEY; i++) hash = hash * 31 + key[i];
+	return hash % DOWN_BUCKETS;
+}
+
+//whether a connect to this address failed in the last DOWN_SECONDS. marks that have run out are dropped on the way
+int addr_down(struct sockaddr_storage *ss) {
+	unsigned char key[ADDR_KEY];
+	down_addr **link, *d;
+	time_t now = time(NULL);
+	int bucket = addr_key(ss, key), down = 0;
+	
+	pthread_mutex_lock(&down_lock);
+	link = &down_table[bucket];
+	while((d = *link) != NULL) {
+		if(d->until <= now) {
+			*link = d->next;
+			free(d);
+			continue;
+		}
+		if(memcmp(d->key, key, ADDR_KEY) == 0) down = 1;
+		link = &d->next;
+	}
+	pthread_mutex_unlock(&down_lock);
+	return down;
+}
+
+//marks an address down after a failed connect, or clears its mark after one that worked
+void addr_mark(struct sockaddr_storage *ss, int down) {
+	unsigned char key[ADDR_KEY];
+	down_addr **link, *d;
+	int bucket = addr_key(ss, key);
+	
+	pthread_mutex_lock(&down_lock);
+	for(link = &down_table[bucket]; (d = *link) != NULL; link = &d->next)
+		if(memcmp(d->key, key, ADDR_KEY) == 0) break;
+	
+	if(down) {
+		if(d == NULL && (d = malloc(sizeof(down_addr))) != NULL) {
+			memcpy(d->key, key, ADDR_KEY);
+			d->next = down_table[bucket];
+			down_table[bucket] = d;
+		}
+		if(d) d->until = time(NULL) + DOWN_SECONDS;
+	}
+	else if(d) {
+		*link = d->next;
+		free(d);
+	}
+	pthread_mutex_unlock(&down_lock);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//metrics: every thread counts into a block of its own, so nothing on the request path contends on a shared counter. a
+//thread finds its block through a thread-local pointer, makes it on its first count, and folds it into stats_retired
+//when it exits. blocks start on a cache line of their own, and since a block's thread is its only writer, counts are
+//relaxed loads and stores rather than locked instructions. readers (print_stats on SIGUSR1, and GET /metrics on the
+//admin port, -a) add every block up under stats_lock. timings go into log-linear histograms in the manner of HDR
+//histograms: HIST_SUB buckets to each power of two of microseconds, so a time is placed to within an eighth of itself
+
+#define HIST_SUB 8		//buckets per power of two
+#define METRICS_SIZE 32768	//room for the admin port's answer
+
+__thread thread_stats *my_stats;
+thread_stats *live_stats;	//blocks of threads still running
+thread_stats stats_retired;	//what threads that have exited counted
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t stats_key;	//runs stats_retire as a thread exits
+
+//what the admin port reports, in order. counters that share a name are told apart by their labels
+struct {
+	char *name, *labels, *help;
+	int counter;
+} metric_counters[] = {
+	{"uproxy_requests_total", "", "Requests read from clients.", STAT_REQUESTS},
+	{"uproxy_cache_hits_total", "{tier=\"memory\"}", "Requests answered from the cache, by tier.", STAT_RAM_HITS},
+	{"uproxy_cache_hits_total", "{tier=\"mapped\"}", NULL, STAT_MAP_HITS},
+	{"uproxy_cache_hits_total", "{tier=\"disk\"}", NULL, STAT_DISK_HITS},
+	{"uproxy_cache_misses_total", "", "Requests forwarded to their server.", STAT_MISSES},
+	{"uproxy_cache_coalesced_total", "", "Requests that shared a download already in progress.", STAT_COALESCED},
+	{"uproxy_cache_revalidations_total", "", "Stale responses a server confirmed with 304.", STAT_REVALIDATIONS},
+	{"uproxy_upstream_pool_total", "{result=\"hit\"}", "Server connections wanted, by whether an idle one was pooled.", STAT_POOL_HITS},
+	{"uproxy_upstream_pool_total", "{result=\"miss\"}", NULL, STAT_POOL_MISSES},
+	{"uproxy_dns_cache_hits_total", "", "Name lookups answered from the dns cache.", STAT_DNS_HITS},
+	{"uproxy_dns_lookups_total", "", "Names looked up by the resolver threads.", STAT_DNS_LOOKUPS},
+	{"uproxy_dns_joined_total", "", "Name lookups that waited on one already in progress.", STAT_DNS_JOINED},
+	{"uproxy_connect_fallbacks_total", "", "Connects won by an address other than the first.", STAT_CONNECT_FALLBACKS},
+	{"uproxy_origins_down_total", "", "Connects refused because every address was marked down.", STAT_ORIGINS_DOWN},
+	{"uproxy_client_bytes_total", "", "Bytes sent to clients.", STAT_CLIENT_BYTES},
+	{"uproxy_server_bytes_total", "", "Bytes received from servers.", STAT_SERVER_BYTES},
+	{"uproxy_client_connections_total", "", "Client connections accepted.", STAT_OPENED},
+	{"uproxy_cache_locks_total", "", "Cache locks taken.", STAT_LOCKS},
+	{"uproxy_cache_locks_contended_total", "", "Cache locks that had to be waited for.", STAT_LOCKS_CONTENDED},
+	{"uproxy_access_log_records_total", "", "Access log records written.", STAT_LOG_RECORDS},
+	{"uproxy_access_log_dropped_total", "", "Access log records dropped because their thread's ring was full.", STAT_LOG_DROPPED},
+	{"uproxy_segment_bytes_total", "{source=\"cache\"}", "Bytes appended to log store segments, by what wrote them.", STAT_SEGMENT_BYTES},
+	{"uproxy_segment_bytes_total", "{source=\"compaction\"}", NULL, STAT_COMPACTED_BYTES},
+	{"uproxy_segments_freed_total", "", "Log store segments compacted away and removed.", STAT_SEGMENTS_FREED},
+	{"uproxy_range_responses_total", "", "Partial responses served from the cache for Range requests.", STAT_RANGES},
+	{"uproxy_range_fills_total", "", "Whole objects downloaded in the background for Range requests that missed.", STAT_RANGE_FILLS},
+	{"uproxy_gzip_variants_total", "", "Gzip variants made of cached responses.", STAT_VARIANTS},
+	{"uproxy_gzip_variant_hits_total", "", "Hits answered from a gzip variant.", STAT_VARIANT_HITS},
+	{"uproxy_gzip_bytes_total", "{side=\"in\"}", "Body bytes compressed into gzip variants, and what they came to.", STAT_COMPRESS_IN},
+	{"uproxy_gzip_bytes_total", "{side=\"out\"}", NULL, STAT_COMPRESS_OUT},
+};
+struct {
+	char *name, *help;
+	int hist;
+} metric_hists[] = {
+	{"uproxy_upstream_connect_seconds", "Time to connect to a server, over all of its addresses.", HIST_CONNECT},
+	{"uproxy_upstream_first_byte_seconds", "Time from sending a server the request to having its response head.", HIST_FIRST_BYTE},
+	{"uproxy_cache_lock_wait_seconds", "Time spent waiting for a cache lock held by another thread.", HIST_LOCK_WAIT},
+	{"uproxy_dns_lookup_seconds", "Time to look up a host name that was not cached, from wherever answered.", HIST_DNS},
+};
+
+thread_stats *stats_self(void);
+void stats_retire(void *);
+void stats_fold(thread_stats *, thread_stats *);
+int hist_bucket(unsigned long);
+unsigned long hist_upper(int);
+unsigned long hist_quantile(thread_stats *, int, double);
+int metrics_format(char *, int);
+
+void stats_init(void) {
+	if(pthread_key_create(&stats_key, stats_retire) != 0) perror("creating stats key");
+}
+
+//adds n to one of the calling thread's counters
+void stat_add(int counter, unsigned long n) {
+	thread_stats *s = my_stats ? my_stats : stats_self();
+	
+	if(s == NULL) return;
+	atomic_store_explicit(&s->counters[counter], atomic_load_explicit(&s->counters[counter], memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+//records a time, in microseconds, in one of the calling thread's histograms
+void stat_time(int hist, unsigned long us) {
+	thread_stats *s = my_stats ? my_stats : stats_self();
+	atomic_ulong *bucket;
+	
+	if(s == NULL) return;
+	bucket = &s->hists[hist][hist_bucket(us)];
+	atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1, memory_order_relaxed);
+	atomic_store_explicit(&s->hist_sums[hist], atomic_load_explicit(&s->hist_sums[hist], memory_order_relaxed) + us, memory_order_relaxed);
+}
+
+unsigned long now_us(void) {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+//cache locks are taken through these, which only look at the clock when the lock turns out to be held
+void cache_rdlock(pthread_rwlock_t *lock) {
+	unsigned long start;
+	
+	if(pthread_rwlock_tryrdlock(lock) != 0) {
+		start = now_us();
+		pthread_rwlock_rdlock(lock);
+		stat_time(HIST_LOCK_WAIT, now_us() - start);
+		stat_add(STAT_LOCKS_CONTENDED, 1);
+	}
+	stat_add(STAT_LOCKS, 1);
+}
+
+void cache_wrlock(pthread_rwlock_t *lock) {
+	unsigned long start;
+	
+	if(pthread_rwlock_trywrlock(lock) != 0) {
+		start = now_us();
+		pthread_rwlock_wrlock(lock);
+		stat_time(HIST_LOCK_WAIT, now_us() - start);
+		stat_add(STAT_LOCKS_CONTENDED, 1);
+	}
+	stat_add(STAT_LOCKS, 1);
+}
+
+void cache_lock(pthread_mutex_t *lock) {
+	unsigned long start;
+	
+	if(pthread_mutex_trylock(lock) != 0) {
+		start = now_us();
+		pthread_mutex_lock(lock);
+		stat_time(HIST_LOCK_WAIT, now_us() - start);
+		stat_add(STAT_LOCKS_CONTENDED, 1);
+	}
+	stat_add(STAT_LOCKS, 1);
+}
+
+//makes the calling thread's block on its first count. returns NULL if there is no memory for one, and its counts are lost
+thread_stats *stats_self(void) {
+	thread_stats *s;
+	
+	if(posix_memalign((void **) &s, 64, sizeof(thread_stats)) != 0) return NULL;
+	memset(s, 0, sizeof(thread_stats));
+	
+	pthread_mutex_lock(&stats_lock);
+	s->prev = NULL;
+	s->next = live_stats;
+	if(live_stats) live_stats->prev = s;
+	live_stats = s;
+	pthread_mutex_unlock(&stats_lock);
+	
+	pthread_setspecific(stats_key, s);
+	return my_stats = s;
+}
+
+//folds an exiting thread's block into stats_retired
+void stats_retire(void *arg) {
+	thread_stats *s = arg;
+	
+	pthread_mutex_lock(&stats_lock);
+	stats_fold(&stats_retired, s);
+	if(s->prev) s->prev->next = s->next;
+	else live_stats = s->next;
+	if(s->next) s->next->prev = s->prev;
+	pthread_mutex_unlock(&stats_lock);
+	
+	my_stats = NULL;
+	free(s);
+}
+
+//adds up every thread's counts into total
+void stats_collect(thread_stats *total) {
+	thread_stats *s;
+	
+	memset(total, 0, sizeof(thread_stats));
+	pthread_mutex_lock(&stats_lock);
+	stats_fold(total, &stats_retired);
+	for(s = live_stats; s != NULL; s = s->next) stats_fold(total, s);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+//adds from's counts to into's. into is only ever written under stats_lock
+void stats_fold(thread_stats *into, thread_stats *from) {
+	int i, h;
+	
+	for(i = 0; i < STAT_COUNTERS; i++)
+		atomic_store_explicit(&into->counters[i], into->counters[i] + atomic_load_explicit(&from->counters[i], memory_order_relaxed), memory_order_relaxed);
+	for(h = 0; h < HISTS; h++) {
+		for(i = 0; i < HIST_BUCKETS; i++)
+			atomic_store_explicit(&into->hists[h][i], into->hists[h][i] + atomic_load_explicit(&from->hists[h][i], memory_order_relaxed), memory_order_relaxed);
+		atomic_store_explicit(&into->hist_sums[h], into->hist_sums[h] + atomic_load_explicit(&from->hist_sums[h], memory_order_relaxed), memory_order_relaxed);
+	}
+}
+
+//the bucket for a time: the first HIST_SUB hold 0 to HIST_SUB - 1 us, and after that each power of two is split in
+//HIST_SUB by the bits that follow its top one. times past the last bucket go in it
+int hist_bucket(unsigned long us) {
+	int top, bucket;
+	
+	if(us < HIST_SUB) return us;
+	top = 63 - __builtin_clzl(us);
+	bucket = (top - 2) * HIST_SUB + ((us >> (top - 3)) & (HIST_SUB - 1));
+	return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+//the time, in microseconds, that a bucket's times are below
+unsigned long hist_upper(int bucket) {
+	if(bucket < HIST_SUB) return bucket + 1;
+	return (unsigned long) (HIST_SUB + bucket % HIST_SUB + 1) << (bucket / HIST_SUB - 1);
+}
+
+//a time that fraction q of a histogram's times are below, to within a bucket
+unsigned long hist_quantile(thread_stats *t, int hist, double q) {
+	unsigned long count = 0, seen = 0;
+	int i;
+	
+	for(i = 0; i < HIST_BUCKETS; i++) count += t->hists[hist][i];
+	for(i = 0; i < HIST_BUCKETS && count > 0; i++) {
+		seen += t->hists[hist][i];
+		if(seen >= q * count) return hist_upper(i);
+	}
+	return 0;
+}
+
+//prints a histogram's median, 99th percentile and count for print_stats
+void print_hist(thread_stats *t, int hist, char *what) {
+	unsigned long count = 0;
+	int i;
+	
+	for(i = 0; i < HIST_BUCKETS; i++) count += t->hists[hist][i];
+	fprintf(stderr, "%s: %lu, median under %lu us, 99%% under %lu us, 99.9%% under %lu us\n", what, count,
+		hist_quantile(t, hist, 0.5), hist_quantile(t, hist, 0.99), hist_quantile(t, hist, 0.999));
+}
+
+//writes every metric into buf in the Prometheus text format, returning its length. a histogram's buckets are reported
+//a power of two at a time, from 8us up. the last bucket also holds every longer time, so it is only reported as +Inf
+int metrics_format(char *buf, int size) {
+	thread_stats *t = malloc(sizeof(thread_stats));
+	unsigned long cumulative;
+	int len = 0, h, b;
+	size_t i;
+	
+	if(t == NULL) return 0;
+	stats_collect(t);
+	
+	#define METRIC(...) if(len < size) len += snprintf(buf + len, size - len, __VA_ARGS__)
+	for(i = 0; i < sizeof(metric_counters) / sizeof(metric_counters[0]); i++) {
+		if(metric_counters[i].help) {
+			METRIC("# HELP %s %s\n", metric_counters[i].name, metric_counters[i].help);
+			METRIC("# TYPE %s counter\n", metric_counters[i].name);
+		}
+		METRIC("%s%s %lu\n", metric_counters[i].name, metric_counters[i].labels, t->counters[metric_counters[i].counter]);
+	}
+	METRIC("# HELP uproxy_client_connections Client connections open.\n# TYPE uproxy_client_connections gauge\n");
+	METRIC("uproxy_client_connections %lu\n", t->counters[STAT_OPENED] - t->counters[STAT_CLOSED]);
+	
+	for(i = 0; i < sizeof(metric_hists) / sizeof(metric_hists[0]); i++) {
+		h = metric_hists[i].hist;
+		METRIC("# HELP %s %s\n# TYPE %s histogram\n", metric_hists[i].name, metric_hists[i].help, metric_hists[i].name);
+		cumulative = 0;
+		for(b = 0; b < HIST_BUCKETS; b++) {
+			cumulative += t->hists[h][b];
+			if(b % HIST_SUB == HIST_SUB - 1 && b < HIST_BUCKETS - 1) METRIC("%s_bucket{le=\"%g\"} %lu\n", metric_hists[i].name, hist_upper(b) / 1e6, cumulative);
+		}
+		METRIC("%s_bucket{le=\"+Inf\"} %lu\n", metric_hists[i].name, cumulative);
+		METRIC("%s_sum %g\n%s_count %lu\n", metric_hists[i].name, t->hist_sums[h] / 1e6, metric_hists[i].name, cumulative);
+	}
+	#undef METRIC
+	
+	free(t);
+	return len < size ? len : size;
+}
+
+//answers GET /metrics on the admin port, which only listens on loopback. one request per connection
+void *admin_thread(void *arg) {
+	struct sockaddr_in addr;
+	struct timeval wait;
+	char request[1024], head[256], *body = malloc(METRICS_SIZE);
+	int sock = socket(AF_INET, SOCK_STREAM, 0), client, optval = 1, n, head_len;
+	
+	(void) arg;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(admin_port);
+	if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) perror("setting reuseaddr");
+	if(body == NULL || sock < 0 || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(sock, 16) < 0) {
+		perror("opening admin port");
+		return NULL;
+	}
+	
+	//a client that never sends its request only holds the admin port up for a second
+	wait.tv_sec = 1;
+	wait.tv_usec = 0;
+	while(1) {
+		if((client = accept(sock, NULL, NULL)) < 0) continue;
+		if(setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait)) < 0) perror("setting receive timeout");
+		
+		n = recv(client, request, sizeof(request) - 1, 0);
+		if(n > 0) {
+			request[n] = '\0';
+			if(strncmp(request, "GET /metrics", 12) == 0 && (request[12] == ' ' || request[12] == '?')) {
+				n = metrics_format(body, METRICS_SIZE);
+				head_len = sprintf(head, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", n);
+			}
+			else {
+				n = 0;
+				head_len = sprintf(head, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+			}
+			if(send(client, head, head_len, MSG_NOSIGNAL) < 0 || (n > 0 && send(client, body, n, MSG_NOSIGNAL) < 0)) perror("writing metrics");
+		}
+		if(close(client) < 0) perror("closing socket");
+	}
+	return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//access log (-l): a fixed size record for every request, of its uri, status, bytes, cache result and timings, written
+//to the log file in binary. a thread fills in the record of the request it is answering through access_current as it
+//goes (the event loop points it at the connection it is stepping), and copies it into a ring of its own once the
+//response is done. a ring has one thread adding to it and access_writer taking from it, so handing a record over takes
+//no lock, just a release store of the ring's head. access_writer wakes every ACCESS_FLUSH_MS, writes out everything
+//the rings hold in one go, and moves the file aside to path.1 once it passes ACCESS_ROTATE bytes. a thread that finds
+//its ring full drops the record and counts it rather than wait for the disk. access_decode.c turns the files into text
+
+#define ACCESS_RING 512			//records in each thread's ring, a power of two
+#define ACCESS_FLUSH_MS 50		//how often the writer empties the rings
+#define ACCESS_ROTATE (64L << 20)	//bytes a log file grows to before it is rotated
+#define ACCESS_KEEP 4			//rotated files kept, path.1 the newest
+
+typedef struct access_ring {
+	access_record records[ACCESS_RING];
+	atomic_ulong head __attribute__((aligned(64)));	//records ever added, only moved by the ring's thread
+	atomic_ulong tail __attribute__((aligned(64)));	//records ever written out, only moved by the writer
+	atomic_int retired;		//set as the ring's thread exits, after which the writer reuses the ring
+	struct access_ring *next;
+} access_ring;
+
+__thread access_record *access_current;	//request the calling thread is answering
+__thread access_ring *my_ring;
+access_ring *access_rings;		//rings of running threads, and of exited ones not yet drained
+access_ring *access_free;		//drained rings for new threads to take
+pthread_mutex_t access_lock = PTHREAD_MUTEX_INITIALIZER;	//guards both lists
+pthread_key_t access_key;		//runs access_retire as a thread exits
+FILE *access_fp;			//only used by the writer
+long access_size;
+
+void access_push(access_record *);
+access_ring *access_ring_self(void);
+void access_retire(void *);
+long access_drain(access_ring *);
+void access_reuse(access_ring *);
+int access_open(void);
+void access_rotate(void);
+
+//opens the log before any requests come in, so a bad path is found out at startup
+int access_init(void) {
+	if(pthread_key_create(&access_key, access_retire) != 0) perror("creating access log key");
+	return access_open();
+}
+
+unsigned long wall_us(void) {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+//opens a record for a request just read, finishing the last one if something left it open
+void access_start(access_record *rec) {
+	if(access_path == NULL) return;
+	access_finish(rec);
+	memset(rec, 0, sizeof(access_record));
+	rec->time = wall_us();
+	access_current = rec;
+}
+
+//closes a request's record once its response is done, or the connection is, and hands it to the writer
+void access_finish(access_record *rec) {
+	if(rec->time == 0) return;
+	rec->total_us = wall_us() - rec->time;
+	access_push(rec);
+	rec->time = 0;
+	if(access_current == rec) access_current = NULL;
+}
+
+//the rest of these fill in the open record, if there is one
+void access_uri(char *uri, int len) {
+	access_record *rec = access_current;
+	
+	if(rec == NULL || rec->time == 0) return;
+	rec->uri_len = len;
+	memcpy(rec->uri, uri, len < ACCESS_URI ? len : ACCESS_URI);
+}
+
+void access_status(int status) {
+	if(access_current && access_current->time) access_current->status = status;
+}
+
+void access_cache(int result) {
+	if(access_current && access_current->time) access_current->cache = result;
+}
+
+//counts bytes sent to a client, in the metrics and in the open record
+void client_sent(unsigned long n) {
+	if(client_detached) return;
+	stat_add(STAT_CLIENT_BYTES, n);
+	if(access_current && access_current->time) access_current->bytes += n;
+}
+
+//records how long connecting to the server or waiting on its response head took, in the metrics and in the open record
+void upstream_time(int hist, unsigned long us) {
+	stat_time(hist, us);
+	if(access_current == NULL || access_current->time == 0) return;
+	if(hist == HIST_CONNECT) access_current->connect_us = us;
+	else access_current->first_byte_us = us;
+}
+
+//adds a finished record to the calling thread's ring, or drops it if the ring is full
+void access_push(access_record *rec) {
+	access_ring *r = my_ring ? my_ring : access_ring_self();
+	unsigned long head;
+	
+	if(r == NULL) {
+		stat_add(STAT_LOG_DROPPED, 1);
+		return;
+	}
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	if(head - atomic_load_explicit(&r->tail, memory_order_acquire) >= ACCESS_RING) {
+		stat_add(STAT_LOG_DROPPED, 1);
+		return;
+	}
+	r->records[head & (ACCESS_RING - 1)] = *rec;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+//gives the calling thread a ring on its first record, a drained one if there is one. returns NULL if there is no memory
+access_ring *access_ring_self(void) {
+	access_ring *r;
+	
+	pthread_mutex_lock(&access_lock);
+	r = access_free;
+	if(r) access_free = r->next;
+	pthread_mutex_unlock(&access_lock);
+	if(r == NULL && posix_memalign((void **) &r, 64, sizeof(access_ring)) != 0) return NULL;
+	
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->retired, 0);
+	pthread_mutex_lock(&access_lock);
+	r->next = access_rings;
+	access_rings = r;
+	pthread_mutex_unlock(&access_lock);
+	
+	pthread_setspecific(access_key, r);
+	return my_ring = r;
+}
+
+//marks an exiting thread's ring for the writer to drain and take back
+void access_retire(void *arg) {
+	access_ring *r = arg;
+	
+	atomic_store_explicit(&r->retired, 1, memory_order_release);
+	my_ring = NULL;
+}
+
+//the log writer: empties every ring into the file each ACCESS_FLUSH_MS, then rotates the file if it has grown too big
+void *access_writer(void *arg) {
+	access_ring *r, *next;
+	long written;
+	int retired;
+	
+	(void) arg;
+	while(1) {
+		usleep(ACCESS_FLUSH_MS * 1000);
+		if(access_fp == NULL && access_open() < 0) continue;
+		
+		//rings are only ever added at the front of the list and only ever taken off it here, so it can be walked unlocked
+		pthread_mutex_lock(&access_lock);
+		r = access_rings;
+		pthread_mutex_unlock(&access_lock);
+		
+		written = 0;
+		for(; r != NULL; r = next) {
+			next = r->next;
+			retired = atomic_load_explicit(&r->retired, memory_order_acquire);
+			written += access_drain(r);
+			if(retired) access_reuse(r);
+		}
+		if(written == 0) continue;
+		
+		if(fflush(access_fp) != 0) perror("writing access log");
+		stat_add(STAT_LOG_RECORDS, written);
+		access_size += written * sizeof(access_record);
+		if(access_size >= ACCESS_ROTATE) access_rotate();
+	}
+	return NULL;
+}
+
+//writes out the records a ring holds and frees up their slots. returns how many there were
+long access_drain(access_ring *r) {
+	unsigned long tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	unsigned long head = atomic_load_explicit(&r->head, memory_order_acquire);
+	unsigned long first = tail & (ACCESS_RING - 1), n = head - tail;
+	
+	if(n == 0) return 0;
+	
+	//the records may wrap around the end of the ring
+	if(first + n > ACCESS_RING) {
+		fwrite(&r->records[first], sizeof(access_record), ACCESS_RING - first, access_fp);
+		fwrite(r->records, sizeof(access_record), first + n - ACCESS_RING, access_fp);
+	}
+	else fwrite(&r->records[first], sizeof(access_record), n, access_fp);
+	
+	atomic_store_explicit(&r->tail, head, memory_order_release);
+	return n;
+}
+
+//moves a drained ring of an exited thread to the free list
+void access_reuse(access_ring *r) {
+	access_ring **link;
+	
+	pthread_mutex_lock(&access_lock);
+	for(link = &access_rings; *link != r; link = &(*link)->next);
+	*link = r->next;
+	r->next = access_free;
+	access_free = r;
+	pthread_mutex_unlock(&access_lock);
+}
+
+//opens the log for appending, starting a new file with ACCESS_MAGIC
+int access_open(void) {
+	struct stat st;
+	
+	access_fp = fopen(access_path, "a");
+	if(access_fp == NULL) {
+		perror("opening access log");
+		return -1;
+	}
+	setvbuf(access_fp, NULL, _IOFBF, 1 << 20);
+	access_size = fstat(fileno(access_fp), &st) == 0 ? st.st_size : 0;
+	if(access_size == 0) {
+		fwrite(ACCESS_MAGIC, 1, sizeof(ACCESS_MAGIC) - 1, access_fp);
+		if(fflush(access_fp) != 0) perror("writing access log");
+		access_size = sizeof(ACCESS_MAGIC) - 1;
+	}
+	return 0;
+}
+
+//shifts path.1 to path.2 and so on, dropping the oldest, moves the log to path.1 and starts a new one
+void access_rotate(void) {
+	char from[PATH_MAX], to[PATH_MAX];
+	int i;
+	
+	if(fclose(access_fp) != 0) perror("closing access log");
+	for(i = ACCESS_KEEP; i > 1; i--) {
+		snprintf(from, sizeof(from), "%s.%d", access_path, i - 1);
+		snprintf(to, sizeof(to), "%s.%d", access_path, i);
+		if(rename(from, to) < 0 && errno != ENOENT) perror("rotating access log");
+	}
+	snprintf(to, sizeof(to), "%s.1", access_path);
+	if(rename(access_path, to) < 0) perror("rotating access log");
+	access_open();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//in-flight downloads: the first client to miss on a uri leads its download into the cache, and clients that miss
+//on the same uri while it is running follow it instead of going to the network themselves. followers read the
+//leader's cache file through their own descriptor and send each part of it as soon as the leader has written it,
+//so they don't wait for the download to end. misses on different uris don't touch each other at all.
+//a follower whose leader fails before it had anything to send fetches the uri on its own
+
+#define FLIGHT_BUCKETS 256
+
+inflight *flight_table[FLIGHT_BUCKETS];
+pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//finds the download in progress for uri, or starts one if there is none and the index has no fresh entry either.
+//*f gets the download unless the result is FLIGHT_CACHED. a follower must inflight_release it, a leader inflight_finish it
+int inflight_join(char *uri, unsigned long hash, inflight **f) {
+	inflight *o;
+	cache_entry entry;
+	
+	cache_lock(&flight_lock);
+	for(o = flight_table[hash % FLIGHT_BUCKETS]; o; o = o->next)
+		if(o->hash == hash && strcmp(o->uri, uri) == 0) break;
+	
+	if(o) {
+		o->refs++;
+		pthread_mutex_unlock(&flight_lock);
+		*f = o;
+		return FLIGHT_FOLLOW;
+	}
+	
+	//leaders add to the index before leaving the table, so one that just finished is in the index by now
+	if(index_lookup(uri, hash, &entry, NULL) && time(NULL) < entry.expires) {
+		pthread_mutex_unlock(&flight_lock);
+		*f = NULL;
+		return FLIGHT_CACHED;
+	}
+	
+	o = calloc(1, sizeof(inflight));
+	if(o == NULL || (o->uri = strdup(uri)) == NULL) {
+		perror("malloc for in-flight download");
+		pthread_mutex_unlock(&flight_lock);
+		free(o);
+		*f = NULL;
+		return FLIGHT_LEAD;
+	}
+	o->hash = hash;
+	o->fd = o->efd = -1;
+	o->refs = 1;
+	pthread_cond_init(&o->cond, NULL);
+	o->next = flight_table[hash % FLIGHT_BUCKETS];
+	flight_table[hash % FLIGHT_BUCKETS] = o;
+	pthread_mutex_unlock(&flight_lock);
+	
+	*f = o;
+	return FLIGHT_LEAD;
+}
+
+//wakes every follower of f, flight_lock must be held
+void inflight_wake(inflight *f) {
+	uint64_t one = 1;
+	
+	pthread_cond_broadcast(&f->cond);
+	if(f->efd >= 0 && write(f->efd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("waking followers");
+}
+
+//the leader has opened fp as the download's cache file
+void inflight_start(inflight *f, FILE *fp) {
+	if(f == NULL) return;
+	
+	cache_lock(&flight_lock);
+	f->fd = dup(fileno(fp));
+	if(f->fd < 0) perror("sharing cache file");
+	pthread_mutex_unlock(&flight_lock);
+}
+
+//makes everything the leader has written to fp so far visible to followers
+void inflight_publish(inflight *f, FILE *fp) {
+	off_t written;
+	
+	if(f == NULL || fp == NULL || f->fd < 0) return;
+	
+	//spliced bytes go straight to the descriptor, so its offset is the true length rather than the stream's
+	if(fflush(fp) != 0) perror("flushing cache file");
+	written = lseek(fileno(fp), 0, SEEK_CUR);
+	
+	cache_lock(&flight_lock);
+	if(written > f->progress) {
+		f->progress = written;
+		inflight_wake(f);
+	}
+	pthread_mutex_unlock(&flight_lock);
+}
+
+//the leader is done with f, whether or not its download made it into the cache
+void inflight_finish(inflight *f, int complete) {
+	inflight **link;
+	
+	if(f == NULL) return;
+	
+	cache_lock(&flight_lock);
+	for(link = &flight_table[f->hash % FLIGHT_BUCKETS]; *link != f; link = &(*link)->next);
+	*link = f->next;
+	f->done = 1;
+	f->complete = complete;
+	inflight_wake(f);
+	pthread_mutex_unlock(&flight_lock);
+	
+	inflight_release(f);
+}
+
+void inflight_release(inflight *f) {
+	cache_lock(&flight_lock);
+	if(--f->refs > 0) {
+		pthread_mutex_unlock(&flight_lock);
+		return;
+	}
+	pthread_mutex_unlock(&flight_lock);
+	
+	if(f->fd >= 0) close(f->fd);
+	if(f->efd >= 0) close(f->efd);
+	pthread_cond_destroy(&f->cond);
+	free(f->uri);
+	free(f);
+}
+
+//returns how much of the file has been written, first waiting until that is more than seen or the
+//download is over if block is set. *done and *complete give the download's state. the leader's server can only go
+//silent for KEEPALIVE_TIMEOUT seconds, but its client can stop reading, so a follower that sees nothing for twice
+//that long gives up as if the download had failed
+long inflight_wait(inflight *f, long seen, int block, int *done, int *complete) {
+	struct timespec deadline;
+	int stalled = 0;
+	long progress;
+	
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += 2 * KEEPALIVE_TIMEOUT;
+	
+	cache_lock(&flight_lock);
+	while(block && f->progress <= seen && !f->done && !stalled)
+		stalled = pthread_cond_timedwait(&f->cond, &flight_lock, &deadline) == ETIMEDOUT;
+	progress = f->progress;
+	*done = f->done || stalled;
+	*complete = f->complete && !stalled;
+	pthread_mutex_unlock(&flight_lock);
+	
+	return progress;
+}
+
+//reads the response head from the download once enough of it is written, and rewrites it for the client into out
+//like load_cached_head. *body_off gets the file offset the rest of the response starts at. *chunked says whether
+//the client takes chunked framing, and is left set only if the body has to be sent to it chunked.
+//returns the head's length, 0 if the response goes out as it is and ends the client's connection,
+//-1 if more of the file is needed, or -2 if the download failed or varies and the follower should fetch on its own
+int inflight_head(inflight *f, long progress, int done, int complete, char *out, int out_size, int *keep_alive, int *chunked, off_t *body_off) {
+	char head[HEADSIZE];
+	long start = strlen(f->uri) + 1;
+	int n = 0, status = 0, head_len;
+	response_head rh;
+	cache_meta meta;
+	
+	if(done && !complete) return -2;
+	
+	if(f->fd >= 0 && progress > start) {
+		n = pread(f->fd, head, progress - start < HEADSIZE ? progress - start : HEADSIZE, start);
+		if(n < 0) {
+			perror("reading in-flight cache file");
+			return -2;
+		}
+		status = parse_response_head(head, n, &rh);
+	}
+	if(status == 0 && !done && n < HEADSIZE) return -1;
+	
+	if(status == 1) {
+		//a response that varies may not be the one this client asked for
+		if(response_header(head, &rh, "Vary", NULL)) return -2;
+		response_meta(head, &rh, NULL, &meta);
+		
+		//a body without a length, because the server closes after it or because it was chunked and is stored
+		//without the chunking, has none to give the client until the download is over. until then it is sent
+		//chunked again, or ends the client's connection if the client can't take that
+		if(rh.chunked || rh.content_length >= 0 || done) *chunked = 0;
+		else if(!*chunked) *keep_alive = 0;
+		head_len = rewrite_response_head(head, &rh, out, out_size, *keep_alive, rh.chunked || rh.content_length >= 0 ? -1 : *chunked ? LENGTH_CHUNKED : done ? progress - start - rh.head_len : -1, NULL, meta.compressible);
+		if(head_len > 0) {
+			*body_off = start + rh.head_len;
+			return head_len;
+		}
+	}
+	
+	*body_off = start;
+	*keep_alive = 0;
+	*chunked = 0;
+	return 0;
+}
+
+//answers a client from a download another client is leading, sending the cache file as it is written. chunked
+//says whether the client takes chunked framing, for a body whose length isn't known yet
+//returns whether the client's connection can stay open, or -1 if nothing was sent and the client should fetch on its own
+int send_inflight_response(int sock, inflight *f, int keep_alive, int chunked) {
+	char head[HEADSIZE + 256], size_line[32];
+	int head_len, done, complete, chunk;
+	long progress = 0;
+	off_t offset;
+	ssize_t sent;
+	
+	chunked = chunked && keep_alive;
+	do {
+		progress = inflight_wait(f, progress, 1, &done, &complete);
+		head_len = inflight_head(f, progress, done, complete, head, sizeof(head), &keep_alive, &chunked, &offset);
+	} while(head_len == -1);
+	if(head_len == -2) return -1;
+	
+	if(head_len > 0 && socket_write(sock, head, head_len) < 0) {
+		perror("writing to socket");
+		return 0;
+	}
+	
+	while(1) {
+		//a body sent chunked gets a chunk for each stretch of it the leader has written
+		chunk = chunked && offset < progress;
+		if(chunk && socket_write(sock, size_line, sprintf(size_line, "%lx\r\n", (long) (progress - offset))) < 0) {
+			perror("writing to socket");
+			return 0;
+		}
+		while(offset < progress) {
+			sent = sendfile(sock, f->fd, &offset, progress - offset);
+			if(sent < 0 && errno == EINTR) continue;
+			if(sent <= 0) {
+				perror("sending in-flight cache file");
+				return 0;
+			}
+			client_sent(sent);
+		}
+		if(chunk && socket_write(sock, "\r\n", 2) < 0) {
+			perror("writing to socket");
+			return 0;
+		}
+		if(done) break;
+		progress = inflight_wait(f, progress, 1, &done, &complete);
+	}
+	if(chunked && complete && socket_write(sock, "0\r\n\r\n", 5) < 0) {
+		perror("writing to socket");
+		return 0;
+	}
+	
+	//a download cut short leaves this client's response cut short as well
+	return complete ? keep_alive : 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//event loop mode: instead of a thread per client, a fixed set of workers (one per core by default) each
+//run their own epoll instance over non-blocking sockets, and step every connection through the same
+//read -> parse -> cache lookup -> connect -> relay sequence that proxy_func runs top to bottom.
+//a connection following another one's download (see the in-flight section) watches the download's eventfd
+//in place of a server socket. a connection whose client goes away while it leads a download carries on into the
+//cache without it, with client_sock closed and set to -1
+
+typedef enum {
+	EV_READ_REQUEST,	//waiting for the client's next request
+	EV_SEND_CACHED,		//streaming a cached response to the client
+	EV_RESOLVING,		//waiting for a resolver thread to look up the server's name
+	EV_CONNECTING,		//waiting on a non-blocking connect to the server
+	EV_SEND_REQUEST,	//writing the forwarded request to the server
+	EV_READ_HEAD,		//collecting the server's response head
+	EV_RELAY,		//relaying the response body to the client and the cache
+	EV_FOLLOW,		//sending another connection's download to the client as it arrives
+	EV_FLUSH		//writing out whatever is left of the response
+} ev_state;
+
+//room for a rewritten response head plus the start of the body that arrived with it
+#define EV_OUTSIZE (2 * HEADSIZE + 256)
+
+typedef struct ev_conn ev_conn;
+typedef struct ev_worker ev_worker;
+
+//epoll hands one of these back so the worker knows which side of a connection is ready
+typedef struct {
+	ev_conn *conn;
+	int is_server;
+} ev_handle;
+
+struct ev_conn {
+	ev_state state;
+	int epfd;			//the worker's epoll instance
+	int client_sock, server_sock;
+	ev_handle client_h, server_h;
+	int keep_alive;			//whether the client's connection stays open after this response
+	
+	char in[REQSIZE];		//client requests, possibly several pipelined
+	int in_len;
+	request_head req;		//the first request in in, parsed as it arrives and kept there until it is answered
+	
+	//these buffers only exist while a request is being answered, so idle connections stay small
+	char *out;			//bytes waiting to be written to the client
+	int out_off, out_len;
+	forward_request *forward;	//request waiting to be written to the server
+	long forward_sent;
+	char *head;			//the server's response head as it arrives
+	int head_fill;
+	
+	response_head rh;
+	body_framer framer;
+	splice_relay relay;		//pipes the body goes through when splicing is set
+	int splicing;
+	FILE *cache_fp;			//file being written on a miss
+	cache_object *hit;		//response being sent on a disk hit
+	ram_object *ram;		//object being sent on a memory hit
+	off_t body_off;			//where the rest of a cached body starts, in hit or ram
+	long body_left;			//bytes of a cached body still to be sent
+	int caching;			//set while cache_fp is a file being written
+	int caching_failed;		//set if the cache file could not be written
+	char cache_path[100];
+	char *cache_uri;		//uri a miss is fetching
+	cache_meta meta;		//what to store the response being written with
+	cache_object *stale;		//stale copy being revalidated, sent instead of the server's reply on a 304
+	long stale_lifetime;
+	inflight *flight;		//download this connection leads or follows
+	int leading;
+	int chunking;			//set if a followed download's body goes to the client chunked
+	long chunk_left;		//bytes of the chunk being sent still to go
+	int client_behind;		//set while a follower waits on its client rather than on the download
+	
+	char origin[ORIGIN_SIZE];	//upstream pool key, and the host and port to connect to
+	int reused;			//server connection came from the pool
+	int server_reusable;		//server connection can go back to the pool once the response ends
+	dns_entry *lookup;		//name lookup being waited on, its eventfd is in server_sock
+	dns_answer addrs;		//the server's addresses
+	int port;
+	connect_race *race;		//connects to the server's addresses while state is EV_CONNECTING
+	int timer_fd;			//timerfd for the race's next step, only open while there is a race
+	unsigned long sent_at;		//when the request was sent to the server, in microseconds
+	access_record access;		//the request being answered, for the access log
+	
+	ev_worker *worker;
+	time_t active;			//when either side last made progress, see ev_reap
+	ev_conn *idle_prev, *idle_next;	//the worker's connections, least recently active first
+};
+
+struct ev_worker {
+	int epfd;
+	int listen_sock;
+	int timeout;
+	ev_conn *oldest, *newest;	//every connection, by when it was last active
+	time_t reaped;			//when ev_reap last ran
+};
+
+void *ev_worker_func(void *);
+void ev_accept(ev_worker *);
+void ev_client_ready(ev_worker *, ev_conn *, uint32_t);
+void ev_server_ready(ev_worker *, ev_conn *, uint32_t);
+void ev_start_request(ev_worker *, ev_conn *);
+void ev_send_cached(ev_worker *, ev_conn *, char *, unsigned long, cache_object *);
+int ev_send_variant(ev_worker *, ev_conn *, char *);
+void ev_fetch(ev_worker *, ev_conn *, char *);
+void ev_follow_start(ev_worker *, ev_conn *);
+void ev_follow(ev_worker *, ev_conn *);
+void ev_drop_flight(ev_conn *);
+void ev_connect(ev_worker *, ev_conn *);
+void ev_resolved(ev_worker *, ev_conn *);
+int ev_race(ev_worker *, ev_conn *);
+void ev_race_end(ev_conn *);
+void ev_read_head(ev_worker *, ev_conn *);
+void ev_revalidated(ev_worker *, ev_conn *);
+void ev_relay(ev_worker *, ev_conn *);
+void ev_splice(ev_worker *, ev_conn *);
+void ev_finish_relay(ev_worker *, ev_conn *, int);
+void ev_release_server(ev_worker *, ev_conn *);
+void ev_response_done(ev_worker *, ev_conn *);
+void ev_next_request(ev_worker *, ev_conn *);
+void ev_send_error(ev_worker *, ev_conn *, int, char *);
+int ev_flush(ev_conn *);
+int ev_send_body(ev_conn *);
+void ev_watch(ev_worker *, int, ev_handle *, uint32_t);
+void ev_close(ev_conn *);
+void ev_client_lost(ev_worker *, ev_conn *);
+void ev_touch(ev_conn *);
+void ev_unlink(ev_conn *);
+void ev_reap(ev_worker *);
+
+//starts the workers on the shared listening socket and never returns
+void run_event_loop(int listen_sock, int timeout, int workers) {
+	struct rlimit rl;
+	pthread_t *threads;
+	ev_worker *w;
+	int i;
+	
+	if(workers <= 0) workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if(workers <= 0) workers = 1;
+	
+	//every client costs up to two descriptors, so allow as many as the hard limit lets us
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		if(setrlimit(RLIMIT_NOFILE, &rl) < 0) perror("raising descriptor limit");
+	}
+	
+	if(fcntl(listen_sock, F_SETFL, fcntl(listen_sock, F_GETFL) | O_NONBLOCK) < 0)
+		perror("making listening socket non-blocking");
+	
+	threads = malloc(workers * sizeof(pthread_t));
+	w = malloc(workers * sizeof(ev_worker));
+	if(threads==NULL || w==NULL) {
+		perror("malloc before starting workers");
+		exit(-1);
+	}
+	
+	for(i = 0; i < workers; i++) {
+		struct epoll_event ev;
+		
+		w[i].listen_sock = listen_sock;
+		w[i].timeout = timeout;
+		w[i].oldest = w[i].newest = NULL;
+		w[i].reaped = time(NULL);
+		w[i].epfd = epoll_create1(0);
+		if(w[i].epfd < 0) {
+			perror("creating epoll instance");
+			exit(-1);
+		}
+		
+		//EPOLLEXCLUSIVE wakes one worker per new connection instead of all of them
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.ptr = NULL;
+		if(epoll_ctl(w[i].epfd, EPOLL_CTL_ADD, listen_sock, &ev) < 0)
+			perror("watching listening socket");
+		
+		pthread_create(&threads[i], NULL, ev_worker_func, &w[i]);
+	}
+	
+	for(i = 0; i < workers; i++)
+		pthread_join(threads[i], NULL);
+}
+
+//main loop for each worker, dispatches ready descriptors to their connection
+void *ev_worker_func(void *arg) {
+	ev_worker *w = (ev_worker *) arg;
+	struct epoll_event events[256];
+	int n, i;
+	
+	while(1) {
+		//wakes at least once a second to close connections that have gone quiet, see ev_reap
+		n = epoll_wait(w->epfd, events, 256, 1000);
+		if(n < 0) {
+			if(errno != EINTR) perror("waiting on epoll");
+			continue;
+		}
+		
+		for(i = 0; i < n; i++) {
+			ev_handle *h = (ev_handle *) events[i].data.ptr;
+			
+			//whatever is logged while stepping a connection goes in its record
+			access_current = h ? &h->conn->access : NULL;
+			if(h==NULL) ev_accept(w);
+			else if(h->is_server) ev_server_ready(w, h->conn, events[i].events);
+			else ev_client_ready(w, h->conn, events[i].events);
+		}
+		access_current = NULL;
+		if(time(NULL) != w->reaped) ev_reap(w);
+	}
+	return NULL;
+}
+
+//closes connections that have waited KEEPALIVE_TIMEOUT seconds on a client or server that sent or took nothing,
+//whether an idle keep-alive client, a client sending its request slowly or not reading its response, or a server
+//stalled on its response, the same deadline thread mode's timeouts give. a connection waiting on a lookup, a connect
+//race or another connection's download is waiting on something with a deadline of its own, so it is kept, but a
+//follower whose own client has stopped reading is not. a download held up by its client is finished without it
+void ev_reap(ev_worker *w) {
+	ev_conn *c;
+	
+	w->reaped = time(NULL);
+	while((c = w->oldest) != NULL && w->reaped - c->active >= KEEPALIVE_TIMEOUT) {
+		access_current = &c->access;
+		if(c->state == EV_RESOLVING || c->state == EV_CONNECTING || (c->state == EV_FOLLOW && !c->client_behind)) ev_touch(c);
+		else if(c->state == EV_RELAY && (c->out_len > 0 || (c->splicing && c->relay.pending > 0))) ev_client_lost(w, c);
+		else ev_close(c);
+	}
+	access_current = NULL;
+}
+
+//notes that c just made progress, moving it to the newest end of its worker's list
+void ev_touch(ev_conn *c) {
+	ev_worker *w = c->worker;
+	
+	c->active = time(NULL);
+	if(w->newest == c) return;
+	ev_unlink(c);
+	c->idle_prev = w->newest;
+	if(w->newest) w->newest->idle_next = c;
+	else w->oldest = c;
+	w->newest = c;
+}
+
+//takes c off its worker's list, if it is on it
+void ev_unlink(ev_conn *c) {
+	ev_worker *w = c->worker;
+	
+	if(c->idle_prev == NULL && w->oldest != c) return;
+	if(c->idle_prev) c->idle_prev->idle_next = c->idle_next;
+	else w->oldest = c->idle_next;
+	if(c->idle_next) c->idle_next->idle_prev = c->idle_prev;
+	else w->newest = c->idle_prev;
+	c->idle_prev = c->idle_next = NULL;
+}
+
+//accepts every pending client and starts reading its request
+void ev_accept(ev_worker *w) {
+	int client_sock, one = 1;
+	ev_conn *c;
+	struct epoll_event ev;
+	
+	while((client_sock = accept4(w->listen_sock, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+		//heads and bodies are sent separately, see proxy_func
+		if(setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) perror("setting nodelay");
+		c = calloc(1, sizeof(ev_conn));
+		if(c==NULL) {
+			perror("malloc for connection");
+			close(client_sock);
+			continue;
+		}
+		
+		c->state = EV_READ_REQUEST;
+		request_init(&c->req, c->in);
+		c->epfd = w->epfd;
+		c->client_sock = client_sock;
+		c->server_sock = -1;
+		c->client_h.conn = c;
+		c->client_h.is_server = 0;
+		c->server_h.conn = c;
+		c->server_h.is_server = 1;
+		c->worker = w;
+		ev_touch(c);
+		stat_add(STAT_OPENED, 1);
+		
+		ev.events = EPOLLIN;
+		ev.data.ptr = &c->client_h;
+		if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+			perror("watching client socket");
+			ev_close(c);
+		}
+	}
+	
+	if(errno != EAGAIN && errno != EWOULDBLOCK) perror("accepting connection");
+}
+
+//handles readiness on the client side of a connection
+void ev_client_ready(ev_worker *w, ev_conn *c, uint32_t events) {
+	int n;
+	
+	//left over from the same epoll_wait as the event that lost the client, see ev_client_lost
+	if(c->client_sock < 0) return;
+	ev_touch(c);
+	if(c->state == EV_READ_REQUEST) {
+		n = recv(c->client_sock, c->in + c->in_len, REQSIZE - 1 - c->in_len, 0);
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+		
+		//sometimes an empty message is received, ignore these and erroneous calls
+		if(n <= 0) {
+			ev_close(c);
+			return;
+		}
+		
+		c->in_len += n;
+		ev_start_request(w, c);
+		return;
+	}
+	
+	//outside of reading a request, the client should only ever be waiting on our writes
+	if(events & (EPOLLERR | EPOLLHUP)) {
+		ev_client_lost(w, c);
+		return;
+	}
+	
+	if(c->state == EV_SEND_CACHED) {
+		//the head goes out of the buffer, the body straight from where it is cached
+		n = ev_flush(c);
+		if(n > 0) n = ev_send_body(c);
+		if(n < 0) ev_close(c);
+		else if(n > 0) ev_response_done(w, c);
+	}
+	else if(c->state == EV_RELAY) {
+		n = ev_flush(c);
+		if(n < 0) ev_client_lost(w, c);
+		else if(n > 0) {
+			//client caught up, go back to reading from the server
+			ev_watch(w, c->client_sock, &c->client_h, 0);
+			ev_watch(w, c->server_sock, &c->server_h, EPOLLIN);
+		}
+	}
+	else if(c->state == EV_FOLLOW) ev_follow(w, c);
+	else if(c->state == EV_FLUSH) {
+		n = ev_flush(c);
+		if(n < 0 || (n > 0 && !c->keep_alive)) ev_close(c);
+		else if(n > 0) ev_next_request(w, c);
+	}
+}
+
+//handles readiness on the server side of a connection
+void ev_server_ready(ev_worker *w, ev_conn *c, uint32_t events) {
+	int n;
+	
+	ev_touch(c);
+	if(c->state == EV_FOLLOW) {
+		ev_follow(w, c);
+		return;
+	}
+	if(c->state == EV_RESOLVING) {
+		ev_resolved(w, c);
+		return;
+	}
+	
+	if(c->state == EV_CONNECTING && !ev_race(w, c)) return;
+	
+	if(c->state == EV_SEND_REQUEST) {
+		n = forward_send(c->server_sock, c->forward, &c->forward_sent);
+		if(n < 0) {
+			perror("writing to server");
+			ev_close(c);
+			return;
+		}
+		if(n == 0) return;
+		
+		c->head = malloc(HEADSIZE);
+		if(c->head == NULL) {
+			perror("malloc for response head");
+			ev_close(c);
+			return;
+		}
+		c->head_fill = 0;
+		c->sent_at = now_us();
+		c->state = EV_READ_HEAD;
+		ev_watch(w, c->server_sock, &c->server_h, EPOLLIN);
+		return;
+	}
+	
+	if(c->state == EV_READ_HEAD) ev_read_head(w, c);
+	else if(c->state == EV_RELAY) ev_relay(w, c);
+}
+
+//the server answered a revalidation with 304, so the stale copy is refreshed and sent in place of its reply
+void ev_revalidated(ev_worker *w, ev_conn *c) {
+	revalidated(c->cache_uri, c->head, &c->rh, c->stale_lifetime);
+	c->server_reusable = c->rh.keep_alive && c->head_fill == c->rh.head_len;
+	c->framer.done = 1;
+	free(c->head);
+	c->head = NULL;
+	
+	//nothing was written for the 304 itself, and followers find the refreshed entry in the index
+	if(c->cache_fp) close_cache_entry(c->cache_uri, c->cache_fp, c->cache_path, 0, NULL);
+	c->cache_fp = NULL;
+	c->caching = 0;
+	ev_drop_flight(c);
+	ev_release_server(w, c);
+	if(c->client_sock < 0) {
+		ev_close(c);
+		return;
+	}
+	
+	c->hit = c->stale;
+	c->stale = NULL;
+	c->out_len = load_cached_head(c->hit, &c->req, c->out, EV_OUTSIZE, &c->keep_alive, &c->body_off, &c->body_left);
+	c->out_off = 0;
+	c->state = EV_SEND_CACHED;
+	ev_watch(w, c->client_sock, &c->client_h, EPOLLOUT);
+}
+
+//collects the server's response head, then sends it on reframed for the client along with any body behind it
+void ev_read_head(ev_worker *w, ev_conn *c) {
+	int n, head_len, closed;
+	
+	n = recv(c->server_sock, c->head + c->head_fill, HEADSIZE - c->head_fill, 0);
+	if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+	if(n > 0) stat_add(STAT_SERVER_BYTES, n);
+	closed = n <= 0;
+	if(closed && c->head_fill == 0 && c->reused) {
+		//the pooled connection was dropped by the server, retry once on a fresh one
+		close(c->server_sock);
+		c->server_sock = -1;
+		c->reused = 0;
+		c->forward_sent = 0;
+		free(c->head);
+		c->head = NULL;
+		ev_connect(w, c);
+		return;
+	}
+	if(closed && c->head_fill == 0) {
+		//the server hung up without answering
+		ev_send_error(w, c, 502, NULL);
+		return;
+	}
+	
+	head_len = -1;
+	if(!closed) {
+		c->head_fill += n;
+		head_len = parse_response_head(c->head, c->head_fill, &c->rh);
+		if(head_len == 0) return;
+		if(head_len == 1) upstream_time(HIST_FIRST_BYTE, now_us() - c->sent_at);
+	}
+	
+	if(head_len == 1 && c->stale && c->cache_uri && c->rh.status == 304) {
+		ev_revalidated(w, c);
+		return;
+	}
+	
+	//only responses HTTP allows a shared cache to keep are stored, see cache_response
+	if(c->cache_fp && head_len == 1) response_meta(c->head, &c->rh, &c->req, &c->meta);
+	if(c->cache_fp && (head_len != 1 || !c->meta.storable)) {
+		close_cache_entry(c->cache_uri, c->cache_fp, c->cache_path, 0, NULL);
+		c->cache_fp = NULL;
+		c->caching = 0;
+		ev_drop_flight(c);
+	}
+	
+	c->server_reusable = 0;
+	if(head_len == 1) {
+		body_framer_init(&c->framer, &c->rh);
+		if(c->framer.mode == BODY_CLOSE) c->keep_alive = 0;
+		head_len = rewrite_response_head(c->head, &c->rh, c->out, EV_OUTSIZE, c->keep_alive, -1, NULL, c->cache_fp && c->meta.compressible);
+		c->server_reusable = c->rh.keep_alive && c->framer.mode != BODY_CLOSE;
+	}
+	
+	if(head_len > 0) {
+		if(c->cache_fp) write_cache_head(c->cache_fp, c->head, &c->rh);
+		
+		//whatever came in behind the head is the start of the body
+		n = body_consume(&c->framer, c->head + c->rh.head_len, c->head_fill - c->rh.head_len, c->cache_fp);
+		if(n < 0) {
+			ev_finish_relay(w, c, 0);
+			return;
+		}
+		if(n != c->head_fill - c->rh.head_len) c->server_reusable = 0;
+		memcpy(c->out + head_len, c->head + c->rh.head_len, n);
+		c->out_len = head_len + n;
+	}
+	else {
+		//a head that can't be parsed is passed along untouched, and the server's close ends it
+		c->framer.mode = BODY_CLOSE;
+		c->framer.done = 0;
+		c->keep_alive = 0;
+		memcpy(c->out, c->head, c->head_fill);
+		if(c->cache_fp) fwrite(c->head, 1, c->head_fill, c->cache_fp);
+		c->out_len = c->head_fill;
+	}
+	c->out_off = 0;
+	inflight_publish(c->flight, c->cache_fp);
+	
+	free(c->head);
+	c->head = NULL;
+	c->state = EV_RELAY;
+	
+	if(closed || c->framer.done) {
+		ev_finish_relay(w, c, c->framer.done || c->framer.mode == BODY_CLOSE);
+		return;
+	}
+	
+	//the rest of a body that doesn't need parsing is spliced, see cache_response
+	if(c->framer.mode == BODY_LENGTH || c->framer.mode == BODY_CLOSE)
+		c->splicing = splice_relay_open(&c->relay, c->cache_fp) == 0;
+	
+	n = ev_flush(c);
+	if(n < 0) ev_client_lost(w, c);
+	else if(n == 0) {
+		//client is behind, stop reading from the server until it drains
+		ev_watch(w, c->server_sock, &c->server_h, 0);
+		ev_watch(w, c->client_sock, &c->client_h, EPOLLOUT);
+	}
+}
+
+//relays the next piece of the response body to the client and the cache
+void ev_relay(ev_worker *w, ev_conn *c) {
+	int n, received;
+	
+	if(c->splicing) {
+		ev_splice(w, c);
+		return;
+	}
+	
+	received = recv(c->server_sock, c->out, EV_OUTSIZE, 0);
+	if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+	if(received > 0) stat_add(STAT_SERVER_BYTES, received);
+	if(received <= 0) {
+		//only a close-delimited body is supposed to end this way
+		ev_finish_relay(w, c, received == 0 && c->framer.mode == BODY_CLOSE);
+		return;
+	}
+	
+	//the body goes to the cache file as it is walked, and on to the client as it came
+	n = body_consume(&c->framer, c->out, received, c->cache_fp);
+	if(n < 0) {
+		ev_finish_relay(w, c, 0);
+		return;
+	}
+	
+	//anything the server sends past the end of the response means its connection can't be trusted
+	if(n != received) c->server_reusable = 0;
+	
+	inflight_publish(c->flight, c->cache_fp);
+	c->out_off = 0;
+	c->out_len = n;
+	
+	if(c->framer.done) {
+		ev_finish_relay(w, c, 1);
+		return;
+	}
+	
+	n = ev_flush(c);
+	if(n < 0) ev_client_lost(w, c);
+	else if(n == 0) {
+		//client is behind, stop reading from the server until it drains
+		ev_watch(w, c->server_sock, &c->server_h, 0);
+		ev_watch(w, c->client_sock, &c->client_h, EPOLLOUT);
+	}
+}
+
+//like ev_relay, but moves the body through the connection's pipes instead of its buffer
+void ev_splice(ev_worker *w, ev_conn *c) {
+	ssize_t n;
+	long len = c->framer.mode == BODY_LENGTH && c->framer.remaining < c->relay.size ? c->framer.remaining : c->relay.size;
+	
+	n = splice_relay_fill(&c->relay, c->server_sock, len, SPLICE_F_NONBLOCK);
+	if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+	if(n < 0 && atomic_load(&splice_unsupported)) {
+		//nothing was lost, carry on with the buffered relay
+		if(c->cache_fp) splice_relay_finish_cache(&c->relay, c->cache_fp);
+		if(c->relay.cache_failed) c->caching_failed = 1;
+		splice_relay_close(&c->relay);
+		c->splicing = 0;
+		ev_relay(w, c);
+		return;
+	}
+	if(n <= 0) {
+		//only a close-delimited body is supposed to end this way
+		ev_finish_relay(w, c, n == 0 && c->framer.mode == BODY_CLOSE);
+		return;
+	}
+	
+	body_consume(&c->framer, NULL, n, NULL);
+	inflight_publish(c->flight, c->cache_fp);
+	if(c->framer.done) {
+		ev_finish_relay(w, c, 1);
+		return;
+	}
+	
+	n = ev_flush(c);
+	if(n < 0) ev_client_lost(w, c);
+	else if(n == 0) {
+		//client is behind, stop reading from the server until it drains
+		ev_watch(w, c->server_sock, &c->server_h, 0);
+		ev_watch(w, c->client_sock, &c->client_h, EPOLLOUT);
+	}
+}
+
+//parses the next complete request and either starts sending the cached copy or starts connecting to the server
+void ev_start_request(ev_worker *w, ev_conn *c) {
+	char *uri, *version;
+	char *hostname, *file;
+	int err, status, role;
+	unsigned long hash;
+	cache_object *cache_file;
+	ram_object *ram;
+	
+	//wait for the rest of the headers unless the buffer is already full
+	status = request_parse(&c->req, c->in_len);
+	if(status == 0 && c->in_len < REQSIZE - 1) return;
+	
+	c->out = malloc(EV_OUTSIZE);
+	if(c->out == NULL) {
+		perror("malloc for response");
+		ev_close(c);
+		return;
+	}
+	c->out_off = c->out_len = 0;
+	c->keep_alive = 0;
+	access_start(&c->access);
+	
+	if(status <= 0) {
+		ev_send_error(w, c, 400, NULL);
+		return;
+	}
+	stat_add(STAT_REQUESTS, 1);
+	uri = version = NULL;
+	
+	err = parse_get_request(&c->req, &uri, &version);
+	access_uri(c->req.buf + c->req.target, c->req.target_len);
+	if(err!=0) {
+		ev_send_error(w, c, err, version);
+		return;
+	}
+	cache_key(uri);
+	c->keep_alive = request_keep_alive(version, &c->req);
+	
+	//the client is not read from again until this response is finished
+	ev_watch(w, c->client_sock, &c->client_h, 0);
+	
+	hash = fileHash(uri);
+	if(w->timeout > 0 && (ram = ram_lookup(uri, hash)) != NULL) {
+		//a client that takes gzip is answered from the compressed variant where there is one, see the compression section
+		if(ram->compressible && ev_send_variant(w, c, uri)) {
+			ram_release(ram);
+			return;
+		}
+		c->ram = ram;
+		stat_add(c->ram->map ? STAT_MAP_HITS : STAT_RAM_HITS, 1);
+		access_cache(c->ram->map ? ACCESS_MAPPED : ACCESS_MEMORY);
+		c->out_len = ram_head(c->ram, &c->req, c->out, EV_OUTSIZE, &c->keep_alive, &c->body_off, &c->body_left);
+		c->state = EV_SEND_CACHED;
+		ev_watch(w, c->client_sock, &c->client_h, EPOLLOUT);
+		return;
+	}
+	
+	cache_file = find(hash, uri, w->timeout, &c->req);
+	if(cache_file && cache_file->compressible && ev_send_variant(w, c, uri)) {
+		close_cache_object(cache_file);
+		return;
+	}
+	if(cache_file) {
+		ev_send_cached(w, c, uri, hash, cache_file);
+		return;
+	}
+	
+	{
+		char uri_copy[strlen(uri)+1];
+		
+		strcpy(uri_copy, uri);
+		err = parse_uri(uri_copy, &hostname, &file);
+		if(err==0) err = check_origin(hostname, c->origin);
+		if(err!=0) {
+			ev_send_error(w, c, err, version);
+			return;
+		}
+		
+		c->forward = malloc(sizeof(forward_request));
+		if(c->forward == NULL) {
+			perror("malloc for forwarded request");
+			ev_close(c);
+			return;
+		}
+		
+		//a stale copy that can be revalidated only needs the server to say whether it changed, see forward_and_cache.
+		//it is held until the request is answered, since the forwarded request asks about it even after following
+		if(w->timeout > 0) c->stale = find_stale(hash, uri, &c->req, c->forward->conditionals, &c->stale_lifetime);
+		
+		//the forwarded request points into the request buffer, so the path is taken from there rather than the copy
+		build_forward_request(c->forward, version, &c->req, file ? uri + (file - uri_copy) : NULL, c->stale != NULL);
+		c->forward_sent = 0;
+	}
+	
+	//a range that misses is forwarded on its own with the whole object fetched behind it, see the byte ranges section.
+	//other concurrent misses on the same uri share one download, see the in-flight section
+	if(w->timeout > 0 && request_header(&c->req, "Range", NULL)) {
+		if(range_fill(uri, hash, &c->req) == FLIGHT_CACHED && (cache_file = find(hash, uri, w->timeout, &c->req)) != NULL) {
+			ev_send_cached(w, c, uri, hash, cache_file);
+			return;
+		}
+	}
+	else if(w->timeout > 0 && cacheable(uri)) {
+		role = inflight_join(uri, hash, &c->flight);
+		if(role == FLIGHT_CACHED && (cache_file = find(hash, uri, w->timeout, &c->req)) != NULL) {
+			ev_send_cached(w, c, uri, hash, cache_file);
+			return;
+		}
+		if(role == FLIGHT_FOLLOW) {
+			ev_follow_start(w, c);
+			return;
+		}
+		c->leading = c->flight != NULL;
+	}
+	ev_fetch(w, c, uri);
+}
+
+//starts sending a cached response returned by find, through the memory tier when it can be promoted
+void ev_send_cached(ev_worker *w, ev_conn *c, char *uri, unsigned long hash, cache_object *cache_file) {
+	stat_add(STAT_DISK_HITS, 1);
+	access_cache(ACCESS_DISK);
+	
+	if((c->ram = ram_promote(uri, hash, cache_file)) != NULL) {
+		close_cache_object(cache_file);
+		c->out_len = ram_head(c->ram, &c->req, c->out, EV_OUTSIZE, &c->keep_alive, &c->body_off, &c->body_left);
+	}
+	else {
+		c->hit = cache_file;
+		c->out_len = load_cached_head(cache_file, &c->req, c->out, EV_OUTSIZE, &c->keep_alive, &c->body_off, &c->body_left);
+	}
+	c->state = EV_SEND_CACHED;
+	ev_watch(w, c->client_sock, &c->client_h, EPOLLOUT);
+}
+
+//like serve_variant, for the event loop. returns 1 if the variant is being sent
+int ev_send_variant(ev_worker *w, ev_conn *c, char *uri) {
+	char variant[strlen(uri) + sizeof(VARIANT_GZIP)];
+	unsigned long hash;
+	cache_object *cache_file;
+	
+	if(!compress_wanted(&c->req)) return 0;
+	sprintf(variant, "%s" VARIANT_GZIP, uri);
+	hash = fileHash(variant);
+	
+	if((c->ram = ram_lookup(variant, hash)) != NULL) {
+		stat_add(c->ram->map ? STAT_MAP_HITS : STAT_RAM_HITS, 1);
+		stat_add(STAT_VARIANT_HITS, 1);
+		access_cache(c->ram->map ? ACCESS_MAPPED : ACCESS_MEMORY);
+		c->out_len = ram_head(c->ram, &c->req, c->out, EV_OUTSIZE, &c->keep_alive, &c->body_off, &c->body_left);
+		c->state = EV_SEND_CACHED;
+		ev_watch(w, c->client_sock, &c->client_h, EPOLLOUT);
+		return 1;
+	}
+	if((cache_file = find(hash, variant, 1, &c->req)) != NULL) {
+		stat_add(STAT_VARIANT_HITS, 1);
+		ev_send_cached(w, c, variant, hash, cache_file);
+		return 1;
+	}
+	compress_queue(uri);
+	return 0;
+}
+
+//sends the forwarded request to the server, opening a cache file for the response on the way
+void ev_fetch(ev_worker *w, ev_conn *c, char *uri) {
+	stat_add(STAT_MISSES, 1);
+	access_cache(ACCESS_MISS);
+	
+	c->caching = 1;
+	c->cache_uri = strdup(uri);
+	c->cache_fp = open_cache_entry(uri, c->cache_path);
+	if(c->cache_fp) inflight_start(c->flight, c->cache_fp);
+	
+	//a pooled connection is already established, so go straight to sending the request
+	c->server_sock = pool_get(c->origin, 1);
+	c->reused = c->server_sock >= 0;
+	if(c->reused) {
+		struct epoll_event ev;
+		
+		c->state = EV_SEND_REQUEST;
+		ev.events = EPOLLOUT;
+		ev.data.ptr = &c->server_h;
+		if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->server_sock, &ev) < 0) {
+			perror("watching server socket");
+			ev_close(c);
+		}
+		return;
+	}
+	ev_connect(w, c);
+}
+
+//follows the download c->flight, which another connection leads, by watching its eventfd
+void ev_follow_start(ev_worker *w, ev_conn *c) {
+	struct epoll_event ev;
+	
+	stat_add(STAT_COALESCED, 1);
+	access_cache(ACCESS_SHARED);
+	
+	//each follower registers its own duplicate, since epoll takes a descriptor only once
+	cache_lock(&flight_lock);
+	if(c->flight->efd < 0) c->flight->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	c->server_sock = c->flight->efd >= 0 ? dup(c->flight->efd) : -1;
+	pthread_mutex_unlock(&flight_lock);
+	
+	c->state = EV_FOLLOW;
+	c->body_off = 0;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = &c->server_h;
+	if(c->server_sock < 0 || epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->server_sock, &ev) < 0) {
+		perror("watching in-flight download");
+		if(c->server_sock >= 0) close(c->server_sock);
+		c->server_sock = -1;
+		
+		//we can still get the response ourselves
+		{
+			char uri[strlen(c->flight->uri)+1];
+			
+			strcpy(uri, c->flight->uri);
+			ev_drop_flight(c);
+			ev_fetch(w, c, uri);
+		}
+		return;
+	}
+	ev_follow(w, c);
+}
+
+//sends as much more of the followed download as has been written and the client will take, see send_inflight_response
+void ev_follow(ev_worker *w, ev_conn *c) {
+	int done, complete, n;
+	long progress;
+	ssize_t sent;
+	
+	progress = inflight_wait(c->flight, 0, 0, &done, &complete);
+	
+	//body_off stays 0 until the head has been read, since the file starts with the uri line
+	if(c->body_off == 0) {
+		c->chunking = c->keep_alive && strcmp(c->req.buf + c->req.version, "HTTP/1.1") == 0;
+		c->chunk_left = 0;
+		n = inflight_head(c->flight, progress, done, complete, c->out, EV_OUTSIZE, &c->keep_alive, &c->chunking, &c->body_off);
+		if(n == -1) return;
+		if(n == -2) {
+			//nothing can be sent from the leader's download, see send_inflight_response. look in the cache
+			//again, and failing that get the response ourselves
+			char uri[strlen(c->flight->uri)+1];
+			unsigned long hash = c->flight->hash;
+			cache_object *cache_file;
+			
+			strcpy(uri, c->flight->uri);
+			ev_drop_flight(c);
+			ev_watch(w, c->client_sock, &c->client_h, 0);
+			if((cache_file = find(hash, uri, w->timeout, &c->req)) != NULL) ev_send_cached(w, c, uri, hash, cache_file);
+			else ev_fetch(w, c, uri);
+			return;
+		}
+		c->out_off = 0;
+		c->out_len = n;
+	}
+	
+	n = ev_flush(c);
+	while(n > 0 && c->body_off < progress) {
+		//a body sent chunked gets a chunk for each stretch of it the leader has written, see send_inflight_response
+		if(c->chunking && c->chunk_left == 0) {
+			c->chunk_left = progress - c->body_off;
+			c->out_off = 0;
+			c->out_len = sprintf(c->out, "%lx\r\n", c->chunk_left);
+			n = ev_flush(c);
+			continue;
+		}
+		sent = sendfile(c->client_sock, c->flight->fd, &c->body_off, c->chunking ? c->chunk_left : progress - c->body_off);
+		if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) n = 0;
+		else if(sent <= 0) n = -1;
+		else {
+			client_sent(sent);
+			if(c->chunking && (c->chunk_left -= sent) == 0) {
+				c->out_off = 0;
+				c->out_len = sprintf(c->out, "\r\n");
+				n = ev_flush(c);
+			}
+		}
+	}
+	if(n < 0) {
+		ev_close(c);
+		return;
+	}
+	c->client_behind = n == 0;
+	if(n == 0) {
+		ev_watch(w, c->client_sock, &c->client_h, EPOLLOUT);
+		return;
+	}
+	
+	//caught up with the leader, wait for it to write more
+	ev_watch(w, c->client_sock, &c->client_h, 0);
+	if(!done) return;
+	
+	//a download cut short leaves this client's response cut short as well
+	if(!complete) c->keep_alive = 0;
+	else if(c->chunking) {
+		c->out_off = 0;
+		c->out_len = sprintf(c->out, "0\r\n\r\n");
+	}
+	ev_drop_flight(c);
+	ev_response_done(w, c);
+}
+
+//lets go of the download this connection leads or follows. a lead download that is dropped
+//here never made it into the cache
+void ev_drop_flight(ev_conn *c) {
+	if(c->flight == NULL) return;
+	
+	if(c->leading) inflight_finish(c->flight, 0);
+	else {
+		//the eventfd is shared, so closing our duplicate alone would not take it out of epoll
+		epoll_ctl(c->epfd, EPOLL_CTL_DEL, c->server_sock, NULL);
+		close(c->server_sock);
+		c->server_sock = -1;
+		inflight_release(c->flight);
+	}
+	c->flight = NULL;
+	c->leading = 0;
+}
+
+//looks up the server, watching for a resolver thread to finish if the dns cache can't answer straight away
+void ev_connect(ev_worker *w, ev_conn *c) {
+	char host[ORIGIN_SIZE];
+	struct epoll_event ev;
+	int err;
+	
+	err = origin_split(c->origin, host, &c->port);
+	if(err!=0) {
+		ev_send_error(w, c, err, NULL);
+		return;
+	}
+	
+	c->lookup = dns_start(host, &c->addrs, &c->server_sock);
+	if(c->lookup) {
+		c->state = EV_RESOLVING;
+		ev.events = EPOLLIN;
+		ev.data.ptr = &c->server_h;
+		if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->server_sock, &ev) < 0) {
+			perror("watching dns lookup");
+			ev_close(c);
+		}
+		return;
+	}
+	ev_resolved(w, c);
+}
+
+//the server's addresses are in c->addrs, or the error that stopped them being found. starts racing connects to them
+void ev_resolved(ev_worker *w, ev_conn *c) {
+	struct epoll_event ev;
+	int err;
+	
+	if(c->lookup) {
+		dns_finish(c->lookup, &c->addrs);
+		c->lookup = NULL;
+		epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->server_sock, NULL);
+		close(c->server_sock);
+		c->server_sock = -1;
+	}
+	
+	if(c->addrs.status!=0) {
+		ev_send_error(w, c, c->addrs.status, NULL);
+		return;
+	}
+	
+	c->race = malloc(sizeof(connect_race));
+	if(c->race == NULL) {
+		perror("malloc for connect race");
+		ev_close(c);
+		return;
+	}
+	err = race_start(c->race, &c->addrs, c->port);
+	if(err!=0) {
+		free(c->race);
+		c->race = NULL;
+		ev_send_error(w, c, err, NULL);
+		return;
+	}
+	
+	//the race's timer is watched through the server handle as well, since both mean the race has moved on
+	c->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	ev.events = EPOLLIN;
+	ev.data.ptr = &c->server_h;
+	if(c->timer_fd < 0 || epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->timer_fd, &ev) < 0) {
+		perror("setting up connect timer");
+		ev_close(c);
+		return;
+	}
+	c->state = EV_CONNECTING;
+	ev_race(w, c);
+}
+
+//moves the connect race on when one of its attempts or its timer is ready, watching any attempts it starts and
+//arming the timer for its next step. returns 1 once it is won and the request can be sent, 0 otherwise
+int ev_race(ev_worker *w, ev_conn *c) {
+	struct itimerspec timer;
+	struct epoll_event ev;
+	unsigned long expirations;
+	int err, wait, i;
+	
+	if(read(c->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) perror("reading connect timer");
+	err = race_step(c->race, &c->server_sock);
+	if(err == 0) {
+		//the winner is already watched for writability, which is what sending the request waits on
+		ev_race_end(c);
+		c->state = EV_SEND_REQUEST;
+		return 1;
+	}
+	if(err != -1) {
+		ev_race_end(c);
+		ev_send_error(w, c, err, NULL);
+		return 0;
+	}
+	
+	for(i = 0; i < c->race->nattempts; i++) {
+		if(c->race->watched[i]) continue;
+		ev.events = EPOLLOUT;
+		ev.data.ptr = &c->server_h;
+		if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->race->attempts[i].fd, &ev) < 0) perror("watching server socket");
+		c->race->watched[i] = 1;
+	}
+	
+	//an all-zero time disarms a timerfd, so a wait that is already over becomes a nanosecond
+	wait = race_wait(c->race);
+	memset(&timer, 0, sizeof(timer));
+	timer.it_value.tv_sec = wait / 1000;
+	timer.it_value.tv_nsec = (wait % 1000) * 1000000L + (wait == 0);
+	if(timerfd_settime(c->timer_fd, 0, &timer, NULL) < 0) perror("arming connect timer");
+	return 0;
+}
+
+//closes the losing attempts of a race and its timer, which also takes them out of epoll
+void ev_race_end(ev_conn *c) {
+	race_abandon(c->race);
+	free(c->race);
+	c->race = NULL;
+	if(close(c->timer_fd) < 0) perror("closing connect timer");
+}
+
+//called once the response has been read from the server, or the server has gone away.
+//a complete response is kept in the cache, anything cut short is thrown away and ends the client's connection too
+void ev_finish_relay(ev_worker *w, ev_conn *c, int complete) {
+	//a spliced body may still be in the pipe on its way to the client, but it has all reached the cache file
+	if(c->splicing && c->cache_fp) splice_relay_finish_cache(&c->relay, c->cache_fp);
+	if(c->splicing && c->relay.cache_failed) c->caching_failed = 1;
+	
+	//the index has the finished entry before followers are let go, so later misses find it there
+	inflight_publish(c->flight, c->cache_fp);
+	if(c->cache_fp) close_cache_entry(c->cache_uri, c->cache_fp, c->cache_path, complete && c->cache_uri && !c->caching_failed, &c->meta);
+	if(c->flight) inflight_finish(c->flight, c->cache_fp && complete && c->cache_uri && !c->caching_failed);
+	c->flight = NULL;
+	c->leading = 0;
+	c->cache_fp = NULL;
+	c->caching = 0;
+	if(!complete) c->keep_alive = 0;
+	
+	ev_release_server(w, c);
+	
+	ev_response_done(w, c);
+}
+
+//puts the server connection back in the pool if the response left it clean, closes it otherwise
+void ev_release_server(ev_worker *w, ev_conn *c) {
+	if(c->framer.done && c->server_reusable) {
+		epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->server_sock, NULL);
+		pool_put(c->origin, c->server_sock);
+	}
+	else close(c->server_sock);
+	c->server_sock = -1;
+}
+
+//the whole response has been produced, finish writing it and then move on to the next request
+void ev_response_done(ev_worker *w, ev_conn *c) {
+	int n;
+	
+	if(c->state == EV_SEND_CACHED) {
+		if(c->hit) close_cache_object(c->hit);
+		if(c->ram) ram_release(c->ram);
+		c->hit = NULL;
+		c->ram = NULL;
+	}
+	c->state = EV_FLUSH;
+	
+	n = ev_flush(c);
+	if(n < 0 || (n > 0 && !c->keep_alive)) ev_close(c);
+	else if(n > 0) ev_next_request(w, c);
+	else ev_watch(w, c->client_sock, &c->client_h, EPOLLOUT);
+}
+
+//releases the buffers used for the last response and goes back to reading requests,
+//starting right away on any that were pipelined behind it
+void ev_next_request(ev_worker *w, ev_conn *c) {
+	access_finish(&c->access);
+	free(c->out);
+	free(c->forward);
+	free(c->head);
+	free(c->cache_uri);
+	c->out = c->head = c->cache_uri = NULL;
+	c->forward = NULL;
+	c->out_off = c->out_len = 0;
+	free(c->meta.vary);
+	c->meta.vary = NULL;
+	if(c->stale) close_cache_object(c->stale);
+	c->stale = NULL;
+	if(c->splicing) splice_relay_close(&c->relay);
+	c->splicing = c->caching_failed = 0;
+	ev_drop_flight(c);
+	
+	//drop the request just answered from in front of anything pipelined behind it
+	c->in_len -= c->req.head_len;
+	memmove(c->in, c->in + c->req.head_len, c->in_len);
+	request_init(&c->req, c->in);
+	
+	c->state = EV_READ_REQUEST;
+	ev_watch(w, c->client_sock, &c->client_h, EPOLLIN);
+	if(c->in_len > 0) ev_start_request(w, c);
+}
+
+//queues an error message for the client and closes once it has been written
+void ev_send_error(ev_worker *w, ev_conn *c, int err, char *version) {
+	ev_drop_flight(c);
+	c->out_off = 0;
+	c->out_len = format_error_message(c->out, err, version);
+	access_status(err);
+	c->keep_alive = 0;
+	c->state = EV_FLUSH;
+	
+	if(ev_flush(c) != 0) ev_close(c);
+	else ev_watch(w, c->client_sock, &c->client_h, EPOLLOUT);
+}
+
+//writes as much of the pending output as the client socket will take
+//returns 1 once everything is written, 0 if some is still pending, -1 on error
+int ev_flush(ev_conn *c) {
+	int n;
+	
+	//a client that has gone away takes everything, see ev_client_lost
+	if(c->client_sock < 0) {
+		c->out_len = 0;
+		return c->splicing && splice_relay_discard(&c->relay) < 0 ? -1 : 1;
+	}
+	
+	while(c->out_len > 0) {
+		n = send(c->client_sock, c->out + c->out_off, c->out_len, 0);
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		client_sent(n);
+		c->out_off += n;
+		c->out_len -= n;
+	}
+	
+	//a spliced body follows whatever was in the buffer
+	if(c->splicing) return splice_relay_drain(&c->relay, c->client_sock, SPLICE_F_NONBLOCK);
+	return 1;
+}
+
+//sends as much of a cached body as the client socket will take, with sendfile from a cache file
+//or directly out of a memory tier object. returns like ev_flush
+int ev_send_body(ev_conn *c) {
+	ssize_t n;
+	
+	while(c->body_left > 0) {
+		if(c->ram) n = send(c->client_sock, c->ram->data + c->body_off, c->body_left, 0);
+		else n = sendfile(c->client_sock, c->hit->fd, &c->body_off, c->body_left);
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			perror("sending cached body");
+			return -1;
+		}
+		if(n == 0) return -1;	//the cache file is shorter than it said
+		client_sent(n);
+		if(c->ram) c->body_off += n;
+		c->body_left -= n;
+	}
+	return 1;
+}
+
+//changes which events a descriptor already registered with the worker is watched for
+void ev_watch(ev_worker *w, int fd, ev_handle *h, uint32_t events) {
+	struct epoll_event ev;
+	
+	if(fd < 0) return;
+	ev.events = events;
+	ev.data.ptr = h;
+	if(epoll_ctl(w->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) perror("updating epoll interest");
+}
+
+//tears down a connection in any state, throwing away any cache file that was not finished
+void ev_close(ev_conn *c) {
+	ev_unlink(c);
+	access_finish(&c->access);
+	stat_add(STAT_CLOSED, 1);
+	if(c->cache_fp) fclose(c->cache_fp);
+	if(c->hit) close_cache_object(c->hit);
+	if(c->ram) ram_release(c->ram);
+	if(c->caching && c->cache_fp) remove(c->cache_path);
+	if(c->stale) close_cache_object(c->stale);
+	
+	if(c->splicing) splice_relay_close(&c->relay);
+	ev_drop_flight(c);
+	if(c->lookup) dns_release(c->lookup);
+	if(c->race) ev_race_end(c);
+	if(c->server_sock >= 0 && close(c->server_sock) < 0) perror("closing socket");
+	if(c->client_sock >= 0 && close(c->client_sock) < 0) perror("closing socket");
+	free(c->out);
+	free(c->forward);
+	free(c->head);
+	free(c->cache_uri);
+	free(c->meta.vary);
+	free(c);
+}
+
+//the client went away in the middle of a response. a download being cached is read to its end without it, since
+//followers and later hits are waiting on it, so only the client's socket is closed. anything else is torn down
+void ev_client_lost(ev_worker *w, ev_conn *c) {
+	if(c->cache_fp == NULL || c->client_sock < 0 || (c->splicing && splice_relay_discard(&c->relay) < 0)) {
+		ev_close(c);
+		return;
+	}
+	
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->client_sock, NULL);
+	if(close(c->client_sock) < 0) perror("closing socket");
+	c->client_sock = -1;
+	c->keep_alive = 0;
+	c->out_len = 0;
+	ev_touch(c);
+	
+	//the server may have been left unwatched while the client caught up
+	if(c->state == EV_RELAY) ev_watch(w, c->server_sock, &c->server_h, EPOLLIN);
 }